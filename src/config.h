@@ -16,8 +16,12 @@
  *
  * @param (buf_type_sv4l2 | buf_type_master) creates a master object.
  * @param buf_type_sv4l2 creates a slave object, it needs a master object as argument.
- * @param (buf_type_memory | buf_type_master) creates a master memory sharing.
- * @param buf_type_memory not yet supported.
+ * @param (buf_type_memory | buf_type_master) creates a master memory sharing,
+ * it accepts 3 arguments to receive the memory:
+ *  - int *nmem the number of buffers
+ *  - void ***mems a table of memory pointers to free
+ *  - size_t *size the size of each memory spaces
+ * @param buf_type_memory creates a slave object on the memory of the master:
  *  - int nmem the number of buffers
  *  - void *mems a table of memory pointers to use
  *  - size_t size the size of each memory spaces
@@ -35,6 +39,42 @@ enum buf_type_e
 	buf_type_master = 0x80,
 };
 
+/**
+ * @brief events reported by a device to the pipeline.
+ *
+ * @param event_type_eos the device doesn't send frames anymore.
+ * @param event_type_sourcechange the definition of the device changed,
+ * the buffers must be requested again.
+ * @param event_type_framesync the sensor started a new frame.
+ * @param event_type_control a control changed its value.
+ */
+enum event_type_e
+{
+	event_type_none = 0,
+	event_type_eos = 0x01,
+	event_type_sourcechange = 0x02,
+	event_type_framesync = 0x04,
+	event_type_control = 0x08,
+};
+
+/**
+ * a format supported by a device, used to negotiate the links.
+ * fourcc is 0 when the device accepts any format (raw files),
+ * maxwidth and maxheight are 0 when the device accepts any size.
+ * A discrete size has min == max.
+ */
+typedef struct DeviceFormat_s DeviceFormat_t;
+struct DeviceFormat_s
+{
+	uint32_t fourcc;
+	uint32_t minwidth;
+	uint32_t maxwidth;
+	uint32_t stepwidth;
+	uint32_t minheight;
+	uint32_t maxheight;
+	uint32_t stepheight;
+};
+
 typedef struct DeviceConf_s DeviceConf_t;
 struct DeviceConf_s
 {
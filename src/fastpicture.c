@@ -5,25 +5,88 @@
 #include <string.h>
 #include <errno.h>
 
+#include <linux/videodev2.h>
+
 #include "log.h"
 #include "sv4l2.h"
 #include "sfile.h"
+#include "sclock.h"
 #include "config.h"
 
-int main_loop(V4L2_t *cam, File_t *file)
+#define STABLE_FRAMES 2
+#define STABLE_MAXFRAMES 30
+
+#define EXPOSURE_NCONTROLS 4
+
+static const int exposure_ids[EXPOSURE_NCONTROLS] = {
+	V4L2_CID_EXPOSURE_ABSOLUTE,
+	V4L2_CID_EXPOSURE,
+	V4L2_CID_ANALOGUE_GAIN,
+	V4L2_CID_GAIN,
+};
+
+static int exposure_findcontrol(void *arg, struct v4l2_queryctrl *ctrl, V4L2_t *dev)
+{
+	int *available = (int *)arg;
+	for (int i = 0; i < EXPOSURE_NCONTROLS; i++)
+	{
+		if (exposure_ids[i] != ctrl->id)
+			continue;
+		dbg("fastpicture: exposure control %s", ctrl->name);
+		available[i] = 1;
+	}
+	return 0;
+}
+
+/**
+ * the exposure is stable when the controls of the auto exposure keep
+ * their values between two frames. Only the controls of the device are
+ * read, they are listed once before the capture.
+ */
+static int exposure_changed(V4L2_t *cam, const int available[EXPOSURE_NCONTROLS], intptr_t values[EXPOSURE_NCONTROLS])
+{
+	int nvalues = 0;
+	int changed = 0;
+	for (int i = 0; i < EXPOSURE_NCONTROLS; i++)
+	{
+		if (!available[i])
+			continue;
+		intptr_t value = (intptr_t)sv4l2_control(cam, exposure_ids[i], (void *)-1);
+		if (value == -1)
+			continue;
+		nvalues++;
+		if (value != values[i])
+			changed = 1;
+		values[i] = value;
+	}
+	return (nvalues > 0)? changed: -1;
+}
+
+int main_loop(V4L2_t *cam, File_t *file, int warmup, int stable, uint64_t start)
 {
 	int run = 1;
 	sv4l2_start(cam);
 	sfile_start(file);
 	int camfd = sv4l2_fd(cam);
-	int filefd = sfile_fd(file);
 	int maxfd = camfd;
+	int nframes = 0;
+	int nstables = 0;
+	intptr_t values[EXPOSURE_NCONTROLS] = {-1, -1, -1, -1};
+	int available[EXPOSURE_NCONTROLS] = {0};
+	if (stable)
+	{
+		sv4l2_treecontrols(cam, exposure_findcontrol, available);
+		int ncontrols = 0;
+		for (int i = 0; i < EXPOSURE_NCONTROLS; i++)
+			ncontrols += available[i];
+		if (ncontrols == 0)
+			dbg("fastpicture: no exposure control, only the warmup frames are dropped");
+	}
+	uint64_t first = 0;
 	while (run)
 	{
 		fd_set rfds;
-		fd_set wfds;
 		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
 		FD_SET(camfd, &rfds);
 		struct timeval timeout = {
 			.tv_sec = 2,
@@ -31,7 +94,7 @@ int main_loop(V4L2_t *cam, File_t *file)
 		};
 		int ret;
 
-		ret = select(maxfd + 1, &rfds, &wfds, NULL, &timeout);
+		ret = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
 		if (ret == -1 && errno == EINTR)
 			continue;
 		if (ret == 0)
@@ -51,7 +114,36 @@ int main_loop(V4L2_t *cam, File_t *file)
 				run = 0;
 				break;
 			}
+			if (nframes++ == 0)
+				first = sclock_now();
 
+			/// the first frames are given back until the exposure converges
+			int keep = (nframes > warmup);
+			if (keep && stable)
+			{
+				int changed = exposure_changed(cam, available, values);
+				if (changed > 0)
+					nstables = 0;
+				else if (changed == 0)
+					nstables++;
+				keep = (changed < 0) || (nstables >= STABLE_FRAMES);
+				if (!keep && nframes > warmup + STABLE_MAXFRAMES)
+				{
+					warn("fastpicture: exposure not stable after %d frames", nframes);
+					keep = 1;
+				}
+			}
+			if (!keep)
+			{
+				if (sv4l2_queue(cam, index, 0) < 0)
+				{
+					err("camera buffer queuing error %m");
+					run = 0;
+				}
+				continue;
+			}
+
+			sfile_stamp(file, index, sv4l2_timestamp(cam, index), sv4l2_sequence(cam, index));
 			if (sfile_queue(file, index, bytesused) < 0)
 			{
 				err("file buffer queuing error %m");
@@ -68,15 +160,10 @@ int main_loop(V4L2_t *cam, File_t *file)
 				run = 0;
 				break;
 			}
-			if (sv4l2_queue(cam, index, 0) < 0)
-			{
-				err("camera buffer queuing error %m");
-				if (errno == EAGAIN)
-					continue;
-				run = 0;
-				break;
-			}
-			ret--;
+			uint64_t end = sclock_now();
+			warn("fastpicture: first frame after %llu ms, file after %llu ms, %d frames",
+				(unsigned long long)(first - start) / 1000000,
+				(unsigned long long)(end - start) / 1000000, nframes);
 			run = 0; //one shot only
 		}
 	}
@@ -90,6 +177,9 @@ int main(int argc, char * const argv[])
 	const char *configfile = NULL;
 	const char *input = "cam";
 	const char *output = "file:screem.unkown";
+	int warmup = 0;
+	int stable = 0;
+	uint64_t start = sclock_now();
 
 	CameraConfig_t CAMERACONFIG(inconfig, "/dev/video0");
 
@@ -98,7 +188,7 @@ int main(int argc, char * const argv[])
 	int opt;
 	do
 	{
-		opt = getopt(argc, argv, "i:o:j:w:h:");
+		opt = getopt(argc, argv, "i:o:j:w:h:n:b:S");
 		switch (opt)
 		{
 			case 'i':
@@ -116,6 +206,15 @@ int main(int argc, char * const argv[])
 			case 'h':
 				inconfig.parent.height = strtol(optarg, NULL, 10);
 			break;
+			case 'n':
+				warmup = strtol(optarg, NULL, 10);
+			break;
+			case 'b':
+				inconfig.nbuffers = strtol(optarg, NULL, 10);
+			break;
+			case 'S':
+				stable = 1;
+			break;
 		}
 	} while(opt != -1);
 
@@ -147,20 +246,23 @@ int main(int argc, char * const argv[])
 	if (sv4l2_loadsettings && inconfig.parent.entry)
 		sv4l2_loadsettings(cam, inconfig.parent.entry);
 
-	int *dma_bufs = {0};
+	/// the file is written from the CPU, the camera fills an arena of user memory
+	void **mems = NULL;
 	size_t size = 0;
 	int nbbufs = 0;
-	if (sv4l2_requestbuffer(cam, buf_type_dmabuf | buf_type_master, &nbbufs, &dma_bufs, &size, NULL) < 0)
+	if (sv4l2_requestbuffer(cam, buf_type_memory | buf_type_master, &nbbufs, &mems, &size, NULL) < 0)
 	{
-		err("camera dma buffer not allowed");
+		err("camera memory buffer not allowed");
 		return -1;
 	}
-	if (sfile_requestbuffer(file, buf_type_dmabuf, nbbufs, dma_bufs, size, NULL) < 0)
+	if (sfile_requestbuffer(file, buf_type_memory, nbbufs, mems, size, NULL) < 0)
 	{
-		err("file dma buffers not linked");
+		err("file memory buffers not linked");
+		free(mems);
 		return -1;
 	}
-	main_loop(cam, file);
+	free(mems);
+	main_loop(cam, file, warmup, stable, start);
 
 	sv4l2_destroy(cam);
 	sfile_destroy(file);
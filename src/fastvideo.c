@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 
 #include "log.h"
@@ -12,21 +15,45 @@
 #include "sdrm.h"
 #include "segl.h"
 #include "sfile.h"
+#ifdef HAVE_LIBJPEG
+#include "smjpeg.h"
+#endif
+#include "sclock.h"
 #include "config.h"
 
 #define MODE_DAEMONIZE 0x01
 
+#define SNAPSHOT_IDLE 0
+#define SNAPSHOT_ARMED 1
+#define SNAPSHOT_SELECTED 2
+#define SNAPSHOT_WRITING 3
+
 typedef DeviceConf_t * (*FastVideoDevice_createconfig_t)(void);
 typedef void *(*FastVideoDevice_create_t)(const char *devicename, DeviceConf_t *config);
 typedef void *(*FastVideoDevice_loadsettings_t)(void *dev, void *configentry);
 typedef int (*FastVideoDevice_requestbuffer_t)(void *dev, enum buf_type_e t, ...);
 typedef int (*FastVideoDevice_eventfd_t)(void *dev);
+typedef int (*FastVideoDevice_event_t)(void *dev);
 typedef int (*FastVideoDevice_start_t)(void *dev);
 typedef int (*FastVideoDevice_stop_t)(void *dev);
 typedef int (*FastVideoDevice_dequeue_t)(void *dev, void **mem, size_t *bytesused);
 typedef int (*FastVideoDevice_queue_t)(void *dev, int index, size_t bytesused);
 typedef void (*FastVideoDevice_destroy_t)(void *dev);
+typedef int (*FastVideoDevice_formats_t)(void *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg);
+typedef int (*FastVideoDevice_setformat_t)(void *dev, uint32_t fourcc, uint32_t width, uint32_t height);
+typedef uint64_t (*FastVideoDevice_timestamp_t)(void *dev, int index);
+typedef uint32_t (*FastVideoDevice_sequence_t)(void *dev, int index);
+typedef int (*FastVideoDevice_stamp_t)(void *dev, int index, uint64_t timestamp, uint32_t sequence);
+typedef int (*FastVideoDevice_trigger_t)(void *dev);
+typedef void *(*FastVideoDevice_sink_t)(void *dev);
+typedef DeviceConf_t *(*FastVideoDevice_config_t)(void *dev);
 
+/**
+ * a transform (-m) gives its sink with the sink function, the sink
+ * is driven by sinkops and its configuration comes from config.
+ * A sink with stamp receives the timestamp and the sequence of the
+ * frames of a source with sequence, before their queuing.
+ */
 typedef struct FastVideoDevice_ops_s FastVideoDevice_ops_t;
 struct FastVideoDevice_ops_s
 {
@@ -36,11 +63,21 @@ struct FastVideoDevice_ops_s
 	FastVideoDevice_loadsettings_t loadsettings;
 	FastVideoDevice_requestbuffer_t requestbuffer;
 	FastVideoDevice_eventfd_t eventfd;
+	FastVideoDevice_event_t event;
 	FastVideoDevice_start_t start;
 	FastVideoDevice_stop_t stop;
 	FastVideoDevice_dequeue_t dequeue;
 	FastVideoDevice_queue_t queue;
 	FastVideoDevice_destroy_t destroy;
+	FastVideoDevice_formats_t formats;
+	FastVideoDevice_setformat_t setformat;
+	FastVideoDevice_timestamp_t timestamp;
+	FastVideoDevice_sequence_t sequence;
+	FastVideoDevice_stamp_t stamp;
+	FastVideoDevice_trigger_t trigger;
+	FastVideoDevice_sink_t sink;
+	FastVideoDevice_ops_t *sinkops;
+	FastVideoDevice_config_t config;
 };
 
 FastVideoDevice_ops_t sv4l2_ops = {
@@ -50,12 +87,60 @@ FastVideoDevice_ops_t sv4l2_ops = {
 	.loadsettings = (FastVideoDevice_loadsettings_t)sv4l2_loadsettings,
 	.requestbuffer = (FastVideoDevice_requestbuffer_t)sv4l2_requestbuffer,
 	.eventfd = (FastVideoDevice_eventfd_t)sv4l2_fd,
+	.event = (FastVideoDevice_event_t)sv4l2_event,
 	.start = (FastVideoDevice_start_t)sv4l2_start,
 	.stop = (FastVideoDevice_stop_t)sv4l2_stop,
 	.dequeue = (FastVideoDevice_dequeue_t)sv4l2_dequeue,
 	.queue = (FastVideoDevice_queue_t)sv4l2_queue,
 	.destroy = (FastVideoDevice_destroy_t)sv4l2_destroy,
+	.formats = (FastVideoDevice_formats_t)sv4l2_formats,
+	.setformat = (FastVideoDevice_setformat_t)sv4l2_setformat,
+	.timestamp = (FastVideoDevice_timestamp_t)sv4l2_timestamp,
+	.sequence = (FastVideoDevice_sequence_t)sv4l2_sequence,
+	.config = (FastVideoDevice_config_t)sv4l2_config,
 };
+FastVideoDevice_ops_t sv4l2_m2m_ops = {
+	.name = "m2m",
+	.createconfig = sv4l2_createconfig,
+	.create = (FastVideoDevice_create_t)sv4l2_m2m_create,
+	.loadsettings = (FastVideoDevice_loadsettings_t)sv4l2_loadsettings,
+	.requestbuffer = (FastVideoDevice_requestbuffer_t)sv4l2_requestbuffer,
+	.eventfd = (FastVideoDevice_eventfd_t)sv4l2_fd,
+	.event = (FastVideoDevice_event_t)sv4l2_event,
+	.start = (FastVideoDevice_start_t)sv4l2_start,
+	.stop = (FastVideoDevice_stop_t)sv4l2_stop,
+	.dequeue = (FastVideoDevice_dequeue_t)sv4l2_dequeue,
+	.queue = (FastVideoDevice_queue_t)sv4l2_queue,
+	.destroy = (FastVideoDevice_destroy_t)sv4l2_destroy,
+	.formats = (FastVideoDevice_formats_t)sv4l2_formats,
+	.setformat = (FastVideoDevice_setformat_t)sv4l2_setformat,
+	.timestamp = (FastVideoDevice_timestamp_t)sv4l2_timestamp,
+	.sequence = (FastVideoDevice_sequence_t)sv4l2_sequence,
+	.sink = (FastVideoDevice_sink_t)sv4l2_m2m_output,
+	.sinkops = &sv4l2_ops,
+	.config = (FastVideoDevice_config_t)sv4l2_config,
+};
+#ifdef HAVE_LIBJPEG
+FastVideoDevice_ops_t smjpeg_ops = {
+	.name = "mjpeg",
+	.createconfig = smjpeg_createconfig,
+	.create = (FastVideoDevice_create_t)smjpeg_create,
+	.loadsettings = (FastVideoDevice_loadsettings_t)NULL,
+	.requestbuffer = (FastVideoDevice_requestbuffer_t)smjpeg_requestbuffer,
+	.eventfd = (FastVideoDevice_eventfd_t)smjpeg_eventfd,
+	.start = (FastVideoDevice_start_t)smjpeg_start,
+	.stop = (FastVideoDevice_stop_t)smjpeg_stop,
+	.dequeue = (FastVideoDevice_dequeue_t)smjpeg_dequeue,
+	.queue = (FastVideoDevice_queue_t)smjpeg_queue,
+	.destroy = (FastVideoDevice_destroy_t)smjpeg_destroy,
+	.formats = (FastVideoDevice_formats_t)smjpeg_formats,
+	.setformat = (FastVideoDevice_setformat_t)smjpeg_setformat,
+	.timestamp = (FastVideoDevice_timestamp_t)smjpeg_timestamp,
+	.sink = (FastVideoDevice_sink_t)smjpeg_sink,
+	.sinkops = &smjpeg_ops,
+	.config = (FastVideoDevice_config_t)smjpeg_config,
+};
+#endif
 #ifdef HAVE_EGL
 FastVideoDevice_ops_t segl_ops = {
 	.name = "gpu",
@@ -69,6 +154,8 @@ FastVideoDevice_ops_t segl_ops = {
 	.dequeue = (FastVideoDevice_dequeue_t)segl_dequeue,
 	.queue = (FastVideoDevice_queue_t)segl_queue,
 	.destroy = (FastVideoDevice_destroy_t)segl_destroy,
+	.formats = (FastVideoDevice_formats_t)segl_formats,
+	.setformat = (FastVideoDevice_setformat_t)segl_setformat,
 };
 #endif
 #ifdef HAVE_LIBDRM
@@ -84,6 +171,9 @@ FastVideoDevice_ops_t sdrm_ops = {
 	.dequeue = (FastVideoDevice_dequeue_t)sdrm_dequeue,
 	.queue = (FastVideoDevice_queue_t)sdrm_queue,
 	.destroy = (FastVideoDevice_destroy_t)sdrm_destroy,
+	.formats = (FastVideoDevice_formats_t)sdrm_formats,
+	.setformat = (FastVideoDevice_setformat_t)sdrm_setformat,
+	.timestamp = (FastVideoDevice_timestamp_t)sdrm_timestamp,
 };
 #endif
 FastVideoDevice_ops_t sfile_ops = {
@@ -92,12 +182,15 @@ FastVideoDevice_ops_t sfile_ops = {
 	.create = (FastVideoDevice_create_t)sfile_create,
 	.loadsettings = (FastVideoDevice_loadsettings_t)NULL,
 	.requestbuffer = (FastVideoDevice_requestbuffer_t)sfile_requestbuffer,
-	.eventfd = (FastVideoDevice_eventfd_t)NULL,
+	.eventfd = (FastVideoDevice_eventfd_t)sfile_eventfd,
 	.start = (FastVideoDevice_start_t)sfile_start,
 	.stop = (FastVideoDevice_stop_t)sfile_stop,
 	.dequeue = (FastVideoDevice_dequeue_t)sfile_dequeue,
 	.queue = (FastVideoDevice_queue_t)sfile_queue,
 	.destroy = (FastVideoDevice_destroy_t)sfile_destroy,
+	.timestamp = (FastVideoDevice_timestamp_t)sfile_timestamp,
+	.stamp = (FastVideoDevice_stamp_t)sfile_stamp,
+	.trigger = (FastVideoDevice_trigger_t)sfile_trigger,
 };
 
 typedef struct FastVideoDevice_s FastVideoDevice_t;
@@ -108,6 +201,51 @@ struct FastVideoDevice_s
 	FastVideoDevice_ops_t *ops;
 };
 
+/**
+ * a link moves the buffers from the input device to the output device
+ * and gives them back to the input device when the output releases them.
+ * A m2m device is the output of a link and the input of the next one.
+ * The latency is the time between the input timestamp and the output
+ * timestamp of the same buffer, when both devices give them.
+ */
+typedef struct FastVideoSnapshot_s FastVideoSnapshot_t;
+typedef struct FastVideoLink_s FastVideoLink_t;
+struct FastVideoLink_s
+{
+	FastVideoDevice_t *input;
+	FastVideoDevice_t *output;
+	int infd;
+	int outfd;
+	DeviceConf_t request;
+	uint64_t latency;
+	uint32_t nlatencies;
+	int *dma_bufs;
+	int nbufs;
+	size_t size;
+	FastVideoSnapshot_t *snapshot;
+};
+
+/**
+ * a snapshot keeps a frame of the camera out of the pipeline after
+ * its display, the time for a thread to write it into a file.
+ * The commands come from a fifo, one per line:
+ *  snapshot <path> [<timestamp in ns>]
+ *  trigger
+ * The trigger starts the recording of the outputs with a pre trigger memory.
+ */
+struct FastVideoSnapshot_s
+{
+	int cmdfd;
+	int done[2];
+	int state;
+	char path[256];
+	uint64_t timestamp;
+	int index;
+	size_t bytesused;
+	FastVideoLink_t *link;
+	pthread_t thread;
+};
+
 FastVideoDevice_t *config_createdevice(const char *name, const char *configfile, FastVideoDevice_ops_t *ops[])
 {
 	FastVideoDevice_t *device = NULL;
@@ -164,50 +302,614 @@ int choice_config(DeviceConf_t *inconfig, DeviceConf_t *outconfig)
 	return 0;
 }
 
-int main_loop(FastVideoDevice_t *input, FastVideoDevice_t *output)
+/// the mjpeg transform and the V4L2 decoders decode the compressed frames, a container or a JPEG file stores them
+static int main_compressed(FastVideoDevice_t *sink, const char *name)
 {
-	output->ops->start(output->dev);
-	input->ops->start(input->dev);
-	int maxfd = 0;
-	int infd = -1;
-	if (input->ops->eventfd)
+#ifdef HAVE_LIBJPEG
+	if (sink->ops == &smjpeg_ops)
+		return 1;
+#endif
+	if (sink->ops == &sfile_ops)
+		return sfile_compressed(name, (FileConfig_t *)sink->config);
+	return sink->ops == &sv4l2_m2m_ops;
+}
+
+static void main_request(DeviceConf_t *request, DeviceConf_t *first, DeviceConf_t *second)
+{
+	request->fourcc = first->fourcc;
+	request->width = first->width;
+	request->height = first->height;
+	if (second == NULL)
+		return;
+	if (request->fourcc == 0)
+		request->fourcc = second->fourcc;
+	if (request->width == 0)
+		request->width = second->width;
+	if (request->height == 0)
+		request->height = second->height;
+}
+
+static uint32_t fourcc_bpp(uint32_t fourcc)
+{
+	static const struct
+	{
+		uint32_t fourcc;
+		uint32_t bpp;
+	} table[] = {
+		{FOURCC('G','R','E','Y'), 8},
+		{FOURCC('B','A','8','1'), 8},
+		{FOURCC('G','B','R','G'), 8},
+		{FOURCC('R','G','G','B'), 8},
+		{FOURCC('p','B','A','A'), 10},
+		{FOURCC('p','G','A','A'), 10},
+		{FOURCC('p','R','A','A'), 10},
+		{FOURCC('N','V','1','2'), 12},
+		{FOURCC('N','V','2','1'), 12},
+		{FOURCC('Y','U','1','2'), 12},
+		{FOURCC('Y','V','1','2'), 12},
+		{FOURCC('B','A','1','0'), 16},
+		{FOURCC('G','B','1','0'), 16},
+		{FOURCC('B','G','1','0'), 16},
+		{FOURCC('R','G','1','0'), 16},
+		{FOURCC('R','G','1','2'), 16},
+		{FOURCC('Y','U','Y','V'), 16},
+		{FOURCC('U','Y','V','Y'), 16},
+		{FOURCC('Y','V','Y','U'), 16},
+		{FOURCC('R','G','B','P'), 16},
+		{FOURCC('R','G','1','6'), 16},
+		{FOURCC('R','G','B','3'), 24},
+		{FOURCC('B','G','R','3'), 24},
+		{FOURCC('R','G','2','4'), 24},
+		{FOURCC('B','G','2','4'), 24},
+		/// the raw formats are preferred, the compressed ones are chosen on request
+		{FOURCC('M','J','P','G'), 64},
+		{FOURCC('J','P','E','G'), 64},
+		{FOURCC('H','2','6','4'), 64},
+	};
+	for (int i = 0; i < sizeof(table) / sizeof(*table); i++)
+	{
+		if (table[i].fourcc == fourcc)
+			return table[i].bpp;
+	}
+	return 32;
+}
+
+typedef struct FastVideoFormats_s FastVideoFormats_t;
+struct FastVideoFormats_s
+{
+	DeviceFormat_t *formats;
+	int nformats;
+};
+
+static int negotiate_collect(void *arg, DeviceFormat_t *format)
+{
+	FastVideoFormats_t *list = (FastVideoFormats_t *)arg;
+	list->formats = realloc(list->formats, (list->nformats + 1) * sizeof(*list->formats));
+	memcpy(&list->formats[list->nformats], format, sizeof(*format));
+	list->nformats++;
+	return 0;
+}
+
+static int negotiate_fit(uint32_t value, uint32_t min, uint32_t max, uint32_t step)
+{
+	if (max == 0)
+		return 1;
+	if (value < min || value > max)
+		return 0;
+	return step < 2 || ((value - min) % step) == 0;
+}
+
+/**
+ * select the nearest value of target accepted by the two ranges
+ */
+static int negotiate_dimension(uint32_t target,
+		uint32_t min1, uint32_t max1, uint32_t step1,
+		uint32_t min2, uint32_t max2, uint32_t step2, uint32_t *value)
+{
+	uint32_t low = (min1 > min2)? min1: min2;
+	uint32_t high = UINT32_MAX;
+	if (max1 && max1 < high)
+		high = max1;
+	if (max2 && max2 < high)
+		high = max2;
+	if (low > high)
+		return -1;
+	uint32_t start = target;
+	if (start < low)
+		start = low;
+	if (start > high)
+		start = high;
+	uint32_t window = ((step1 > 1)? step1: 1) * ((step2 > 1)? step2: 1);
+	for (uint32_t delta = 0; delta <= window; delta++)
+	{
+		if (start >= low + delta &&
+			negotiate_fit(start - delta, min1, max1, step1) &&
+			negotiate_fit(start - delta, min2, max2, step2))
+		{
+			*value = start - delta;
+			return 0;
+		}
+		if (start + delta <= high &&
+			negotiate_fit(start + delta, min1, max1, step1) &&
+			negotiate_fit(start + delta, min2, max2, step2))
+		{
+			*value = start + delta;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * choose the format shared by the two sides of the link, without conversion.
+ * A null fourcc accepts any format of the other side.
+ * The candidates are ordered by:
+ *  - the fourcc requested by the configuration,
+ *  - the distance to the requested size,
+ *  - the bandwidth of the frames.
+ */
+static int main_negotiate(FastVideoLink_t *link)
+{
+	FastVideoDevice_t *input = link->input;
+	FastVideoDevice_t *output = link->output;
+	if (input->ops->formats == NULL || output->ops->formats == NULL)
+	{
+		choice_config(input->config, output->config);
+		return 0;
+	}
+	FastVideoFormats_t inlist = {0};
+	FastVideoFormats_t outlist = {0};
+	input->ops->formats(input->dev, negotiate_collect, &inlist);
+	output->ops->formats(output->dev, negotiate_collect, &outlist);
+
+	uint32_t targetwidth = link->request.width? link->request.width: input->config->width;
+	uint32_t targetheight = link->request.height? link->request.height: input->config->height;
+	/// without request, the default size of choice_config
+	if (targetwidth == 0)
+		targetwidth = 640;
+	if (targetheight == 0)
+		targetheight = 480;
+	struct
+	{
+		uint32_t fourcc;
+		uint32_t width;
+		uint32_t height;
+		int other;
+		uint64_t distance;
+		uint64_t bandwidth;
+	} best = {0}, candidate;
+	int found = 0;
+	for (int i = 0; i < inlist.nformats; i++)
+	{
+		DeviceFormat_t *in = &inlist.formats[i];
+		for (int j = 0; j < outlist.nformats; j++)
+		{
+			DeviceFormat_t *out = &outlist.formats[j];
+			if (in->fourcc && out->fourcc && in->fourcc != out->fourcc)
+				continue;
+			candidate.fourcc = in->fourcc? in->fourcc: out->fourcc;
+			if (candidate.fourcc == 0)
+				candidate.fourcc = link->request.fourcc;
+			if (candidate.fourcc == 0)
+				continue;
+			if (negotiate_dimension(targetwidth, in->minwidth, in->maxwidth, in->stepwidth,
+					out->minwidth, out->maxwidth, out->stepwidth, &candidate.width) ||
+				negotiate_dimension(targetheight, in->minheight, in->maxheight, in->stepheight,
+					out->minheight, out->maxheight, out->stepheight, &candidate.height))
+				continue;
+			candidate.other = link->request.fourcc && link->request.fourcc != candidate.fourcc;
+			candidate.distance = (uint64_t)abs((int)candidate.width - (int)targetwidth) +
+						abs((int)candidate.height - (int)targetheight);
+			candidate.bandwidth = (uint64_t)candidate.width * candidate.height * fourcc_bpp(candidate.fourcc);
+			if (!found ||
+				candidate.other < best.other ||
+				(candidate.other == best.other && candidate.distance < best.distance) ||
+				(candidate.other == best.other && candidate.distance == best.distance &&
+					candidate.bandwidth < best.bandwidth))
+			{
+				memcpy(&best, &candidate, sizeof(best));
+				found = 1;
+			}
+		}
+	}
+	free(inlist.formats);
+	free(outlist.formats);
+	if (!found)
+	{
+		warn("fastvideo: %s => %s no common format, conversion required",
+			input->config->name, output->config->name);
+		choice_config(input->config, output->config);
+		return -1;
+	}
+	dbg("fastvideo: %s => %s negotiated %.4s %ux%u", input->config->name, output->config->name,
+		(char *)&best.fourcc, best.width, best.height);
+	if (input->ops->setformat &&
+		input->ops->setformat(input->dev, best.fourcc, best.width, best.height) < 0)
+		return -1;
+	/// the driver of the input may adjust the size
+	choice_config(input->config, output->config);
+	if (output->ops->setformat &&
+		output->ops->setformat(output->dev, input->config->fourcc, input->config->width, input->config->height) < 0)
+		return -1;
+	return 0;
+}
+
+static int main_linkbuffers(FastVideoLink_t *link)
+{
+	FastVideoDevice_t *input = link->input;
+	FastVideoDevice_t *output = link->output;
+	int *dma_bufs = {0};
+	size_t size = 0;
+	int nbbufs = 0;
+	if (input->ops->requestbuffer(input->dev, buf_type_dmabuf | buf_type_master, &nbbufs, &dma_bufs, &size, NULL) < 0)
+	{
+		err("input dma buffer not allowed");
+		return -1;
+	}
+	if (output->ops->requestbuffer(output->dev, buf_type_dmabuf, nbbufs, dma_bufs, size, NULL) < 0)
+	{
+		err("output dma buffers not linked");
+		free(dma_bufs);
+		return -1;
+	}
+	/// the snapshot writer reads the buffers of the link
+	free(link->dma_bufs);
+	link->dma_bufs = dma_bufs;
+	link->nbufs = nbbufs;
+	link->size = size;
+	return 0;
+}
+
+static void *main_snapshot_write(void *arg)
+{
+	FastVideoSnapshot_t *snapshot = arg;
+	FastVideoLink_t *link = snapshot->link;
+	FileConfig_t config = {0};
+	config.parent.name = snapshot->path;
+	config.parent.fourcc = link->input->config->fourcc;
+	config.parent.width = link->input->config->width;
+	config.parent.height = link->input->config->height;
+	config.parent.stride = link->input->config->stride;
+	config.filename = snapshot->path;
+	config.direction = File_Input_e;
+	File_t *file = sfile_create(snapshot->path, &config);
+	if (file != NULL)
+	{
+		int dma_buf = link->dma_bufs[snapshot->index];
+		if (sfile_requestbuffer(file, buf_type_dmabuf, 1, &dma_buf, link->size) == 0 &&
+			sfile_start(file) == 0 &&
+			sfile_queue(file, 0, snapshot->bytesused) == 0)
+			warn("fastvideo: snapshot %s written", snapshot->path);
+		sfile_stop(file);
+		sfile_destroy(file);
+	}
+	else
+		err("fastvideo: snapshot %s not available", snapshot->path);
+	if (write(snapshot->done[1], &snapshot->index, sizeof(snapshot->index)) != sizeof(snapshot->index))
+		err("fastvideo: snapshot release error %m, buffer %d not queued", snapshot->index);
+	return NULL;
+}
+
+static FastVideoSnapshot_t *main_snapshot_create(const char *fifo, FastVideoLink_t *link)
+{
+	if (mkfifo(fifo, 0660) && errno != EEXIST)
+	{
+		err("fastvideo: command fifo %s error %m", fifo);
+		return NULL;
+	}
+	/// the fifo is opened for writing too, to never see the end of file
+	int cmdfd = open(fifo, O_RDWR | O_NONBLOCK);
+	if (cmdfd < 0)
+	{
+		err("fastvideo: command fifo %s error %m", fifo);
+		return NULL;
+	}
+	FastVideoSnapshot_t *snapshot = calloc(1, sizeof(*snapshot));
+	snapshot->cmdfd = cmdfd;
+	snapshot->link = link;
+	snapshot->state = SNAPSHOT_IDLE;
+	if (pipe(snapshot->done))
+	{
+		err("fastvideo: snapshot pipe error %m");
+		close(cmdfd);
+		free(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+static int main_snapshot_command(FastVideoSnapshot_t *snapshot, FastVideoLink_t *links, int nlinks)
+{
+	char line[512];
+	ssize_t length = read(snapshot->cmdfd, line, sizeof(line) - 1);
+	if (length <= 0)
+		return 0;
+	line[length] = '\0';
+	for (char *command = strtok(line, "\n"); command != NULL; command = strtok(NULL, "\n"))
+	{
+		if (!strcmp(command, "trigger"))
+		{
+			for (int i = 0; i < nlinks; i++)
+			{
+				FastVideoDevice_t *output = links[i].output;
+				if (output->ops->trigger && output->ops->trigger(output->dev) == 0)
+					warn("fastvideo: %s triggered", output->config->name);
+			}
+			continue;
+		}
+		char path[sizeof(snapshot->path)];
+		unsigned long long timestamp = 0;
+		if (sscanf(command, "snapshot %255s %llu", path, &timestamp) < 1)
+		{
+			warn("fastvideo: unknown command \"%s\"", command);
+			continue;
+		}
+		if (snapshot->state != SNAPSHOT_IDLE)
+		{
+			warn("fastvideo: snapshot %s busy", snapshot->path);
+			continue;
+		}
+		strcpy(snapshot->path, path);
+		snapshot->timestamp = timestamp;
+		snapshot->state = SNAPSHOT_ARMED;
+	}
+	return 0;
+}
+
+/**
+ * the first frame after the requested time is selected on its arrival.
+ */
+static void main_snapshot_select(FastVideoSnapshot_t *snapshot, int index, size_t bytesused)
+{
+	FastVideoDevice_t *input = snapshot->link->input;
+	if (snapshot->state != SNAPSHOT_ARMED)
+		return;
+	if (snapshot->timestamp && input->ops->timestamp &&
+		input->ops->timestamp(input->dev, index) < snapshot->timestamp)
+		return;
+	snapshot->index = index;
+	snapshot->bytesused = bytesused;
+	snapshot->state = SNAPSHOT_SELECTED;
+}
+
+/**
+ * the selected frame goes to the writer instead of the input
+ */
+static int main_snapshot_hold(FastVideoSnapshot_t *snapshot, int index)
+{
+	if (snapshot->state != SNAPSHOT_SELECTED || snapshot->index != index)
+		return 0;
+	if (index >= snapshot->link->nbufs ||
+		pthread_create(&snapshot->thread, NULL, main_snapshot_write, snapshot))
+	{
+		err("fastvideo: snapshot not started");
+		snapshot->state = SNAPSHOT_IDLE;
+		return 0;
+	}
+	snapshot->state = SNAPSHOT_WRITING;
+	return 1;
+}
+
+static int main_snapshot_release(FastVideoSnapshot_t *snapshot)
+{
+	int index;
+	if (read(snapshot->done[0], &index, sizeof(index)) != sizeof(index))
+		return 0;
+	pthread_join(snapshot->thread, NULL);
+	snapshot->state = SNAPSHOT_IDLE;
+	FastVideoDevice_t *input = snapshot->link->input;
+	if (input->ops->queue(input->dev, index, 0) < 0 && errno != EAGAIN)
+	{
+		err("input buffer queuing error %m");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * the buffers of the link are going to be released, the writer must
+ * finish before.
+ */
+static void main_snapshot_reset(FastVideoSnapshot_t *snapshot)
+{
+	int index;
+	if (snapshot->state == SNAPSHOT_WRITING)
+	{
+		/// the index is obsolete, the snapshot is written
+		if (read(snapshot->done[0], &index, sizeof(index)) == sizeof(index))
+			pthread_join(snapshot->thread, NULL);
+		snapshot->state = SNAPSHOT_IDLE;
+	}
+	/// the selected frame is lost, the next one is taken
+	if (snapshot->state == SNAPSHOT_SELECTED)
+		snapshot->state = SNAPSHOT_ARMED;
+}
+
+static void main_snapshot_destroy(FastVideoSnapshot_t *snapshot)
+{
+	if (snapshot->state == SNAPSHOT_WRITING)
+		pthread_join(snapshot->thread, NULL);
+	close(snapshot->done[0]);
+	close(snapshot->done[1]);
+	close(snapshot->cmdfd);
+	free(snapshot);
+}
+
+static int main_event(FastVideoLink_t *link)
+{
+	FastVideoDevice_t *input = link->input;
+	FastVideoDevice_t *output = link->output;
+	int event = input->ops->event(input->dev);
+	if (event & event_type_eos)
+	{
+		warn("fastvideo: %s end of stream", input->config->name);
+		return -1;
+	}
+	if (event & event_type_sourcechange)
+	{
+		/// the input released its buffers, the link is built again with the new definition
+		if (link->snapshot)
+			main_snapshot_reset(link->snapshot);
+		output->ops->stop(output->dev);
+		input->ops->stop(input->dev);
+		/// the source imposes its new size, the sink follows it
+		link->request.width = input->config->width;
+		link->request.height = input->config->height;
+		if (main_negotiate(link) < 0)
+		{
+			err("fastvideo: %s => %s renegotiation error", input->config->name, output->config->name);
+			return -1;
+		}
+		if (main_linkbuffers(link) < 0)
+			return -1;
+		output->ops->start(output->dev);
+		input->ops->start(input->dev);
+	}
+	return 0;
+}
+
+static int main_link(FastVideoLink_t *link, fd_set *rfds, fd_set *wfds)
+{
+	FastVideoDevice_t *input = link->input;
+	FastVideoDevice_t *output = link->output;
+	int ret = 0;
+	if (link->infd < 0 || FD_ISSET(link->infd, rfds))
+	{
+		int index = 0;
+		size_t bytesused = 0;
+		if ((index = input->ops->dequeue(input->dev, NULL, &bytesused)) < 0)
+		{
+			if (errno == EAGAIN)
+				return 0;
+			if (errno)
+				err("input buffer dequeuing error %m");
+			return -1;
+		}
+		if (link->snapshot)
+			main_snapshot_select(link->snapshot, index, bytesused);
+		if (output->ops->stamp && input->ops->timestamp && input->ops->sequence)
+			output->ops->stamp(output->dev, index, input->ops->timestamp(input->dev, index),
+				input->ops->sequence(input->dev, index));
+
+		if (output->ops->queue(output->dev, index, bytesused) < 0)
+		{
+			if (errno == EAGAIN)
+				return 0;
+			if (errno)
+				err("output buffer queuing error %m");
+			return -1;
+		}
+	}
+	if (link->outfd < 0 || FD_ISSET(link->outfd, wfds) || FD_ISSET(link->outfd, rfds))
+	{
+		int index = 0;
+		if ((index = output->ops->dequeue(output->dev, NULL, NULL)) < 0)
+		{
+			if (errno == EAGAIN)
+				return 0;
+			if (errno)
+				err("output buffer dequeuing error %m");
+			return -1;
+		}
+		if (input->ops->timestamp && output->ops->timestamp)
+		{
+			uint64_t start = input->ops->timestamp(input->dev, index);
+			uint64_t end = output->ops->timestamp(output->dev, index);
+			if (start && end > start)
+			{
+				link->latency += end - start;
+				link->nlatencies++;
+			}
+		}
+		if (link->snapshot && main_snapshot_hold(link->snapshot, index))
+			return 1;
+		if (input->ops->queue(input->dev, index, 0) < 0)
+		{
+			if (errno == EAGAIN)
+				return 0;
+			if (errno)
+				err("input buffer queuing error %m");
+			return -1;
+		}
+		ret = 1;
+	}
+	return ret;
+}
+
+int main_loop(FastVideoLink_t *links, int nlinks)
+{
+	/// the downstream devices are ready before their sources
+	for (int i = nlinks - 1; i > -1; i--)
 	{
-		infd = input->ops->eventfd(input->dev);
-		maxfd = (infd > maxfd)?infd:maxfd;
+		links[i].output->ops->start(links[i].output->dev);
+		links[i].input->ops->start(links[i].input->dev);
 	}
-	int outfd = -1;
-	if (output->ops->eventfd)
+	int maxfd = 0;
+	for (int i = 0; i < nlinks; i++)
 	{
-		outfd = output->ops->eventfd(output->dev);
-		maxfd = (outfd > maxfd)?outfd:maxfd;
+		FastVideoDevice_t *input = links[i].input;
+		FastVideoDevice_t *output = links[i].output;
+		links[i].infd = -1;
+		if (input->ops->eventfd)
+		{
+			links[i].infd = input->ops->eventfd(input->dev);
+			maxfd = (links[i].infd > maxfd)?links[i].infd:maxfd;
+		}
+		links[i].outfd = -1;
+		if (output->ops->eventfd)
+		{
+			links[i].outfd = output->ops->eventfd(output->dev);
+			maxfd = (links[i].outfd > maxfd)?links[i].outfd:maxfd;
+		}
 	}
-	int timerfd = timerfd_create(CLOCK_REALTIME, 0);
+	/// the period doesn't depend on the time settings
+	int timerfd = timerfd_create(SCLOCK_DOMAIN, 0);
 	struct itimerspec timeout = {
 		.it_interval = {.tv_sec = 1, .tv_nsec = 0},
 		.it_value = {.tv_sec = 1, .tv_nsec = 0},
 	};
-	timerfd_settime(timerfd, TFD_TIMER_CANCEL_ON_SET, &timeout, NULL);
-	maxfd = (outfd > timerfd)?outfd:timerfd;
+	timerfd_settime(timerfd, 0, &timeout, NULL);
+	sclock_update();
+	maxfd = (maxfd > timerfd)?maxfd:timerfd;
+	FastVideoSnapshot_t *snapshot = links[0].snapshot;
+	if (snapshot)
+	{
+		maxfd = (maxfd > snapshot->cmdfd)?maxfd:snapshot->cmdfd;
+		maxfd = (maxfd > snapshot->done[0])?maxfd:snapshot->done[0];
+	}
 
 	unsigned int count = 0;
-	while (isrunning())
+	int run = 1;
+	while (run && isrunning())
 	{
 		fd_set rfds;
 		fd_set wfds;
+		fd_set efds;
 		FD_ZERO(&rfds);
 		FD_ZERO(&wfds);
-		if (infd > 0)
-			FD_SET(infd, &rfds);
-		if (outfd > 0)
+		FD_ZERO(&efds);
+		for (int i = 0; i < nlinks; i++)
 		{
-			FD_SET(outfd, &rfds);
-			FD_SET(outfd, &wfds);
+			if (links[i].infd > 0)
+				FD_SET(links[i].infd, &rfds);
+			if (links[i].infd > 0 && links[i].input->ops->event)
+				FD_SET(links[i].infd, &efds);
+			if (links[i].outfd > 0)
+			{
+				FD_SET(links[i].outfd, &rfds);
+				FD_SET(links[i].outfd, &wfds);
+			}
 		}
 		if (timerfd > 0)
 			FD_SET(timerfd, &rfds);
+		if (snapshot)
+		{
+			FD_SET(snapshot->cmdfd, &rfds);
+			FD_SET(snapshot->done[0], &rfds);
+		}
 
 		int ret;
-		ret = select(maxfd + 1, &rfds, &wfds, NULL, NULL);
+		ret = select(maxfd + 1, &rfds, &wfds, &efds, NULL);
 		if (ret == -1 && errno == EINTR)
 			continue;
 		if (ret > 0 && FD_ISSET(timerfd, &rfds))
@@ -218,65 +920,69 @@ int main_loop(FastVideoDevice_t *input, FastVideoDevice_t *output)
 			{
 				warn("fastvideo(%d): %d fps", getpid(), count);
 				count = 0;
+				for (int i = 0; i < nlinks; i++)
+				{
+					if (links[i].nlatencies)
+						warn("fastvideo(%d): %s -> %s latency %llu us", getpid(),
+							links[i].input->config->name, links[i].output->config->name,
+							(unsigned long long)(links[i].latency / links[i].nlatencies / 1000));
+					links[i].latency = 0;
+					links[i].nlatencies = 0;
+				}
+				/// the wall clock and the boot clock drift from the pipeline clock
+				sclock_update();
 			}
 			ret--;
 		}
-		if (ret == 0)
+		if (ret > 0 && snapshot && FD_ISSET(snapshot->cmdfd, &rfds))
 		{
-			continue;
+			main_snapshot_command(snapshot, links, nlinks);
+			ret--;
 		}
-		if (infd < 0 || (ret > 0 && FD_ISSET(infd, &rfds)))
+		if (ret > 0 && snapshot && FD_ISSET(snapshot->done[0], &rfds))
 		{
-			int index = 0;
-			size_t bytesused = 0;
-			if ((index = input->ops->dequeue(input->dev, NULL, &bytesused)) < 0)
-			{
-				if (errno == EAGAIN)
-					continue;
-				if (errno)
-					err("input buffer dequeuing error %m");
-				killdaemon(NULL);
-				break;
-			}
-
-			if (output->ops->queue(output->dev, index, bytesused) < 0)
+			if (main_snapshot_release(snapshot) < 0)
 			{
-				if (errno == EAGAIN)
-					continue;
-				if (errno)
-					err("output buffer queuing error %m");
 				killdaemon(NULL);
-				break;
+				run = 0;
 			}
 			ret--;
 		}
-		if (outfd < 0 || (ret > 0 && FD_ISSET(outfd, &wfds)) || (ret > 0 && FD_ISSET(outfd, &rfds)))
+		if (ret == 0)
 		{
-			int index = 0;
-			if ((index = output->ops->dequeue(output->dev, NULL, NULL)) < 0)
+			continue;
+		}
+		for (int i = 0; i < nlinks; i++)
+		{
+			if (links[i].infd > 0 && FD_ISSET(links[i].infd, &efds))
 			{
-				if (errno == EAGAIN)
-					continue;
-				if (errno)
-					err("output buffer dequeuing error %m");
-				killdaemon(NULL);
-				break;
+				if (main_event(&links[i]) < 0)
+				{
+					killdaemon(NULL);
+					run = 0;
+					break;
+				}
+				/// the readiness of the fd is obsolete after the event
+				continue;
 			}
-			if (input->ops->queue(input->dev, index, 0) < 0)
+			int done = main_link(&links[i], &rfds, &wfds);
+			if (done < 0)
 			{
-				if (errno == EAGAIN)
-					continue;
-				if (errno)
-					err("input buffer queuing error %m");
 				killdaemon(NULL);
+				run = 0;
 				break;
 			}
-			count++;
-			ret--;
+			/// the last link releases the frames of the pipeline
+			if (i == nlinks - 1)
+				count += done;
 		}
 	}
-	input->ops->stop(input->dev);
-	output->ops->stop(output->dev);
+	for (int i = 0; i < nlinks; i++)
+	{
+		links[i].input->ops->stop(links[i].input->dev);
+		links[i].output->ops->stop(links[i].output->dev);
+	}
+	close(timerfd);
 	return 0;
 }
 
@@ -287,6 +993,8 @@ int main(int argc, char * const argv[])
 	const char *configfile = NULL;
 	const char *input = "cam";
 	const char *output = "gpu";
+	const char *transform = NULL;
+	const char *cmdfifo = NULL;
 	int width = 640;
 	int height = 480;
 	unsigned int mode = 0;
@@ -294,7 +1002,7 @@ int main(int argc, char * const argv[])
 	int opt;
 	do
 	{
-		opt = getopt(argc, argv, "i:o:j:w:h:D");
+		opt = getopt(argc, argv, "i:o:m:j:w:h:c:D");
 		switch (opt)
 		{
 			case 'i':
@@ -303,6 +1011,12 @@ int main(int argc, char * const argv[])
 			case 'o':
 				output = optarg;
 			break;
+			case 'm':
+				transform = optarg;
+			break;
+			case 'c':
+				cmdfifo = optarg;
+			break;
 			case 'j':
 				configfile = optarg;
 			break;
@@ -321,6 +1035,10 @@ int main(int argc, char * const argv[])
 	FastVideoDevice_ops_t *fastVideoDevice_ops[] =
 	{
 		&sv4l2_ops,
+		&sv4l2_m2m_ops,
+#ifdef HAVE_LIBJPEG
+		&smjpeg_ops,
+#endif
 #ifdef HAVE_EGL
 		&segl_ops,
 #endif
@@ -347,7 +1065,33 @@ int main(int argc, char * const argv[])
 		return -1;
 	}
 
-	choice_config(indev->config, outdev->config);
+	/// the values of the configuration files are the requests of the negotiation
+	DeviceConf_t requests[2] = {0};
+	main_request(&requests[0], indev->config, outdev->config);
+	requests[1] = requests[0];
+
+	FastVideoDevice_t *m2mdev = NULL;
+	if (transform != NULL)
+	{
+		m2mdev = config_createdevice(transform, configfile, fastVideoDevice_ops);
+		if (m2mdev == NULL || m2mdev->ops->sink == NULL)
+		{
+			err("transform not available");
+			return -1;
+		}
+		main_request(&requests[0], indev->config, NULL);
+		main_request(&requests[1], m2mdev->config, outdev->config);
+		choice_config(m2mdev->config, outdev->config);
+	}
+	else
+		choice_config(indev->config, outdev->config);
+
+	/// a camera chooses the compressed formats only for a sink accepting them
+	if (indev->ops == &sv4l2_ops)
+		((CameraConfig_t *)indev->config)->compressed = m2mdev?
+				main_compressed(m2mdev, transform): main_compressed(outdev, output);
+	if (m2mdev != NULL && m2mdev->ops == &sv4l2_m2m_ops)
+		((CameraConfig_t *)m2mdev->config)->compressed = main_compressed(outdev, output);
 
 	indev->dev = indev->ops->create(input, indev->config);
 	if (indev->ops->loadsettings && indev->config->entry)
@@ -358,6 +1102,25 @@ int main(int argc, char * const argv[])
 	if (indev->dev == NULL)
 		return -1;
 
+	FastVideoDevice_t m2minput = {0};
+	if (m2mdev != NULL)
+	{
+		if (m2mdev->ops == &sv4l2_m2m_ops)
+			((CameraConfig_t *)m2mdev->config)->input = indev->config;
+		m2mdev->dev = m2mdev->ops->create(transform, m2mdev->config);
+		if (m2mdev->dev == NULL)
+		{
+			indev->ops->destroy(indev->dev);
+			return -1;
+		}
+		if (m2mdev->ops->loadsettings && m2mdev->config->entry)
+			m2mdev->ops->loadsettings(m2mdev->dev, m2mdev->config->entry);
+		/// the OUTPUT queue of the m2m device is the sink of the input
+		m2minput.dev = m2mdev->ops->sink(m2mdev->dev);
+		m2minput.ops = m2mdev->ops->sinkops;
+		m2minput.config = m2minput.ops->config(m2minput.dev);
+	}
+
 	outdev->dev = outdev->ops->create(output, outdev->config);
 	if (outdev->ops->loadsettings && outdev->config->entry)
 	{
@@ -369,23 +1132,54 @@ int main(int argc, char * const argv[])
 
 	daemonize((mode & MODE_DAEMONIZE) == MODE_DAEMONIZE, pidfile, owner);
 
-	int *dma_bufs = {0};
-	size_t size = 0;
-	int nbbufs = 0;
-	if (indev->ops->requestbuffer(indev->dev, buf_type_dmabuf | buf_type_master, &nbbufs, &dma_bufs, &size, NULL) < 0)
+	FastVideoLink_t links[2] = {0};
+	int nlinks = 0;
+	if (m2mdev != NULL)
 	{
-		err("input dma buffer not allowed");
-		return -1;
+		links[nlinks].input = indev;
+		links[nlinks].output = &m2minput;
+		links[nlinks].request = requests[0];
+		nlinks++;
+		links[nlinks].input = m2mdev;
+		links[nlinks].output = outdev;
+		links[nlinks].request = requests[1];
+		nlinks++;
 	}
-	if (outdev->ops->requestbuffer(outdev->dev, buf_type_dmabuf, nbbufs, dma_bufs, size, NULL) < 0)
+	else
 	{
-		err("output dma buffers not linked");
-		return -1;
+		links[nlinks].input = indev;
+		links[nlinks].output = outdev;
+		links[nlinks].request = requests[0];
+		nlinks++;
+	}
+
+	for (int i = 0; i < nlinks; i++)
+	{
+		if (main_negotiate(&links[i]) < 0)
+		{
+			err("fastvideo: %s => %s negotiation error",
+				links[i].input->config->name, links[i].output->config->name);
+			return -1;
+		}
+		if (main_linkbuffers(&links[i]) < 0)
+			return -1;
+	}
+	/// the snapshots are taken from the frames of the camera
+	if (cmdfifo)
+		links[0].snapshot = main_snapshot_create(cmdfifo, &links[0]);
+	main_loop(links, nlinks);
+	if (links[0].snapshot)
+	{
+		main_snapshot_destroy(links[0].snapshot);
+		unlink(cmdfifo);
 	}
-	main_loop(indev, outdev);
+	for (int i = 0; i < nlinks; i++)
+		free(links[i].dma_bufs);
 
 	killdaemon(pidfile);
 	indev->ops->destroy(indev->dev);
+	if (m2mdev != NULL)
+		m2mdev->ops->destroy(m2mdev->dev);
 	outdev->ops->destroy(outdev->dev);
 	return 0;
 }
@@ -4,3 +4,4 @@ fastvideo_SOURCES+=daemonize.c
 fastvideo_SOURCES-$(HAVE_JANSSON)+=config.c
 fastvideo_LIBS+=fastvideo
 fastvideo_LIBRARY+=jansson
+fastvideo_LIBS+=pthread
@@ -1,11 +1,22 @@
 lib-y+=fastvideo
 fastvideo_SOURCES+=sv4l2.c
+fastvideo_SOURCES+=s3a.c
+fastvideo_SOURCES+=sclock.c
+fastvideo_SOURCES+=ssync.c
+fastvideo_SOURCES+=sformat.c
 fastvideo_SOURCES+=sfile.c
+fastvideo_SOURCES+=scompress.c
+fastvideo_SOURCES-$(HAVE_LIBJPEG)+=sjpeg.c
+fastvideo_SOURCES-$(HAVE_LIBJPEG)+=smjpeg.c
 fastvideo_SOURCES-$(HAVE_LIBDRM)+=sdrm.c
 fastvideo_SOURCES-$(HAVE_EGL)+=segl.c
 fastvideo_SOURCES-$(HAVE_EGL)+=segl_glprog.c
 fastvideo_SOURCES-$(HAVE_GBM)+=segl_drm.c
 fastvideo_SOURCES-$(HAVE_X11)+=segl_x11.c
+fastvideo_LIBS+=pthread
+fastvideo_LIBRARY+=libjpeg
+fastvideo_LIBRARY+=liblz4
+fastvideo_LIBRARY+=libzstd
 fastvideo_LIBRARY-$(DRM)+=libdrm
 fastvideo_LIBRARY-$(EGL)+=glesv2
 fastvideo_LIBRARY-$(EGL)+=egl
@@ -0,0 +1,479 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+#include "log.h"
+#include "sv4l2.h"
+#include "s3a.h"
+
+#define S3A_RED 0
+#define S3A_GREEN 1
+#define S3A_BLUE 2
+
+#define S3A_UNITY 256
+
+typedef struct S3AControl_s S3AControl_t;
+struct S3AControl_s
+{
+	uint32_t id;
+	int32_t minimum;
+	int32_t maximum;
+	int32_t step;
+	int32_t value;
+	int available;
+};
+
+/**
+ * description of the formats: the colour of each pixel of the bayer
+ * quad (line 0 then line 1), the bit depth and the packing of the line.
+ */
+enum s3a_packing_e
+{
+	s3a_packing_8,
+	s3a_packing_16,
+	s3a_packing_csi10,
+	s3a_packing_csi12,
+	s3a_packing_yuyv,
+	s3a_packing_uyvy,
+};
+
+typedef struct S3AFormat_s S3AFormat_t;
+struct S3AFormat_s
+{
+	uint32_t fourcc;
+	uint8_t order[4];
+	uint8_t depth;
+	enum s3a_packing_e packing;
+};
+
+#define BGGR {S3A_BLUE, S3A_GREEN, S3A_GREEN, S3A_RED}
+#define GBRG {S3A_GREEN, S3A_BLUE, S3A_RED, S3A_GREEN}
+#define GRBG {S3A_GREEN, S3A_RED, S3A_BLUE, S3A_GREEN}
+#define RGGB {S3A_RED, S3A_GREEN, S3A_GREEN, S3A_BLUE}
+
+static const S3AFormat_t s3a_formats[] = {
+	{V4L2_PIX_FMT_SBGGR8, BGGR, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_SGBRG8, GBRG, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_SGRBG8, GRBG, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_SRGGB8, RGGB, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_SBGGR10, BGGR, 10, s3a_packing_16},
+	{V4L2_PIX_FMT_SGBRG10, GBRG, 10, s3a_packing_16},
+	{V4L2_PIX_FMT_SGRBG10, GRBG, 10, s3a_packing_16},
+	{V4L2_PIX_FMT_SRGGB10, RGGB, 10, s3a_packing_16},
+	{V4L2_PIX_FMT_SBGGR12, BGGR, 12, s3a_packing_16},
+	{V4L2_PIX_FMT_SGBRG12, GBRG, 12, s3a_packing_16},
+	{V4L2_PIX_FMT_SGRBG12, GRBG, 12, s3a_packing_16},
+	{V4L2_PIX_FMT_SRGGB12, RGGB, 12, s3a_packing_16},
+	{V4L2_PIX_FMT_SBGGR16, BGGR, 16, s3a_packing_16},
+	{V4L2_PIX_FMT_SGBRG16, GBRG, 16, s3a_packing_16},
+	{V4L2_PIX_FMT_SGRBG16, GRBG, 16, s3a_packing_16},
+	{V4L2_PIX_FMT_SRGGB16, RGGB, 16, s3a_packing_16},
+	{V4L2_PIX_FMT_SBGGR10P, BGGR, 10, s3a_packing_csi10},
+	{V4L2_PIX_FMT_SGBRG10P, GBRG, 10, s3a_packing_csi10},
+	{V4L2_PIX_FMT_SGRBG10P, GRBG, 10, s3a_packing_csi10},
+	{V4L2_PIX_FMT_SRGGB10P, RGGB, 10, s3a_packing_csi10},
+	{V4L2_PIX_FMT_SBGGR12P, BGGR, 12, s3a_packing_csi12},
+	{V4L2_PIX_FMT_SGBRG12P, GBRG, 12, s3a_packing_csi12},
+	{V4L2_PIX_FMT_SGRBG12P, GRBG, 12, s3a_packing_csi12},
+	{V4L2_PIX_FMT_SRGGB12P, RGGB, 12, s3a_packing_csi12},
+	{V4L2_PIX_FMT_GREY, {0}, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_NV12, {0}, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_YUV420, {0}, 8, s3a_packing_8},
+	{V4L2_PIX_FMT_YUYV, {0}, 8, s3a_packing_yuyv},
+	{V4L2_PIX_FMT_UYVY, {0}, 8, s3a_packing_uyvy},
+	{0},
+};
+
+typedef struct S3A_s S3A_t;
+struct S3A_s
+{
+	V4L2_t *dev;
+	S3AConfig_t config;
+	const S3AFormat_t *format;
+	int bayer;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t wait;
+	S3AControl_t exposure;
+	S3AControl_t gain;
+	S3AControl_t red;
+	S3AControl_t blue;
+	S3AStats_t stats;
+};
+
+static int _s3a_findcontrol(void *arg, struct v4l2_queryctrl *ctrl, V4L2_t *dev)
+{
+	S3A_t *ctx = (S3A_t *)arg;
+	S3AControl_t *controls[] = {&ctx->exposure, &ctx->gain, &ctx->red, &ctx->blue};
+	for (int i = 0; i < sizeof(controls) / sizeof(*controls); i++)
+	{
+		if (controls[i]->id != ctrl->id || ctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)
+			continue;
+		controls[i]->minimum = ctrl->minimum;
+		controls[i]->maximum = ctrl->maximum;
+		controls[i]->step = (ctrl->step > 0)? ctrl->step: 1;
+		controls[i]->value = ctrl->default_value;
+		controls[i]->available = 1;
+	}
+	return 0;
+}
+
+static void _s3a_readcontrol(S3A_t *ctx, S3AControl_t *control)
+{
+	if (!control->available)
+		return;
+	void *value = sv4l2_control(ctx->dev, control->id, (void *)-1);
+	if (value == (void *)-1)
+	{
+		control->available = 0;
+		return;
+	}
+	control->value = (int32_t)(intptr_t)value;
+}
+
+static int _s3a_writecontrol(S3A_t *ctx, S3AControl_t *control, int64_t value)
+{
+	if (!control->available)
+		return 0;
+	if (value < control->minimum)
+		value = control->minimum;
+	if (value > control->maximum)
+		value = control->maximum;
+	value = control->minimum + ((value - control->minimum) / control->step) * control->step;
+	if (value == control->value)
+		return 0;
+	void *ret = sv4l2_control(ctx->dev, control->id, (void *)(intptr_t)value);
+	if (ret == (void *)-1)
+		return -1;
+	control->value = (int32_t)(intptr_t)ret;
+	return 1;
+}
+
+S3A_t *s3a_create(V4L2_t *dev, S3AConfig_t *config)
+{
+	DeviceConf_t *devconfig = sv4l2_config(dev);
+	const S3AFormat_t *format = NULL;
+	for (int i = 0; s3a_formats[i].fourcc != 0; i++)
+	{
+		if (s3a_formats[i].fourcc == devconfig->fourcc)
+		{
+			format = &s3a_formats[i];
+			break;
+		}
+	}
+	if (format == NULL)
+	{
+		err("s3a: format %.4s not supported", (char *)&devconfig->fourcc);
+		return NULL;
+	}
+
+	S3A_t *ctx = calloc(1, sizeof(*ctx));
+	ctx->dev = dev;
+	ctx->format = format;
+	ctx->bayer = format->order[0] != format->order[1];
+	ctx->width = devconfig->width;
+	ctx->height = devconfig->height;
+	ctx->stride = devconfig->stride;
+	ctx->config.mode = S3A_AE | S3A_AWB;
+	ctx->config.target = 110;
+	ctx->config.step = 16;
+	ctx->config.damping = 25;
+	ctx->config.delay = 2;
+	if (config)
+	{
+		ctx->config.mode = config->mode;
+		if (config->target)
+			ctx->config.target = config->target;
+		if (config->step)
+			ctx->config.step = config->step;
+		if (config->damping)
+			ctx->config.damping = config->damping;
+		ctx->config.delay = config->delay;
+	}
+	/// the grid samples whole bayer quads
+	ctx->config.step &= ~1;
+	if (ctx->config.step < 2)
+		ctx->config.step = 2;
+
+	ctx->exposure.id = V4L2_CID_EXPOSURE;
+	ctx->gain.id = V4L2_CID_ANALOGUE_GAIN;
+	ctx->red.id = V4L2_CID_RED_BALANCE;
+	ctx->blue.id = V4L2_CID_BLUE_BALANCE;
+	sv4l2_treecontrols(dev, _s3a_findcontrol, ctx);
+	if (!ctx->gain.available)
+	{
+		ctx->gain.id = V4L2_CID_GAIN;
+		sv4l2_treecontrols(dev, _s3a_findcontrol, ctx);
+	}
+	_s3a_readcontrol(ctx, &ctx->exposure);
+	_s3a_readcontrol(ctx, &ctx->gain);
+	_s3a_readcontrol(ctx, &ctx->red);
+	_s3a_readcontrol(ctx, &ctx->blue);
+	if (!ctx->exposure.available && !ctx->gain.available)
+		ctx->config.mode &= ~S3A_AE;
+	if (!ctx->red.available || !ctx->blue.available)
+		ctx->config.mode &= ~S3A_AWB;
+	if (ctx->config.mode == 0)
+		warn("s3a: %s without exposure and balance controls, statistics only", devconfig->name);
+	dbg("s3a: %.4s %ux%u grid %u, exposure %d gain %d", (char *)&format->fourcc,
+		ctx->width, ctx->height, ctx->config.step, ctx->exposure.value, ctx->gain.value);
+	return ctx;
+}
+
+/**
+ * the value of the pixel x of the line on 8 bits
+ */
+static inline uint32_t _s3a_pixel(const S3AFormat_t *format, const uint8_t *line, uint32_t x)
+{
+	switch (format->packing)
+	{
+	case s3a_packing_16:
+		return (line[x * 2] | (line[x * 2 + 1] << 8)) >> (format->depth - 8);
+	case s3a_packing_csi10:
+		/// 4 pixels in 5 bytes, the first bytes contain the msb
+		return line[(x >> 2) * 5 + (x & 3)];
+	case s3a_packing_csi12:
+		/// 2 pixels in 3 bytes
+		return line[(x >> 1) * 3 + (x & 1)];
+	default:
+		return line[x];
+	}
+}
+
+static void _s3a_sample_bayer(S3A_t *ctx, const uint8_t *mem, size_t size, uint64_t sums[3])
+{
+	const S3AFormat_t *format = ctx->format;
+	uint32_t step = ctx->config.step;
+	/// the samples start on the first pixel of a quad
+	uint32_t start = (step / 2) & ~1;
+	for (uint32_t y = start; y + 1 < ctx->height; y += step)
+	{
+		const uint8_t *lines[2] = {mem + y * ctx->stride, mem + (y + 1) * ctx->stride};
+		if ((size_t)(y + 2) * ctx->stride > size)
+			break;
+		for (uint32_t x = start; x + 1 < ctx->width; x += step)
+		{
+			uint32_t colour[3] = {0};
+			colour[format->order[0]] += _s3a_pixel(format, lines[0], x);
+			colour[format->order[1]] += _s3a_pixel(format, lines[0], x + 1);
+			colour[format->order[2]] += _s3a_pixel(format, lines[1], x);
+			colour[format->order[3]] += _s3a_pixel(format, lines[1], x + 1);
+			/// the quad contains two green pixels
+			colour[S3A_GREEN] >>= 1;
+			uint32_t luma = (colour[S3A_RED] * 77 + colour[S3A_GREEN] * 150 + colour[S3A_BLUE] * 29) >> 8;
+			ctx->stats.histogram[luma * S3A_HISTOGRAM_BINS / 256]++;
+			sums[S3A_RED] += colour[S3A_RED];
+			sums[S3A_GREEN] += colour[S3A_GREEN];
+			sums[S3A_BLUE] += colour[S3A_BLUE];
+			ctx->stats.nsamples++;
+		}
+	}
+}
+
+static void _s3a_sample_yuv(S3A_t *ctx, const uint8_t *mem, size_t size, uint64_t sums[3])
+{
+	const S3AFormat_t *format = ctx->format;
+	uint32_t step = ctx->config.step;
+	int64_t u = 0;
+	int64_t v = 0;
+	for (uint32_t y = step / 2; y < ctx->height; y += step)
+	{
+		const uint8_t *line = mem + y * ctx->stride;
+		if ((size_t)(y + 1) * ctx->stride > size)
+			break;
+		for (uint32_t x = step / 2; x < ctx->width; x += step)
+		{
+			uint32_t luma;
+			if (format->packing == s3a_packing_yuyv || format->packing == s3a_packing_uyvy)
+			{
+				/// a macro pixel contains 2 pixels and the chroma
+				const uint8_t *macro = line + (x & ~1) * 2;
+				int yoffset = (format->packing == s3a_packing_yuyv)? 0: 1;
+				int uoffset = (format->packing == s3a_packing_yuyv)? 1: 0;
+				luma = macro[yoffset];
+				u += macro[uoffset] - 128;
+				v += macro[uoffset + 2] - 128;
+			}
+			else
+				luma = line[x];
+			ctx->stats.histogram[luma * S3A_HISTOGRAM_BINS / 256]++;
+			sums[S3A_GREEN] += luma;
+			ctx->stats.nsamples++;
+		}
+	}
+	if (ctx->stats.nsamples == 0)
+		return;
+	/// the grey world on the means of the chroma
+	int64_t luma = sums[S3A_GREEN];
+	int64_t red = luma + (359 * v) / 256;
+	int64_t green = luma - (88 * u + 183 * v) / 256;
+	int64_t blue = luma + (454 * u) / 256;
+	sums[S3A_RED] = (red > 0)? red: 0;
+	sums[S3A_GREEN] = (green > 0)? green: 0;
+	sums[S3A_BLUE] = (blue > 0)? blue: 0;
+}
+
+static int _s3a_exposure(S3A_t *ctx)
+{
+	S3AStats_t *stats = &ctx->stats;
+	uint32_t mean = (stats->mean > 0)? stats->mean: 1;
+	int64_t ratio = (int64_t)ctx->config.target * S3A_UNITY / mean;
+	if (ratio > 2 * S3A_UNITY)
+		ratio = 2 * S3A_UNITY;
+	if (ratio < S3A_UNITY / 2)
+		ratio = S3A_UNITY / 2;
+	/// the mean hides the saturated areas
+	if (stats->histogram[S3A_HISTOGRAM_BINS - 1] > stats->nsamples / 20 && ratio > S3A_UNITY * 4 / 5)
+		ratio = S3A_UNITY * 4 / 5;
+	/// dead band against the oscillations
+	if (ratio > S3A_UNITY * 95 / 100 && ratio < S3A_UNITY * 105 / 100)
+		return 0;
+	ratio = S3A_UNITY + (ratio - S3A_UNITY) * (int64_t)ctx->config.damping / 100;
+
+	int64_t exposure = ctx->exposure.available? ctx->exposure.value: 1;
+	int64_t gain = ctx->gain.available? ctx->gain.value: 1;
+	int64_t total = exposure * gain * ratio / S3A_UNITY;
+	int ret = 0;
+	if (ctx->exposure.available)
+	{
+		/// the exposure first, the gain adds noise
+		int64_t mingain = (ctx->gain.available && ctx->gain.minimum > 0)? ctx->gain.minimum: 1;
+		exposure = total / mingain;
+		if (exposure > ctx->exposure.maximum)
+			exposure = ctx->exposure.maximum;
+		if (exposure < ctx->exposure.minimum)
+			exposure = ctx->exposure.minimum;
+		if (exposure < 1)
+			exposure = 1;
+		ret |= _s3a_writecontrol(ctx, &ctx->exposure, exposure);
+		exposure = ctx->exposure.value? ctx->exposure.value: 1;
+	}
+	if (ctx->gain.available)
+		ret |= _s3a_writecontrol(ctx, &ctx->gain, total / exposure);
+	return ret;
+}
+
+static int _s3a_balance(S3A_t *ctx, S3AControl_t *control, uint32_t gain)
+{
+	int64_t value = control->value;
+	int64_t target = value * gain / S3A_UNITY;
+	if (target * 100 > value * 98 && target * 100 < value * 102)
+		return 0;
+	value += (target - value) * (int64_t)ctx->config.damping / 100;
+	return _s3a_writecontrol(ctx, control, value);
+}
+
+int s3a_process(S3A_t *ctx, const void *mem, size_t size)
+{
+	if (mem == NULL || ctx->stride == 0)
+		return -1;
+	uint64_t sums[3] = {0};
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	if (ctx->bayer)
+		_s3a_sample_bayer(ctx, mem, size, sums);
+	else
+		_s3a_sample_yuv(ctx, mem, size, sums);
+	S3AStats_t *stats = &ctx->stats;
+	if (stats->nsamples == 0)
+		return -1;
+	stats->red = sums[S3A_RED] / stats->nsamples;
+	stats->green = sums[S3A_GREEN] / stats->nsamples;
+	stats->blue = sums[S3A_BLUE] / stats->nsamples;
+	uint64_t luma = 0;
+	for (int i = 0; i < S3A_HISTOGRAM_BINS; i++)
+		luma += (uint64_t)stats->histogram[i] * (i * 256 / S3A_HISTOGRAM_BINS + 128 / S3A_HISTOGRAM_BINS);
+	stats->mean = luma / stats->nsamples;
+	stats->redgain = S3A_UNITY;
+	stats->bluegain = S3A_UNITY;
+	if (stats->red > 0)
+		stats->redgain = stats->green * S3A_UNITY / stats->red;
+	if (stats->blue > 0)
+		stats->bluegain = stats->green * S3A_UNITY / stats->blue;
+	if (stats->redgain > 4 * S3A_UNITY)
+		stats->redgain = 4 * S3A_UNITY;
+	if (stats->bluegain > 4 * S3A_UNITY)
+		stats->bluegain = 4 * S3A_UNITY;
+
+	/// the sensor applies the controls some frames later
+	if (ctx->wait > 0)
+	{
+		ctx->wait--;
+		return 0;
+	}
+	int ret = 0;
+	if (ctx->config.mode & S3A_AE)
+		ret |= _s3a_exposure(ctx);
+	if (ctx->config.mode & S3A_AWB)
+	{
+		ret |= _s3a_balance(ctx, &ctx->red, stats->redgain);
+		ret |= _s3a_balance(ctx, &ctx->blue, stats->bluegain);
+	}
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+	{
+		ctx->wait = ctx->config.delay;
+		dbg("s3a: mean %u => exposure %d gain %d, red %d blue %d", stats->mean,
+			ctx->exposure.value, ctx->gain.value, ctx->red.value, ctx->blue.value);
+	}
+	return ret;
+}
+
+int s3a_statistics(S3A_t *ctx, S3AStats_t *stats)
+{
+	if (stats == NULL)
+		return -1;
+	memcpy(stats, &ctx->stats, sizeof(*stats));
+	return 0;
+}
+
+void s3a_destroy(S3A_t *ctx)
+{
+	free(ctx);
+}
+
+#ifdef HAVE_JANSSON
+#include <jansson.h>
+
+int s3a_loadjsonconfiguration(void *arg, void *entry)
+{
+	json_t *jconfig = entry;
+	S3AConfig_t *config = (S3AConfig_t *)arg;
+	if (!json_is_object(jconfig))
+		return -1;
+	json_t *value = json_object_get(jconfig, "ae");
+	if (value && json_is_boolean(value))
+	{
+		if (json_is_true(value))
+			config->mode |= S3A_AE;
+		else
+			config->mode &= ~S3A_AE;
+	}
+	value = json_object_get(jconfig, "awb");
+	if (value && json_is_boolean(value))
+	{
+		if (json_is_true(value))
+			config->mode |= S3A_AWB;
+		else
+			config->mode &= ~S3A_AWB;
+	}
+	value = json_object_get(jconfig, "target");
+	if (value && json_is_integer(value))
+		config->target = json_integer_value(value);
+	value = json_object_get(jconfig, "step");
+	if (value && json_is_integer(value))
+		config->step = json_integer_value(value);
+	value = json_object_get(jconfig, "damping");
+	if (value && json_is_integer(value))
+		config->damping = json_integer_value(value);
+	value = json_object_get(jconfig, "delay");
+	if (value && json_is_integer(value))
+		config->delay = json_integer_value(value);
+	return 0;
+}
+#endif
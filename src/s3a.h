@@ -0,0 +1,98 @@
+#ifndef __S3A_H__
+#define __S3A_H__
+
+#include <stdint.h>
+
+#include "config.h"
+#include "sv4l2.h"
+
+#define S3A_AE 0x01
+#define S3A_AWB 0x02
+
+#define S3A_HISTOGRAM_BINS 64
+
+/**
+ * @param mode a bits field build with S3A_AE and S3A_AWB.
+ * @param target the mean luminance to reach on 8 bits.
+ * @param step the distance in pixels between two samples of the grid.
+ * @param damping the percentage of the correction applied on each update.
+ * @param delay the number of frames between two updates, the time for
+ * the sensor to apply the controls.
+ */
+typedef struct S3AConfig_s S3AConfig_t;
+struct S3AConfig_s
+{
+	int mode;
+	uint32_t target;
+	uint32_t step;
+	uint32_t damping;
+	uint32_t delay;
+};
+
+/**
+ * @brief statistics of the last processed frame.
+ *
+ * @param histogram the luminance histogram of the samples.
+ * @param nsamples the number of samples.
+ * @param mean the mean luminance on 8 bits.
+ * @param red the mean of the red samples on 8 bits.
+ * @param green the mean of the green samples on 8 bits.
+ * @param blue the mean of the blue samples on 8 bits.
+ * @param redgain the gain to apply on red for grey world, in 1/256.
+ * @param bluegain the gain to apply on blue for grey world, in 1/256.
+ */
+typedef struct S3AStats_s S3AStats_t;
+struct S3AStats_s
+{
+	uint32_t histogram[S3A_HISTOGRAM_BINS];
+	uint32_t nsamples;
+	uint32_t mean;
+	uint32_t red;
+	uint32_t green;
+	uint32_t blue;
+	uint32_t redgain;
+	uint32_t bluegain;
+};
+
+typedef struct S3A_s S3A_t;
+
+/**
+ * @brief create the software 3A loop of a capture device.
+ * The sensor must support the exposure and analogue gain controls for
+ * AE, the red and blue balance controls for AWB.
+ *
+ * @param dev the V4L2_t object of the sensor.
+ * @param config the configuration, it may be NULL for the defaults.
+ *
+ * @return S3A_t object or NULL if the device has no usable control.
+ */
+S3A_t *s3a_create(V4L2_t *dev, S3AConfig_t *config);
+/**
+ * @brief compute the statistics of a frame and update the controls.
+ *
+ * @param ctx the S3A_t object.
+ * @param mem the memory of the frame.
+ * @param size the size of the data.
+ *
+ * @return -1 on error, 1 if the controls changed, 0 otherwise.
+ */
+int s3a_process(S3A_t *ctx, const void *mem, size_t size);
+/**
+ * @brief get the statistics of the last processed frame.
+ *
+ * @param ctx the S3A_t object.
+ * @param stats the structure to fill.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int s3a_statistics(S3A_t *ctx, S3AStats_t *stats);
+void s3a_destroy(S3A_t *ctx);
+
+#ifdef HAVE_JANSSON
+int s3a_loadjsonconfiguration(void *arg, void *entry);
+# define s3a_loadconfiguration s3a_loadjsonconfiguration
+#else
+# define s3a_loadconfiguration NULL
+#endif
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "sclock.h"
+
+#define SCLOCK_SAMPLES 5
+
+typedef struct SClockOffset_s SClockOffset_t;
+struct SClockOffset_s
+{
+	clockid_t clock;
+	int64_t offset;
+	uint64_t updated;
+};
+
+static SClockOffset_t g_offsets[] = {
+	{.clock = CLOCK_REALTIME},
+	{.clock = CLOCK_BOOTTIME},
+};
+#define NOFFSETS (sizeof(g_offsets) / sizeof(*g_offsets))
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t _sclock_read(clockid_t clock)
+{
+	struct timespec ts;
+	if (clock_gettime(clock, &ts))
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t sclock_now(void)
+{
+	return _sclock_read(SCLOCK_DOMAIN);
+}
+
+/**
+ * the other clock is read between two readings of the reference,
+ * the narrowest bracket gives the best estimation.
+ */
+static int64_t _sclock_estimate(clockid_t clock)
+{
+	uint64_t window = UINT64_MAX;
+	int64_t offset = 0;
+	for (int i = 0; i < SCLOCK_SAMPLES; i++)
+	{
+		uint64_t before = sclock_now();
+		uint64_t other = _sclock_read(clock);
+		uint64_t after = sclock_now();
+		if (after - before < window)
+		{
+			window = after - before;
+			offset = (int64_t)(other - (before + (after - before) / 2));
+		}
+	}
+	return offset;
+}
+
+int sclock_update(void)
+{
+	uint64_t now = sclock_now();
+	if (now == 0)
+		return -1;
+	for (int i = 0; i < NOFFSETS; i++)
+	{
+		int64_t offset = _sclock_estimate(g_offsets[i].clock);
+		pthread_mutex_lock(&g_mutex);
+		int64_t moved = offset - g_offsets[i].offset;
+		if (g_offsets[i].updated && (moved > 1000000 || moved < -1000000))
+			dbg("sclock: clock %d moved of %lld ns", g_offsets[i].clock, (long long)moved);
+		g_offsets[i].offset = offset;
+		g_offsets[i].updated = now;
+		pthread_mutex_unlock(&g_mutex);
+	}
+	return 0;
+}
+
+static int64_t _sclock_offset(clockid_t clock)
+{
+	int64_t offset = 0;
+	for (int i = 0; i < NOFFSETS; i++)
+	{
+		if (g_offsets[i].clock != clock)
+			continue;
+		pthread_mutex_lock(&g_mutex);
+		int updated = g_offsets[i].updated != 0;
+		pthread_mutex_unlock(&g_mutex);
+		/// the first conversion does the first estimation
+		if (!updated)
+			sclock_update();
+		pthread_mutex_lock(&g_mutex);
+		offset = g_offsets[i].offset;
+		pthread_mutex_unlock(&g_mutex);
+		break;
+	}
+	return offset;
+}
+
+uint64_t sclock_convert(clockid_t clock, uint64_t ns)
+{
+	if (ns == 0)
+		return 0;
+	if (clock == SCLOCK_DOMAIN)
+		return ns;
+	return ns - _sclock_offset(clock);
+}
+
+uint64_t sclock_timeval(clockid_t clock, const struct timeval *tv)
+{
+	uint64_t ns = (uint64_t)tv->tv_sec * 1000000000ULL + (uint64_t)tv->tv_usec * 1000ULL;
+	return sclock_convert(clock, ns);
+}
+
+clockid_t sclock_guess(uint64_t ns)
+{
+	clockid_t clock = SCLOCK_DOMAIN;
+	uint64_t now = sclock_now();
+	uint64_t distance = (now > ns)? now - ns: ns - now;
+	for (int i = 0; i < NOFFSETS; i++)
+	{
+		uint64_t other = now + _sclock_offset(g_offsets[i].clock);
+		uint64_t d = (other > ns)? other - ns: ns - other;
+		if (d < distance)
+		{
+			distance = d;
+			clock = g_offsets[i].clock;
+		}
+	}
+	return clock;
+}
@@ -0,0 +1,57 @@
+#ifndef __SCLOCK_H__
+#define __SCLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/**
+ * All the timestamps of the pipeline are converted into the domain of
+ * CLOCK_MONOTONIC, in nanoseconds.
+ */
+#define SCLOCK_DOMAIN CLOCK_MONOTONIC
+
+/**
+ * @brief read the reference clock.
+ *
+ * @return the current time in ns.
+ */
+uint64_t sclock_now(void);
+/**
+ * @brief estimate again the offsets of the other clocks.
+ * CLOCK_REALTIME jumps with the time settings and CLOCK_BOOTTIME with
+ * the suspends, this function should be called periodically.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sclock_update(void);
+/**
+ * @brief convert a time into the reference domain.
+ *
+ * @param clock the clock of the time, CLOCK_MONOTONIC, CLOCK_BOOTTIME or
+ * CLOCK_REALTIME.
+ * @param ns the time in ns.
+ *
+ * @return the time in ns of the reference clock, 0 on error.
+ */
+uint64_t sclock_convert(clockid_t clock, uint64_t ns);
+/**
+ * @brief same as sclock_convert for a time from a kernel structure.
+ *
+ * @param clock the clock of the time.
+ * @param tv the time.
+ *
+ * @return the time in ns of the reference clock, 0 on error.
+ */
+uint64_t sclock_timeval(clockid_t clock, const struct timeval *tv);
+/**
+ * @brief find the clock of a time without origin, usually from a driver
+ * which doesn't report it. The time must be recent.
+ *
+ * @param ns the time in ns.
+ *
+ * @return the clock nearest to the time.
+ */
+clockid_t sclock_guess(uint64_t ns);
+
+#endif
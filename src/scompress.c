@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "config.h"
+#include "log.h"
+#include "scompress.h"
+
+#define SCOMPRESS_MAXWORKERS 16
+#define SCOMPRESS_DEFAULTZSTDLEVEL 1
+
+enum
+{
+	WORKER_IDLE,
+	WORKER_FILLING,
+	WORKER_PENDING,
+	WORKER_BUSY,
+};
+
+typedef struct SCompressWorker_s SCompressWorker_t;
+struct SCompressWorker_s
+{
+	SCompress_t *compressor;
+	char *input;
+	size_t inputsize;
+	size_t length;
+	/// the samples after the filter
+	char *filtered;
+	char *output;
+	size_t outputsize;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t framesequence;
+	int state;
+#ifdef HAVE_LIBZSTD
+	ZSTD_CCtx *cctx;
+#endif
+	pthread_t thread;
+};
+
+struct SCompress_s
+{
+	int method;
+	int level;
+	uint16_t filter;
+	uint32_t stride;
+	SCompressOutput_t output;
+	void *arg;
+	SCompressWorker_t *workers;
+	int nworkers;
+	/// the sequence of the next pushed frame, and of the next written
+	uint32_t sequence;
+	uint32_t written;
+	uint32_t drops;
+	int run;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/// the sizes of the frames before and after the compression
+	uint64_t rawbytes;
+	uint64_t bytes;
+};
+
+int scompress_supported(int method)
+{
+	switch (method)
+	{
+#ifdef HAVE_LIBLZ4
+		case SCOMPRESS_LZ4:
+			return 1;
+#endif
+#ifdef HAVE_LIBZSTD
+		case SCOMPRESS_ZSTD:
+			return 1;
+#endif
+		default:
+		break;
+	}
+	return 0;
+}
+
+int scompress_method(const char *name)
+{
+	if (!strcasecmp(name, "lz4"))
+		return SCOMPRESS_LZ4;
+	if (!strcasecmp(name, "zstd") || !strcasecmp(name, "zst"))
+		return SCOMPRESS_ZSTD;
+	if (!strcasecmp(name, "none"))
+		return SCOMPRESS_NONE;
+	return -1;
+}
+
+uint16_t scompress_filter(uint32_t fourcc, uint32_t stride)
+{
+	if (stride == 0)
+		return 0;
+	switch (fourcc)
+	{
+		case FOURCC('G','R','E','Y'):
+			return SCOMPRESS_FILTER(SCOMPRESS_FILTER_BYTES, 1);
+		case FOURCC('B','A','8','1'):
+		case FOURCC('G','B','R','G'):
+		case FOURCC('G','R','B','G'):
+		case FOURCC('R','G','G','B'):
+			return SCOMPRESS_FILTER(SCOMPRESS_FILTER_BYTES, 2);
+		case FOURCC('Y','1','0',' '):
+		case FOURCC('Y','1','2',' '):
+		case FOURCC('Y','1','6',' '):
+			if (stride % 2)
+				break;
+			return SCOMPRESS_FILTER(SCOMPRESS_FILTER_WORDS, 1);
+		/// the samples of 10 to 16 bits are stored into 16 bits words
+		case FOURCC('B','G','1','0'):
+		case FOURCC('G','B','1','0'):
+		case FOURCC('B','A','1','0'):
+		case FOURCC('R','G','1','0'):
+		case FOURCC('B','G','1','2'):
+		case FOURCC('G','B','1','2'):
+		case FOURCC('B','A','1','2'):
+		case FOURCC('R','G','1','2'):
+		case FOURCC('B','G','1','4'):
+		case FOURCC('G','B','1','4'):
+		case FOURCC('G','R','1','4'):
+		case FOURCC('R','G','1','4'):
+		case FOURCC('B','Y','R','2'):
+		case FOURCC('G','B','1','6'):
+		case FOURCC('G','R','1','6'):
+		case FOURCC('R','G','1','6'):
+			if (stride % 2)
+				break;
+			return SCOMPRESS_FILTER(SCOMPRESS_FILTER_WORDS, 2);
+		default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * the lines are filtered one by one, the end of a frame shorter than a
+ * line is copied.
+ */
+static void _scompress_filter(uint16_t filter, uint32_t stride, const char *src, size_t length, char *dst)
+{
+	uint32_t distance = filter >> 8;
+	size_t nlines = length / stride;
+	size_t done = 0;
+	if ((filter & 0xff) == SCOMPRESS_FILTER_BYTES)
+	{
+		for (size_t y = 0; y < nlines; y++)
+		{
+			const uint8_t *line = (const uint8_t *)src + y * stride;
+			uint8_t *out = (uint8_t *)dst + y * stride;
+			for (uint32_t x = 0; x < stride && x < distance; x++)
+				out[x] = line[x];
+			for (uint32_t x = distance; x < stride; x++)
+				out[x] = line[x] - line[x - distance];
+		}
+		done = nlines * stride;
+	}
+	else if ((filter & 0xff) == SCOMPRESS_FILTER_WORDS)
+	{
+		uint32_t nsamples = stride / 2;
+		size_t nplane = nlines * nsamples;
+		uint8_t *low = (uint8_t *)dst;
+		uint8_t *high = low + nplane;
+		for (size_t y = 0; y < nlines; y++)
+		{
+			const uint16_t *line = (const uint16_t *)(src + y * stride);
+			for (uint32_t x = 0; x < nsamples; x++)
+			{
+				uint16_t delta = line[x] - ((x >= distance)? line[x - distance]: 0);
+				uint16_t zigzag = (uint16_t)(delta << 1) ^ (uint16_t)-(delta >> 15);
+				*low++ = zigzag;
+				*high++ = zigzag >> 8;
+			}
+		}
+		done = nplane * 2;
+	}
+	memcpy(dst + done, src + done, length - done);
+}
+
+static void _scompress_unfilter(uint16_t filter, uint32_t stride, const char *src, size_t length, char *dst)
+{
+	uint32_t distance = filter >> 8;
+	size_t nlines = length / stride;
+	size_t done = 0;
+	if ((filter & 0xff) == SCOMPRESS_FILTER_BYTES)
+	{
+		for (size_t y = 0; y < nlines; y++)
+		{
+			const uint8_t *in = (const uint8_t *)src + y * stride;
+			uint8_t *line = (uint8_t *)dst + y * stride;
+			for (uint32_t x = 0; x < stride && x < distance; x++)
+				line[x] = in[x];
+			for (uint32_t x = distance; x < stride; x++)
+				line[x] = in[x] + line[x - distance];
+		}
+		done = nlines * stride;
+	}
+	else if ((filter & 0xff) == SCOMPRESS_FILTER_WORDS)
+	{
+		uint32_t nsamples = stride / 2;
+		size_t nplane = nlines * nsamples;
+		const uint8_t *low = (const uint8_t *)src;
+		const uint8_t *high = low + nplane;
+		for (size_t y = 0; y < nlines; y++)
+		{
+			uint16_t *line = (uint16_t *)(dst + y * stride);
+			for (uint32_t x = 0; x < nsamples; x++)
+			{
+				uint16_t zigzag = *low++ | (*high++ << 8);
+				uint16_t delta = (zigzag >> 1) ^ (uint16_t)-(zigzag & 1);
+				line[x] = delta + ((x >= distance)? line[x - distance]: 0);
+			}
+		}
+		done = nplane * 2;
+	}
+	memcpy(dst + done, src + done, length - done);
+}
+
+static size_t _scompress_bound(int method, size_t length)
+{
+	switch (method)
+	{
+#ifdef HAVE_LIBLZ4
+		case SCOMPRESS_LZ4:
+			return LZ4_compressBound(length);
+#endif
+#ifdef HAVE_LIBZSTD
+		case SCOMPRESS_ZSTD:
+			return ZSTD_compressBound(length);
+#endif
+		default:
+		break;
+	}
+	return length;
+}
+
+static ssize_t _scompress_compress(SCompressWorker_t *worker, const char *src, size_t length)
+{
+	SCompress_t *compressor = worker->compressor;
+	switch (compressor->method)
+	{
+#ifdef HAVE_LIBLZ4
+		case SCOMPRESS_LZ4:
+		{
+			int acceleration = (compressor->level < 0)? -compressor->level: 1;
+			int ret = LZ4_compress_fast(src, worker->output, length, worker->outputsize, acceleration);
+			return (ret > 0)? ret: -1;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case SCOMPRESS_ZSTD:
+		{
+			size_t ret = ZSTD_compressCCtx(worker->cctx, worker->output, worker->outputsize,
+				src, length, compressor->level);
+			if (ZSTD_isError(ret))
+			{
+				err("scompress: zstd error %s", ZSTD_getErrorName(ret));
+				return -1;
+			}
+			return ret;
+		}
+#endif
+		default:
+		break;
+	}
+	return -1;
+}
+
+static void *_scompress_workerthread(void *arg)
+{
+	SCompressWorker_t *worker = arg;
+	SCompress_t *compressor = worker->compressor;
+	pthread_mutex_lock(&compressor->mutex);
+	while (compressor->run || worker->state == WORKER_PENDING)
+	{
+		if (worker->state != WORKER_PENDING)
+		{
+			pthread_cond_wait(&compressor->cond, &compressor->mutex);
+			continue;
+		}
+		worker->state = WORKER_BUSY;
+		pthread_mutex_unlock(&compressor->mutex);
+
+		const char *src = worker->input;
+		if (compressor->filter)
+		{
+			_scompress_filter(compressor->filter, compressor->stride, worker->input, worker->length, worker->filtered);
+			src = worker->filtered;
+		}
+		ssize_t length = _scompress_compress(worker, src, worker->length);
+
+		pthread_mutex_lock(&compressor->mutex);
+		while (compressor->written != worker->sequence)
+			pthread_cond_wait(&compressor->cond, &compressor->mutex);
+		if (length > 0)
+		{
+			compressor->rawbytes += worker->length;
+			compressor->bytes += length;
+		}
+		pthread_mutex_unlock(&compressor->mutex);
+		/// the other workers wait their turn, the output is never concurrent
+		if (length < 0)
+			err("scompress: frame %u compression error", worker->sequence);
+		else if (compressor->output(compressor->arg, worker->output, length,
+					worker->timestamp, worker->framesequence) < 0)
+			err("scompress: frame %u output error %m", worker->sequence);
+		pthread_mutex_lock(&compressor->mutex);
+		compressor->written++;
+		worker->state = WORKER_IDLE;
+		pthread_cond_broadcast(&compressor->cond);
+	}
+	pthread_mutex_unlock(&compressor->mutex);
+	return NULL;
+}
+
+static void _scompress_workerrelease(SCompressWorker_t *worker)
+{
+#ifdef HAVE_LIBZSTD
+	if (worker->cctx)
+		ZSTD_freeCCtx(worker->cctx);
+#endif
+	free(worker->input);
+	free(worker->filtered);
+	free(worker->output);
+}
+
+SCompress_t *scompress_create(int method, int level, uint16_t filter, uint32_t stride,
+		int nworkers, SCompressOutput_t output, void *arg)
+{
+	if (!scompress_supported(method))
+	{
+		err("scompress: method %d not supported", method);
+		return NULL;
+	}
+	if (stride == 0)
+		filter = 0;
+	if (method == SCOMPRESS_ZSTD && level == 0)
+		level = SCOMPRESS_DEFAULTZSTDLEVEL;
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+	if (nworkers > SCOMPRESS_MAXWORKERS)
+		nworkers = SCOMPRESS_MAXWORKERS;
+
+	SCompress_t *compressor = calloc(1, sizeof(*compressor));
+	compressor->method = method;
+	compressor->level = level;
+	compressor->filter = filter;
+	compressor->stride = stride;
+	compressor->output = output;
+	compressor->arg = arg;
+	compressor->workers = calloc(nworkers, sizeof(*compressor->workers));
+	pthread_mutex_init(&compressor->mutex, NULL);
+	pthread_cond_init(&compressor->cond, NULL);
+	compressor->run = 1;
+	for (int i = 0; i < nworkers; i++)
+	{
+		SCompressWorker_t *worker = &compressor->workers[i];
+		worker->compressor = compressor;
+#ifdef HAVE_LIBZSTD
+		if (method == SCOMPRESS_ZSTD && (worker->cctx = ZSTD_createCCtx()) == NULL)
+		{
+			err("scompress: worker %d initialization error", i);
+			break;
+		}
+#endif
+		if (pthread_create(&worker->thread, NULL, _scompress_workerthread, worker))
+		{
+			err("scompress: worker %d thread error %m", i);
+			_scompress_workerrelease(worker);
+			break;
+		}
+		compressor->nworkers++;
+	}
+	if (compressor->nworkers == 0)
+	{
+		scompress_destroy(compressor);
+		return NULL;
+	}
+	dbg("scompress: %d workers method %d level %d filter %#x", compressor->nworkers, method, level, filter);
+	return compressor;
+}
+
+/**
+ * the memory of a worker grows with the frames, it's allocated by the
+ * first frames.
+ */
+static int _scompress_workerreserve(SCompressWorker_t *worker, size_t length)
+{
+	SCompress_t *compressor = worker->compressor;
+	if (length <= worker->inputsize)
+		return 0;
+	free(worker->input);
+	free(worker->filtered);
+	free(worker->output);
+	worker->input = malloc(length);
+	worker->filtered = (compressor->filter)? malloc(length): NULL;
+	worker->outputsize = _scompress_bound(compressor->method, length);
+	worker->output = malloc(worker->outputsize);
+	if (worker->input == NULL || worker->output == NULL || (compressor->filter && worker->filtered == NULL))
+	{
+		err("scompress: memory of %zu bytes error %m", length);
+		worker->inputsize = 0;
+		return -1;
+	}
+	worker->inputsize = length;
+	return 0;
+}
+
+int scompress_push(SCompress_t *compressor, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	SCompressWorker_t *worker = NULL;
+	pthread_mutex_lock(&compressor->mutex);
+	for (int i = 0; i < compressor->nworkers && worker == NULL; i++)
+	{
+		if (compressor->workers[i].state == WORKER_IDLE)
+			worker = &compressor->workers[i];
+	}
+	if (worker == NULL)
+	{
+		compressor->drops++;
+		pthread_mutex_unlock(&compressor->mutex);
+		return 1;
+	}
+	worker->state = WORKER_FILLING;
+	pthread_mutex_unlock(&compressor->mutex);
+
+	int ret = _scompress_workerreserve(worker, length);
+	if (ret == 0)
+	{
+		memcpy(worker->input, mem, length);
+		worker->length = length;
+	}
+
+	pthread_mutex_lock(&compressor->mutex);
+	/// the sequence fixes the place of the frame into the output
+	if (ret == 0)
+	{
+		worker->sequence = compressor->sequence++;
+		worker->timestamp = timestamp;
+		worker->framesequence = sequence;
+		worker->state = WORKER_PENDING;
+		pthread_cond_broadcast(&compressor->cond);
+	}
+	else
+		worker->state = WORKER_IDLE;
+	pthread_mutex_unlock(&compressor->mutex);
+	return ret;
+}
+
+void scompress_destroy(SCompress_t *compressor)
+{
+	pthread_mutex_lock(&compressor->mutex);
+	compressor->run = 0;
+	pthread_cond_broadcast(&compressor->cond);
+	pthread_mutex_unlock(&compressor->mutex);
+	for (int i = 0; i < compressor->nworkers; i++)
+	{
+		pthread_join(compressor->workers[i].thread, NULL);
+		_scompress_workerrelease(&compressor->workers[i]);
+	}
+	if (compressor->drops)
+		warn("scompress: %u frames dropped, all the workers were busy", compressor->drops);
+	if (compressor->bytes)
+		dbg("scompress: %llu bytes compressed into %llu (%.2fx)", (unsigned long long)compressor->rawbytes,
+			(unsigned long long)compressor->bytes, (double)compressor->rawbytes / compressor->bytes);
+	pthread_mutex_destroy(&compressor->mutex);
+	pthread_cond_destroy(&compressor->cond);
+	free(compressor->workers);
+	free(compressor);
+}
+
+struct SCompressDecoder_s
+{
+	int method;
+	uint16_t filter;
+	uint32_t stride;
+	/// the samples before the unfilter
+	char *scratch;
+	size_t scratchsize;
+#ifdef HAVE_LIBZSTD
+	ZSTD_DCtx *dctx;
+#endif
+};
+
+SCompressDecoder_t *scompress_decodercreate(int method, uint16_t filter, uint32_t stride)
+{
+	if (!scompress_supported(method))
+	{
+		err("scompress: method %d not supported", method);
+		return NULL;
+	}
+	SCompressDecoder_t *decoder = calloc(1, sizeof(*decoder));
+	decoder->method = method;
+	decoder->filter = (stride > 0)? filter: 0;
+	decoder->stride = stride;
+#ifdef HAVE_LIBZSTD
+	if (method == SCOMPRESS_ZSTD)
+		decoder->dctx = ZSTD_createDCtx();
+#endif
+	return decoder;
+}
+
+static ssize_t _scompress_decompress(SCompressDecoder_t *decoder, const char *data, size_t length, char *out, size_t size)
+{
+	switch (decoder->method)
+	{
+#ifdef HAVE_LIBLZ4
+		case SCOMPRESS_LZ4:
+		{
+			int ret = LZ4_decompress_safe(data, out, length, size);
+			return (ret >= 0)? ret: -1;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case SCOMPRESS_ZSTD:
+		{
+			size_t ret = ZSTD_decompressDCtx(decoder->dctx, out, size, data, length);
+			if (ZSTD_isError(ret))
+			{
+				err("scompress: zstd error %s", ZSTD_getErrorName(ret));
+				return -1;
+			}
+			return ret;
+		}
+#endif
+		default:
+		break;
+	}
+	return -1;
+}
+
+ssize_t scompress_decode(SCompressDecoder_t *decoder, const char *data, size_t length, char *frame, size_t size)
+{
+	if (!decoder->filter)
+		return _scompress_decompress(decoder, data, length, frame, size);
+	if (decoder->scratchsize < size)
+	{
+		free(decoder->scratch);
+		decoder->scratch = malloc(size);
+		decoder->scratchsize = (decoder->scratch)? size: 0;
+		if (decoder->scratch == NULL)
+			return -1;
+	}
+	ssize_t ret = _scompress_decompress(decoder, data, length, decoder->scratch, size);
+	if (ret > 0)
+		_scompress_unfilter(decoder->filter, decoder->stride, decoder->scratch, ret, frame);
+	return ret;
+}
+
+void scompress_decoderdestroy(SCompressDecoder_t *decoder)
+{
+#ifdef HAVE_LIBZSTD
+	if (decoder->dctx)
+		ZSTD_freeDCtx(decoder->dctx);
+#endif
+	free(decoder->scratch);
+	free(decoder);
+}
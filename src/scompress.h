@@ -0,0 +1,122 @@
+#ifndef __SCOMPRESS_H__
+#define __SCOMPRESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * the compression methods, the value is written into the header of the
+ * container.
+ */
+#define SCOMPRESS_NONE 0
+#define SCOMPRESS_LZ4 1
+#define SCOMPRESS_ZSTD 2
+
+/**
+ * the filter prepares the samples before the compression: the low byte
+ * is the kind of samples, the high byte the distance between two samples
+ * of the same color. The 8 bits samples are replaced by their difference
+ * with the previous one of the line. The 16 bits samples are replaced by
+ * the zigzag of this difference, and split into a plane of low bytes and
+ * a plane of high bytes, nearly empty for the 10 and 12 bits sensors.
+ */
+#define SCOMPRESS_FILTER_BYTES 1
+#define SCOMPRESS_FILTER_WORDS 2
+#define SCOMPRESS_FILTER(kind, distance) ((uint16_t)(((distance) << 8) | (kind)))
+
+/**
+ * @brief receive a compressed frame, the calls follow the order of
+ * scompress_push and never overlap.
+ *
+ * @param arg the argument of scompress_create.
+ * @param data the compressed frame.
+ * @param length the size of the compressed frame.
+ * @param timestamp the timestamp given to scompress_push.
+ * @param sequence the sequence given to scompress_push.
+ *
+ * @return 0 on success, -1 on error.
+ */
+typedef int (*SCompressOutput_t)(void *arg, const char *data, size_t length, uint64_t timestamp, uint32_t sequence);
+
+typedef struct SCompress_s SCompress_t;
+
+/**
+ * @brief check the availability of a method.
+ *
+ * @return 1 if the method is built in.
+ */
+int scompress_supported(int method);
+/**
+ * @brief the method from its name, "lz4" or "zstd".
+ *
+ * @return the method, -1 if unknown.
+ */
+int scompress_method(const char *name);
+/**
+ * @brief choose the filter of a format, the Bayer and grey formats are
+ * filtered.
+ *
+ * @param fourcc the format of the frames.
+ * @param stride the number of bytes of a line.
+ *
+ * @return the filter, 0 without filter.
+ */
+uint16_t scompress_filter(uint32_t fourcc, uint32_t stride);
+/**
+ * @brief create a pool of compressors. Each worker owns a copy of the
+ * frame, the filtered samples and the compressed output.
+ *
+ * @param method SCOMPRESS_LZ4 or SCOMPRESS_ZSTD.
+ * @param level the level of zstd, 0 for the default. A negative level
+ * is faster, for LZ4 too.
+ * @param filter the value of scompress_filter.
+ * @param stride the number of bytes of a line.
+ * @param nworkers the number of threads, 0 for the number of CPUs.
+ * @param output the function receiving the compressed frames.
+ * @param arg the first argument of output.
+ *
+ * @return the pool, NULL on error.
+ */
+SCompress_t *scompress_create(int method, int level, uint16_t filter, uint32_t stride,
+		int nworkers, SCompressOutput_t output, void *arg);
+/**
+ * @brief copy a frame to an idle worker. The frame is dropped when all
+ * the workers are busy. The timestamp and the sequence are given back
+ * to the output function.
+ *
+ * @return 0 on success, 1 if the frame is dropped, -1 on error.
+ */
+int scompress_push(SCompress_t *compressor, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence);
+/**
+ * @brief compress and output the pending frames, then stop the workers.
+ */
+void scompress_destroy(SCompress_t *compressor);
+
+typedef struct SCompressDecoder_s SCompressDecoder_t;
+
+/**
+ * @brief create a decoder for one thread.
+ *
+ * @param method the method of the container.
+ * @param filter the filter of the container.
+ * @param stride the number of bytes of a line.
+ *
+ * @return the decoder, NULL if the method isn't supported.
+ */
+SCompressDecoder_t *scompress_decodercreate(int method, uint16_t filter, uint32_t stride);
+/**
+ * @brief decompress and unfilter a frame.
+ *
+ * @param decoder the decoder.
+ * @param data the compressed frame.
+ * @param length the size of the compressed frame.
+ * @param frame the memory receiving the frame.
+ * @param size the size of this memory.
+ *
+ * @return the size of the frame, -1 on error.
+ */
+ssize_t scompress_decode(SCompressDecoder_t *decoder, const char *data, size_t length, char *frame, size_t size);
+void scompress_decoderdestroy(SCompressDecoder_t *decoder);
+
+#endif
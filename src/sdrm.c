@@ -17,6 +17,8 @@
 #endif
 
 #include "log.h"
+#include "sclock.h"
+#include "sformat.h"
 #include "sdrm.h"
 
 #define MAX_BUFFERS 4
@@ -33,12 +35,14 @@ struct DisplayBuffer_s
 	uint32_t *memory;
 	uint32_t pitch;
 	uint32_t size;
+	uint64_t timestamp;
 	uint8_t queued :1;
 };
 
 typedef struct Display_s Display_t;
 struct Display_s
 {
+	DisplayConf_t *config;
 #ifdef HAVE_LIBKMS
 	struct kms_driver *kms;
 #endif
@@ -50,11 +54,13 @@ struct Display_s
 	uint32_t fourcc;
 	int type;
 	int fd;
+	clockid_t clock;
 	drmModeModeInfo mode;
 	DisplayBuffer_t buffers[MAX_BUFFERS];
 	int nbuffers;
 	int buf_id;
 	int queueid;
+	int running;
 };
 
 static int sdrm_ids(Display_t *disp, uint32_t *conn_id, uint32_t *enc_id, uint32_t *crtc_id, drmModeModeInfo *mode)
@@ -397,6 +403,28 @@ static void sdrm_freebuffer(Display_t *disp, DisplayBuffer_t *buffer)
 #endif
 }
 
+/**
+ * the imported buffers keep only a frame buffer and a handle on the dmabuf
+ */
+static void sdrm_releasebuffers(Display_t *disp)
+{
+	for (int i = 0; i < disp->nbuffers && i < MAX_BUFFERS; i++)
+	{
+		DisplayBuffer_t *buffer = &disp->buffers[i];
+		if (buffer->memory != NULL)
+			sdrm_freebuffer(disp, buffer);
+		else
+		{
+			struct drm_gem_close gem = {.handle = buffer->bo_handle};
+			drmModeRmFB(disp->fd, buffer->fb_id);
+			drmIoctl(disp->fd, DRM_IOCTL_GEM_CLOSE, &gem);
+		}
+		memset(buffer, 0, sizeof(*buffer));
+	}
+	disp->nbuffers = 0;
+	disp->queueid = 0;
+}
+
 Display_t *sdrm_create(const char *name, DisplayConf_t *config)
 {
 	int fd = 0;
@@ -416,7 +444,13 @@ Display_t *sdrm_create(const char *name, DisplayConf_t *config)
 	}
 
 	Display_t *disp = calloc(1, sizeof(*disp));
+	disp->config = config;
 	disp->fd = fd;
+	/// the old drivers stamp the events with the wall clock
+	uint64_t monotonic = 0;
+	disp->clock = CLOCK_REALTIME;
+	if (!drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &monotonic) && monotonic)
+		disp->clock = CLOCK_MONOTONIC;
 	disp->fourcc = FOURCC('A','R','2','4');
 	disp->type = DRM_PLANE_TYPE_PRIMARY;
 
@@ -431,8 +465,8 @@ Display_t *sdrm_create(const char *name, DisplayConf_t *config)
 	}
 	if (sdrm_plane(disp, &disp->plane_id) == -1)
 	{
-		free(disp);
-		return NULL;
+		/// the format may be negotiated later with sdrm_setformat
+		warn("sdrm: format %.4s not supported by the planes", (char *)&disp->fourcc);
 	}
 #ifdef HAVE_LIBKMS
 	if (kms_create(fd, &disp->kms))
@@ -443,6 +477,84 @@ Display_t *sdrm_create(const char *name, DisplayConf_t *config)
 	return disp;
 }
 
+int sdrm_formats(Display_t *disp, int (*cb)(void *arg, DeviceFormat_t *format), void *arg)
+{
+	drmModeConnectorPtr connector = drmModeGetConnector(disp->fd, disp->connector_id);
+	if (connector == NULL)
+		return -1;
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(disp->fd);
+	if (planes == NULL)
+	{
+		drmModeFreeConnector(connector);
+		return -1;
+	}
+	int nformats = 0;
+	for (int i = 0; i < planes->count_planes; ++i)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(disp->fd, planes->planes[i]);
+		int type = (int)sdrm_properties(disp, plane->plane_id, "type");
+		if (type != disp->type)
+		{
+			drmModeFreePlane(plane);
+			continue;
+		}
+		for (int j = 0; j < plane->count_formats; ++j)
+		{
+			uint32_t fourcc = sformat_fromdrm(plane->formats[j]);
+			if (fourcc == 0)
+				continue;
+			/// the imported buffer must cover the whole mode
+			for (int m = 0; m < connector->count_modes; m++)
+			{
+				DeviceFormat_t format = {
+					.fourcc = fourcc,
+					.minwidth = connector->modes[m].hdisplay,
+					.maxwidth = connector->modes[m].hdisplay,
+					.stepwidth = 1,
+					.minheight = connector->modes[m].vdisplay,
+					.maxheight = connector->modes[m].vdisplay,
+					.stepheight = 1,
+				};
+				cb(arg, &format);
+			}
+			nformats++;
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+	drmModeFreeConnector(connector);
+	return nformats;
+}
+
+int sdrm_setformat(Display_t *disp, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	if (disp->running)
+	{
+		err("sdrm: format is locked by the buffers");
+		return -1;
+	}
+	/// the stopped display imports new buffers after a source change
+	sdrm_releasebuffers(disp);
+	if (width != disp->mode.hdisplay || height != disp->mode.vdisplay)
+	{
+		disp->mode.hdisplay = width;
+		disp->mode.vdisplay = height;
+		if (sdrm_ids(disp, &disp->connector_id, &disp->encoder_id, &disp->crtc_id, &disp->mode) == -1)
+			return -1;
+	}
+	/// the pipeline negotiates the V4L2 codes
+	disp->fourcc = sformat_todrm(fourcc);
+	if (disp->fourcc == 0 || sdrm_plane(disp, &disp->plane_id) == -1)
+	{
+		err("sdrm: format %.4s not supported", (char *)&fourcc);
+		return -1;
+	}
+	disp->config->parent.fourcc = disp->fourcc;
+	disp->config->parent.width = disp->mode.hdisplay;
+	disp->config->parent.height = disp->mode.vdisplay;
+	return 0;
+}
+
 int sdrm_requestbuffer(Display_t *disp, enum buf_type_e t, ...)
 {
 	va_list ap;
@@ -479,6 +591,14 @@ int sdrm_requestbuffer(Display_t *disp, enum buf_type_e t, ...)
 			int ntargets = va_arg(ap, int);
 			int *targets = va_arg(ap, int *);
 			size_t size = va_arg(ap, size_t);
+			/// a new request replaces the previous buffers (source change)
+			sdrm_releasebuffers(disp);
+			if (ntargets > MAX_BUFFERS)
+			{
+				err("sdrm: %d buffers for %d framebuffers", ntargets, MAX_BUFFERS);
+				va_end(ap);
+				return -1;
+			}
 			for (int i = 0; i < ntargets; i++)
 			{
 				if (sdrm_buffer_setdma(disp, size, targets[i], &disp->buffers[i]))
@@ -541,6 +661,8 @@ static void page_flip_handler(int fd, unsigned int frame,
 	Display_t *disp = data;
 	int id = disp->queueid;
 	disp->buffers[(int)id].queued = 0;
+	struct timeval tv = {.tv_sec = sec, .tv_usec = usec};
+	disp->buffers[(int)id].timestamp = sclock_timeval(disp->clock, &tv);
 }
 
 int sdrm_queue(Display_t *disp, int id)
@@ -570,6 +692,13 @@ int sdrm_dequeue(Display_t *disp, void **mem, size_t *bytesused)
 	return id;
 }
 
+uint64_t sdrm_timestamp(Display_t *disp, int id)
+{
+	if (id < 0 || id >= disp->nbuffers)
+		return 0;
+	return disp->buffers[id].timestamp;
+}
+
 int sdrm_fd(Display_t *disp)
 {
 	return disp->fd;
@@ -577,6 +706,7 @@ int sdrm_fd(Display_t *disp)
 
 int sdrm_start(Display_t *disp)
 {
+	disp->running = 1;
 	return 0;
 }
 
@@ -708,6 +838,7 @@ int sdrm_loadjsonconfiguration(void *arg, void *entry)
 
 int sdrm_stop(Display_t *disp)
 {
+	disp->running = 0;
 	return 0;
 }
 
@@ -1,6 +1,8 @@
 #ifndef __SDRM_H__
 #define __SDRM_H__
 
+#include <stdint.h>
+
 #include "config.h"
 
 #define DISPLAYCONFIG(name, defaultdevice) name = { \
@@ -22,9 +24,20 @@ DeviceConf_t * sdrm_createconfig();
 
 Display_t *sdrm_create(const char *name, DisplayConf_t *config);
 int sdrm_requestbuffer(Display_t *dev, enum buf_type_e t, ...);
+int sdrm_formats(Display_t *disp, int (*cb)(void *arg, DeviceFormat_t *format), void *arg);
+int sdrm_setformat(Display_t *disp, uint32_t fourcc, uint32_t width, uint32_t height);
 int sdrm_fd(Display_t *disp);
 int sdrm_queue(Display_t *disp, int id);
 int sdrm_dequeue(Display_t *disp, void **mem, size_t *bytesused);
+/**
+ * @brief get the time of the page flip which displayed a buffer.
+ *
+ * @param disp the Display_t object.
+ * @param id the index of the buffer.
+ *
+ * @return the time in ns into the clock domain of the pipeline, 0 if unknown.
+ */
+uint64_t sdrm_timestamp(Display_t *disp, int id);
 int sdrm_start(Display_t *disp);
 int sdrm_stop(Display_t *disp);
 void sdrm_destroy(Display_t *disp);
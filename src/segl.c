@@ -10,6 +10,7 @@
 #include <GLES2/gl2ext.h>
 
 #include "segl.h"
+#include "sformat.h"
 #include "log.h"
 
 #ifdef HAVE_GBM
@@ -34,6 +35,7 @@ struct EGL_s
 	GLBuffer_t buffers[MAX_BUFFERS];
 	int curbufferid;
 	int nbuffers;
+	int running;
 };
 
 PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR = NULL;
@@ -228,6 +230,70 @@ static int link_texturedma(EGL_t *dev, int dma_fd, size_t size)
 	return 0;
 }
 
+int segl_formats(EGL_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg)
+{
+	PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT;
+	eglQueryDmaBufFormatsEXT = (void *) eglGetProcAddress("eglQueryDmaBufFormatsEXT");
+	if (eglQueryDmaBufFormatsEXT == NULL)
+	{
+		err("segl: dmabuf formats query not supported");
+		return -1;
+	}
+	EGLint nformats = 0;
+	if (!eglQueryDmaBufFormatsEXT(dev->egldisplay, 0, NULL, &nformats) || nformats == 0)
+		return -1;
+	EGLint *formats = calloc(nformats, sizeof(*formats));
+	eglQueryDmaBufFormatsEXT(dev->egldisplay, nformats, formats, &nformats);
+	/// the texture is scaled to the viewport, any size is accepted
+	GLint maxsize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+	for (int i = 0; i < nformats; i++)
+	{
+		if (sformat_fromdrm(formats[i]) == 0)
+			continue;
+		DeviceFormat_t format = {
+			.fourcc = sformat_fromdrm(formats[i]),
+			.minwidth = 1,
+			.maxwidth = maxsize,
+			.stepwidth = 1,
+			.minheight = 1,
+			.maxheight = maxsize,
+			.stepheight = 1,
+		};
+		cb(arg, &format);
+	}
+	free(formats);
+	return nformats;
+}
+
+static void segl_releasebuffers(EGL_t *dev)
+{
+	for (int i = 0; i < dev->nbuffers; i++)
+		glDeleteTextures(1, &dev->buffers[i].dma_texture);
+	dev->nbuffers = 0;
+}
+
+int segl_setformat(EGL_t *dev, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	if (dev->running)
+	{
+		err("segl: format is locked by the buffers");
+		return -1;
+	}
+	/// the stopped device imports new buffers after a source change
+	segl_releasebuffers(dev);
+	/// the pipeline negotiates the V4L2 codes, EGL imports the DRM ones
+	if (sformat_todrm(fourcc) == 0)
+	{
+		err("segl: format %.4s not supported", (char *)&fourcc);
+		return -1;
+	}
+	dev->config->parent.fourcc = sformat_todrm(fourcc);
+	dev->config->parent.width = width;
+	dev->config->parent.height = height;
+	return 0;
+}
+
 int segl_requestbuffer(EGL_t *dev, enum buf_type_e t, ...)
 {
 	va_list ap;
@@ -240,6 +306,13 @@ int segl_requestbuffer(EGL_t *dev, enum buf_type_e t, ...)
 			int ntargets = va_arg(ap, int);
 			int *targets = va_arg(ap, int *);
 			size_t size = va_arg(ap, size_t);
+			/// a new request replaces the previous buffers (source change)
+			segl_releasebuffers(dev);
+			if (ntargets > MAX_BUFFERS)
+			{
+				err("segl: %d buffers for %d textures", ntargets, MAX_BUFFERS);
+				break;
+			}
 			for (int i = 0; i < ntargets; i++)
 			{
 				ret = link_texturedma(dev, targets[i], size);
@@ -266,12 +339,14 @@ int segl_start(EGL_t *dev)
 
 	eglMakeCurrent(dev->egldisplay, dev->eglsurface, dev->eglsurface, dev->eglcontext);
 	dev->curbufferid = -1;
+	dev->running = 1;
 	return 0;
 }
 
 int segl_stop(EGL_t *dev)
 {
 	eglMakeCurrent(dev->egldisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	dev->running = 0;
 	return 0;
 };
 
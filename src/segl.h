@@ -70,6 +70,8 @@ typedef struct EGL_s EGL_t;
 
 EGL_t *segl_create(const char *devicename, EGLConfig_t *config);
 int segl_requestbuffer(EGL_t *dev, enum buf_type_e t, ...);
+int segl_formats(EGL_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg);
+int segl_setformat(EGL_t *dev, uint32_t fourcc, uint32_t width, uint32_t height);
 int segl_queue(EGL_t *dev, int id, size_t bytesused);
 int segl_dequeue(EGL_t *dev, void **mem, size_t *bytesused);
 int segl_start(EGL_t *dev);
@@ -1,4 +1,6 @@
-﻿#include <stdarg.h>
+﻿#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,13 +9,22 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
 
 #ifdef HAVE_JANSSON
 #include <jansson.h>
 #endif
 
 #include "sfile.h"
+#include "sclock.h"
+#include "sformat.h"
+#include "sjpeg.h"
+#include "scompress.h"
 #include "config.h"
 #include "log.h"
 
@@ -22,11 +33,148 @@ struct FileBuffer_s
 {
 	void *mem;
 	int dma_buf;
+	int mapped;
+	int exported;
 	size_t size;
 	size_t bytesused;
+	uint64_t timestamp;
+	/// the time and the number of the frame given by its source
+	uint64_t stamp;
+	uint32_t sequence;
+	int stamped;
+	int queued;
+	int resync;
 	FileBuffer_t *next;
 };
 
+#define SEGMENT_NAMELENGTH 256
+
+/**
+ * a segment is opened by the helper thread before the rotation, and
+ * closed by it after the last write, the index receives its statistics.
+ */
+typedef struct FileSegment_s FileSegment_t;
+struct FileSegment_s
+{
+	int fd;
+	unsigned int number;
+	char name[SEGMENT_NAMELENGTH];
+	uint32_t frames;
+	uint64_t bytes;
+	uint64_t first;
+	uint64_t last;
+	FileSegment_t *next;
+};
+
+typedef struct FileSegmenter_s FileSegmenter_t;
+struct FileSegmenter_s
+{
+	int rootfd;
+	int indexfd;
+	const char *pattern;
+	int flags;
+	off_t prealloc;
+	unsigned int opened;
+	FileSegment_t *current;
+	FileSegment_t *ahead;
+	FileSegment_t *closing;
+	int failed;
+	int run;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+#define RECORD_ALIGN 4096
+#define RECORD_CHUNKSIZE (8 * 1024 * 1024)
+#define RECORD_NCHUNKS 4
+#define RECORD_SYNCSIZE (32 * 1024 * 1024)
+
+#define CHUNK_FREE 0
+#define CHUNK_FULL 1
+#define CHUNK_WRITING 2
+
+typedef struct FileChunk_s FileChunk_t;
+struct FileChunk_s
+{
+	char *mem;
+	size_t length;
+	int state;
+	/// the segment closed after the chunk, the next chunks go to fd
+	FileSegment_t *closed;
+	int fd;
+};
+
+/**
+ * the recorder copies the frames into aligned chunks, a thread writes
+ * the full chunks. The last chunk is written by the stop.
+ */
+typedef struct FileRecorder_s FileRecorder_t;
+struct FileRecorder_s
+{
+	int fd;
+	int direct;
+	FileChunk_t chunks[RECORD_NCHUNKS];
+	int current;
+	int next;
+	int run;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	off_t offset;
+	off_t synced;
+	uint32_t drops;
+	int error;
+	FileSegmenter_t *segmenter;
+};
+
+#define RING_DEFAULTFPS 30
+
+#define FORMAT_RAW 0
+#define FORMAT_CONTAINER 1
+#define FORMAT_Y4M 2
+#define FORMAT_PNM 3
+#define FORMAT_JPEG 4
+
+/// the importers of the dmabuf (sdrm, segl) hold 4 buffers at most
+#define EXPORT_NBUFFERS 4
+
+#define RING_ARMED 0
+#define RING_TRIGGERED 1
+
+typedef struct FileSlot_s FileSlot_t;
+struct FileSlot_s
+{
+	size_t length;
+	uint64_t timestamp;
+	uint32_t sequence;
+};
+
+/**
+ * the ring keeps the last seconds of frames in one arena. After a trigger,
+ * a thread drains it into the file from the oldest frame, and the new
+ * frames are appended behind until the end of the post trigger time.
+ */
+typedef struct FileRing_s FileRing_t;
+struct FileRing_s
+{
+	char *arena;
+	size_t arenasize;
+	size_t slotsize;
+	FileSlot_t *slots;
+	int nslots;
+	int head;
+	int tail;
+	int count;
+	int state;
+	uint64_t end;
+	int run;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t drops;
+};
+
 typedef struct File_s File_t;
 struct File_s
 {
@@ -37,8 +185,224 @@ struct File_s
 	size_t nbuffers;
 	FileBuffer_t *buffers;
 	int lastbufferid;
+	FileRecorder_t *recorder;
+	FileRing_t *ring;
+	FileSegmenter_t *segmenter;
+	SJpeg_t *encoder;
+	SCompress_t *compressor;
+	SCompressDecoder_t *decoder;
+	char header[128];
+	int headerlength;
+	int format;
+	/// the size of a frame without padding into the file, and into a buffer
+	size_t packsize;
+	size_t framesize;
+	char *pack;
+	/// the position into the current file of the next written byte
+	off_t offset;
+	uint32_t sequence;
+	FileIndexEntry_t *index;
+	uint32_t nindex;
+	uint32_t maxindex;
+	/// the container source is mapped and read from its index
+	char *map;
+	size_t mapsize;
+	FileIndexEntry_t *frames;
+	uint32_t nframes;
+	uint32_t cursor;
+	uint64_t first;
+	uint64_t start;
+	int resync;
+	int timerfd;
 };
 
+static int _sfile_sourceopen(File_t *dev);
+static int _sfile_export(File_t *dev, int *ntargets, int **targets, size_t *size);
+
+static void _sfile_segmentname(const char *pattern, unsigned int number, char *name, size_t length)
+{
+	if (strchr(pattern, '%'))
+		snprintf(name, length, pattern, number);
+	else
+		snprintf(name, length, "%s.%u", pattern, number);
+}
+
+static FileSegment_t *_sfile_segmentopen(FileSegmenter_t *segmenter)
+{
+	FileSegment_t *segment = calloc(1, sizeof(*segment));
+	segment->number = segmenter->opened + 1;
+	_sfile_segmentname(segmenter->pattern, segment->number, segment->name, sizeof(segment->name));
+	int mode = O_WRONLY | O_CREAT | O_TRUNC;
+	segment->fd = -1;
+	if (segmenter->flags & O_DIRECT)
+		segment->fd = openat(segmenter->rootfd, segment->name, mode | O_DIRECT, 0644);
+	if (segment->fd < 0)
+		segment->fd = openat(segmenter->rootfd, segment->name, mode, 0644);
+	if (segment->fd < 0)
+	{
+		err("sfile: segment \"%s\" opening error %m", segment->name);
+		free(segment);
+		return NULL;
+	}
+	/// the blocks are reserved without changing the size of the file
+	if (segmenter->prealloc > 0 &&
+		fallocate(segment->fd, FALLOC_FL_KEEP_SIZE, 0, segmenter->prealloc))
+		dbg("sfile: segment \"%s\" preallocation error %m", segment->name);
+	segmenter->opened = segment->number;
+	return segment;
+}
+
+static void _sfile_segmentfinish(FileSegmenter_t *segmenter, FileSegment_t *segment)
+{
+	struct stat sb;
+	/// the truncation releases the preallocated blocks behind the data
+	if (fstat(segment->fd, &sb) == 0)
+	{
+		segment->bytes = sb.st_size;
+		if (ftruncate(segment->fd, sb.st_size))
+			dbg("sfile: segment \"%s\" truncation error %m", segment->name);
+	}
+	fdatasync(segment->fd);
+	close(segment->fd);
+	if (segmenter->indexfd >= 0)
+		dprintf(segmenter->indexfd, "%u %s %llu %llu %u %llu\n",
+			segment->number, segment->name,
+			(unsigned long long)segment->first, (unsigned long long)segment->last,
+			segment->frames, (unsigned long long)segment->bytes);
+	dbg("sfile: segment \"%s\" closed with %u frames", segment->name, segment->frames);
+	free(segment);
+}
+
+static void *_sfile_segmentthread(void *arg)
+{
+	FileSegmenter_t *segmenter = arg;
+	pthread_mutex_lock(&segmenter->mutex);
+	while (1)
+	{
+		if (segmenter->closing)
+		{
+			FileSegment_t *segment = segmenter->closing;
+			segmenter->closing = segment->next;
+			pthread_mutex_unlock(&segmenter->mutex);
+			_sfile_segmentfinish(segmenter, segment);
+			pthread_mutex_lock(&segmenter->mutex);
+			continue;
+		}
+		if (!segmenter->run)
+			break;
+		if (segmenter->ahead == NULL && !segmenter->failed)
+		{
+			pthread_mutex_unlock(&segmenter->mutex);
+			FileSegment_t *segment = _sfile_segmentopen(segmenter);
+			pthread_mutex_lock(&segmenter->mutex);
+			segmenter->ahead = segment;
+			segmenter->failed = (segment == NULL);
+			continue;
+		}
+		pthread_cond_wait(&segmenter->cond, &segmenter->mutex);
+	}
+	pthread_mutex_unlock(&segmenter->mutex);
+	return NULL;
+}
+
+/**
+ * the segmenter owns the root directory, the first segment is opened
+ * by sfile_create with the name of the current segment.
+ */
+static FileSegmenter_t *_sfile_segmentercreate(int rootfd, const char *pattern, FileConfig_t *config)
+{
+	FileSegmenter_t *segmenter = calloc(1, sizeof(*segmenter));
+	segmenter->rootfd = rootfd;
+	segmenter->pattern = pattern;
+	segmenter->current = calloc(1, sizeof(*segmenter->current));
+	segmenter->current->fd = -1;
+	_sfile_segmentname(pattern, 0, segmenter->current->name, sizeof(segmenter->current->name));
+	char index[SEGMENT_NAMELENGTH];
+	if (config->segmentindex)
+		snprintf(index, sizeof(index), "%s", config->segmentindex);
+	else
+		snprintf(index, sizeof(index), "%s.idx", pattern);
+	segmenter->indexfd = openat(rootfd, index, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (segmenter->indexfd < 0)
+		warn("sfile: segment index \"%s\" opening error %m", index);
+	else
+		dprintf(segmenter->indexfd, "# number name first last frames bytes\n");
+	pthread_mutex_init(&segmenter->mutex, NULL);
+	pthread_cond_init(&segmenter->cond, NULL);
+	return segmenter;
+}
+
+static int _sfile_segmenterstart(File_t *dev)
+{
+	FileSegmenter_t *segmenter = dev->segmenter;
+	FileConfig_t *config = dev->config;
+	if (segmenter->run)
+		return 0;
+	size_t framesize = (dev->nbuffers > 0)? dev->buffers[0].size: 0;
+	int fps = (config->fps > 0)? config->fps: RING_DEFAULTFPS;
+	if (config->segmentsize > 0)
+		segmenter->prealloc = config->segmentsize;
+	else if (config->segmentframes > 0)
+		segmenter->prealloc = (off_t)config->segmentframes * framesize;
+	else
+		segmenter->prealloc = (off_t)config->segmentduration * fps * framesize;
+	segmenter->prealloc += dev->headerlength;
+	segmenter->flags = fcntl(segmenter->current->fd, F_GETFL);
+	if (segmenter->current->bytes == 0 && segmenter->prealloc > 0 &&
+		fallocate(segmenter->current->fd, FALLOC_FL_KEEP_SIZE, 0, segmenter->prealloc))
+		dbg("sfile: segment preallocation error %m");
+	segmenter->run = 1;
+	if (pthread_create(&segmenter->thread, NULL, _sfile_segmentthread, segmenter))
+	{
+		err("sfile: segment thread error %m");
+		segmenter->run = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void _sfile_segmentclose(FileSegmenter_t *segmenter, FileSegment_t *segment)
+{
+	pthread_mutex_lock(&segmenter->mutex);
+	FileSegment_t **last = &segmenter->closing;
+	while (*last)
+		last = &(*last)->next;
+	segment->next = NULL;
+	*last = segment;
+	pthread_cond_broadcast(&segmenter->cond);
+	pthread_mutex_unlock(&segmenter->mutex);
+}
+
+static void _sfile_segmenterdestroy(FileSegmenter_t *segmenter)
+{
+	if (segmenter->run)
+	{
+		pthread_mutex_lock(&segmenter->mutex);
+		segmenter->run = 0;
+		pthread_cond_broadcast(&segmenter->cond);
+		pthread_mutex_unlock(&segmenter->mutex);
+		pthread_join(segmenter->thread, NULL);
+	}
+	if (segmenter->current->fd >= 0)
+		_sfile_segmentfinish(segmenter, segmenter->current);
+	else
+		free(segmenter->current);
+	/// the segment opened ahead never received data
+	if (segmenter->ahead)
+	{
+		close(segmenter->ahead->fd);
+		unlinkat(segmenter->rootfd, segmenter->ahead->name, 0);
+		free(segmenter->ahead);
+	}
+	if (segmenter->indexfd >= 0)
+		close(segmenter->indexfd);
+	if (segmenter->rootfd != AT_FDCWD)
+		close(segmenter->rootfd);
+	pthread_mutex_destroy(&segmenter->mutex);
+	pthread_cond_destroy(&segmenter->cond);
+	free(segmenter);
+}
+
 File_t * sfile_create(const char *filename, FileConfig_t *config)
 {
 	int rootfd = AT_FDCWD;
@@ -79,10 +443,6 @@ File_t * sfile_create(const char *filename, FileConfig_t *config)
 			return NULL;
 		}
 		fsize = sb.st_size;
-		for (int i = 0; i < sb.st_blocks; i++)
-		{
-
-		}
 	}
 	else
 	{
@@ -92,21 +452,88 @@ File_t * sfile_create(const char *filename, FileConfig_t *config)
 		config->direction = File_Input_e;
 	}
 
-	int fd = openat(rootfd, filename, mode, 0644);
+	FileSegmenter_t *segmenter = NULL;
+	const char *name = filename;
+	if ((config->direction & File_Input_e) &&
+		(config->segmentframes > 0 || config->segmentsize > 0 || config->segmentduration > 0))
+	{
+		segmenter = _sfile_segmentercreate(rootfd, filename, config);
+		name = segmenter->current->name;
+		mode |= O_CREAT | O_TRUNC;
+	}
+
+	int fd = -1;
+	/// the recording bypasses the page cache when the filesystem allows it
+	if ((config->mode & FILE_MODE_RECORD) && (config->direction & File_Input_e))
+		fd = openat(rootfd, name, mode | O_DIRECT, 0644);
+	if (fd < 0)
+		fd = openat(rootfd, name, mode, 0644);
 	if (fd < 0)
 	{
-		err("file \"%s\" opening error %m", filename);
+		err("file \"%s\" opening error %m", name);
+		if (segmenter)
+			_sfile_segmenterdestroy(segmenter);
 		return NULL;
 	}
-	close(rootfd);
+	if (segmenter)
+		segmenter->current->fd = fd;
+	else
+		close(rootfd);
 	File_t *dev = calloc(1, sizeof(*dev));
 	dev->fd = fd;
 	dev->size = fsize;
 	dev->config = config;
 	dev->path = filename;
+	dev->segmenter = segmenter;
+	dev->timerfd = -1;
+	if ((config->direction & File_Output_e) && fsize >= sizeof(uint32_t))
+		_sfile_sourceopen(dev);
 	return dev;
 }
 
+static void _sfile_freebuffers(File_t *dev)
+{
+	for (int i = 0; i < dev->nbuffers; i++)
+	{
+		if (dev->buffers[i].mapped)
+			munmap(dev->buffers[i].mem, dev->buffers[i].size);
+		if (dev->buffers[i].exported)
+			close(dev->buffers[i].dma_buf);
+	}
+	free(dev->buffers);
+	dev->buffers = NULL;
+	dev->nbuffers = 0;
+}
+
+/**
+ * the dmabuf are mapped once, each access of the CPU is bracketed
+ * by the synchronization of the cache.
+ */
+static int _sfile_mapdma(File_t *dev, FileBuffer_t *buffer)
+{
+	int prot = PROT_READ;
+	/// the decoder reads back the previous samples of the frame
+	if (dev->config->direction & File_Output_e)
+		prot = PROT_READ | PROT_WRITE;
+	buffer->mem = mmap(NULL, buffer->size, prot, MAP_SHARED, buffer->dma_buf, 0);
+	if (buffer->mem == MAP_FAILED)
+	{
+		err("sfile: dmabuf %d mapping error %m", buffer->dma_buf);
+		buffer->mem = NULL;
+		return -1;
+	}
+	buffer->mapped = 1;
+	return 0;
+}
+
+static void _sfile_syncdma(FileBuffer_t *buffer, uint64_t flags)
+{
+	struct dma_buf_sync sync = { 0 };
+	sync.flags = flags;
+	if (ioctl(buffer->dma_buf, DMA_BUF_IOCTL_SYNC, &sync))
+		dbg("sfile: dmabuf %d sync error %m", buffer->dma_buf);
+}
+
 int sfile_requestbuffer(File_t *dev, enum buf_type_e t, ...)
 {
 	FileConfig_t *config = dev->config;
@@ -129,6 +556,7 @@ int sfile_requestbuffer(File_t *dev, enum buf_type_e t, ...)
 				if (i < (nmem - 1))
 					buffers[i].next = &buffers[i + 1];
 			}
+			_sfile_freebuffers(dev);
 			dev->buffers = buffers;
 			dev->nbuffers = nmem;
 		}
@@ -140,15 +568,26 @@ int sfile_requestbuffer(File_t *dev, enum buf_type_e t, ...)
 			size_t size = va_arg(ap, size_t);
 			FileBuffer_t *buffers = NULL;
 			buffers = calloc(ntargets, sizeof(FileBuffer_t));
+			_sfile_freebuffers(dev);
+			dev->buffers = buffers;
+			dev->nbuffers = ntargets;
 			for (int i = 0; i < ntargets; i++)
 			{
 				buffers[i].dma_buf = targets[i];
 				buffers[i].size = size;
 				if (i < (ntargets - 1))
 					buffers[i].next = &buffers[i + 1];
+				if (_sfile_mapdma(dev, &buffers[i]))
+					ret = -1;
 			}
-			dev->buffers = buffers;
-			dev->nbuffers = ntargets;
+		}
+		break;
+		case buf_type_dmabuf | buf_type_master:
+		{
+			int *ntargets = va_arg(ap, int *);
+			int **targets = va_arg(ap, int **);
+			size_t *size = va_arg(ap, size_t *);
+			ret = _sfile_export(dev, ntargets, targets, size);
 		}
 		break;
 		default:
@@ -165,28 +604,1291 @@ int sfile_fd(File_t *dev)
 	return dev->fd;
 }
 
-int sfile_start(File_t *dev)
+static int _sfile_writeall(int fd, const char *mem, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t ret = write(fd, mem, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		mem += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+/**
+ * without O_DIRECT, the written pages are flushed and dropped from
+ * the page cache behind the recording.
+ */
+static void _sfile_recordsync(FileRecorder_t *recorder)
+{
+	if (recorder->direct || recorder->offset - recorder->synced < RECORD_SYNCSIZE)
+		return;
+	off_t length = recorder->offset - recorder->synced;
+	sync_file_range(recorder->fd, recorder->synced, length, SYNC_FILE_RANGE_WRITE);
+	if (recorder->synced >= RECORD_SYNCSIZE)
+	{
+		off_t previous = recorder->synced - RECORD_SYNCSIZE;
+		sync_file_range(recorder->fd, previous, RECORD_SYNCSIZE,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(recorder->fd, previous, RECORD_SYNCSIZE, POSIX_FADV_DONTNEED);
+	}
+	recorder->synced = recorder->offset;
+}
+
+static int _sfile_recordchunk(FileRecorder_t *recorder, FileChunk_t *chunk)
+{
+	size_t aligned = chunk->length & ~(size_t)(RECORD_ALIGN - 1);
+	if (!recorder->direct)
+		aligned = chunk->length;
+	if (_sfile_writeall(recorder->fd, chunk->mem, aligned))
+		return -1;
+	/// only the last chunk may have a tail, it is written through the page cache
+	if (aligned < chunk->length)
+	{
+		int flags = fcntl(recorder->fd, F_GETFL);
+		fcntl(recorder->fd, F_SETFL, flags & ~O_DIRECT);
+		recorder->direct = 0;
+		if (_sfile_writeall(recorder->fd, chunk->mem + aligned, chunk->length - aligned))
+			return -1;
+	}
+	recorder->offset += chunk->length;
+	_sfile_recordsync(recorder);
+	return 0;
+}
+
+static void *_sfile_recordthread(void *arg)
+{
+	FileRecorder_t *recorder = arg;
+	pthread_mutex_lock(&recorder->mutex);
+	while (1)
+	{
+		FileChunk_t *chunk = &recorder->chunks[recorder->next];
+		while (chunk->state != CHUNK_FULL && recorder->run)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		if (chunk->state != CHUNK_FULL)
+			break;
+		chunk->state = CHUNK_WRITING;
+		pthread_mutex_unlock(&recorder->mutex);
+		int ret = _sfile_recordchunk(recorder, chunk);
+		pthread_mutex_lock(&recorder->mutex);
+		if (ret)
+		{
+			err("sfile: recording error %m");
+			recorder->error = errno;
+		}
+		/// the rotation is done by the thread, after the last chunk of the segment
+		if (chunk->closed)
+		{
+			_sfile_segmentclose(recorder->segmenter, chunk->closed);
+			recorder->fd = chunk->fd;
+			recorder->direct = (fcntl(recorder->fd, F_GETFL) & O_DIRECT) == O_DIRECT;
+			recorder->offset = 0;
+			recorder->synced = 0;
+			chunk->closed = NULL;
+		}
+		chunk->length = 0;
+		chunk->state = CHUNK_FREE;
+		recorder->next = (recorder->next + 1) % RECORD_NCHUNKS;
+		pthread_cond_broadcast(&recorder->cond);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+	return NULL;
+}
+
+static FileRecorder_t *_sfile_recordercreate(File_t *dev)
+{
+	FileRecorder_t *recorder = calloc(1, sizeof(*recorder));
+	recorder->fd = dev->fd;
+	recorder->direct = (fcntl(dev->fd, F_GETFL) & O_DIRECT) == O_DIRECT;
+	recorder->offset = lseek(dev->fd, 0, SEEK_CUR);
+	recorder->synced = recorder->offset;
+	recorder->segmenter = dev->segmenter;
+	for (int i = 0; i < RECORD_NCHUNKS; i++)
+	{
+		if (posix_memalign((void **)&recorder->chunks[i].mem, RECORD_ALIGN, RECORD_CHUNKSIZE))
+		{
+			err("sfile: recording memory error");
+			for (int j = 0; j < i; j++)
+				free(recorder->chunks[j].mem);
+			free(recorder);
+			return NULL;
+		}
+	}
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	recorder->run = 1;
+	if (pthread_create(&recorder->thread, NULL, _sfile_recordthread, recorder))
+	{
+		err("sfile: recording thread error %m");
+		for (int i = 0; i < RECORD_NCHUNKS; i++)
+			free(recorder->chunks[i].mem);
+		free(recorder);
+		return NULL;
+	}
+	dbg("sfile: recording %s the page cache", recorder->direct? "without": "with");
+	return recorder;
+}
+
+/**
+ * the frame is dropped when the chunks can't store it, the capture
+ * mustn't wait the disk. The parts of the frame are stored together.
+ *
+ * @return 1 if the frame is dropped, -1 on error, 0 otherwise.
+ */
+static int _sfile_record(FileRecorder_t *recorder, const struct iovec *iov, int niov)
+{
+	size_t length = 0;
+	for (int i = 0; i < niov; i++)
+		length += iov[i].iov_len;
+	pthread_mutex_lock(&recorder->mutex);
+	size_t space = 0;
+	for (int i = 0; i < RECORD_NCHUNKS; i++)
+	{
+		FileChunk_t *chunk = &recorder->chunks[(recorder->current + i) % RECORD_NCHUNKS];
+		if (chunk->state != CHUNK_FREE)
+			break;
+		space += RECORD_CHUNKSIZE - chunk->length;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+	if (space < length)
+	{
+		recorder->drops++;
+		warn("sfile: recording too slow, %u frames dropped", recorder->drops);
+		return 1;
+	}
+	for (int i = 0; i < niov; i++)
+	{
+		const char *mem = iov[i].iov_base;
+		length = iov[i].iov_len;
+		while (length > 0)
+		{
+			FileChunk_t *chunk = &recorder->chunks[recorder->current];
+			size_t size = RECORD_CHUNKSIZE - chunk->length;
+			if (size > length)
+				size = length;
+			memcpy(chunk->mem + chunk->length, mem, size);
+			chunk->length += size;
+			mem += size;
+			length -= size;
+			if (chunk->length == RECORD_CHUNKSIZE)
+			{
+				pthread_mutex_lock(&recorder->mutex);
+				chunk->state = CHUNK_FULL;
+				recorder->current = (recorder->current + 1) % RECORD_NCHUNKS;
+				pthread_cond_broadcast(&recorder->cond);
+				pthread_mutex_unlock(&recorder->mutex);
+			}
+		}
+	}
+	return (recorder->error)? -1: 0;
+}
+
+/**
+ * the current chunk is closed even if it isn't full, the rotation is
+ * postponed when it is still waiting the thread.
+ */
+static int _sfile_recordrotate(FileRecorder_t *recorder, int fd, FileSegment_t *closed)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	FileChunk_t *chunk = &recorder->chunks[recorder->current];
+	if (chunk->state != CHUNK_FREE)
+	{
+		pthread_mutex_unlock(&recorder->mutex);
+		return -1;
+	}
+	chunk->closed = closed;
+	chunk->fd = fd;
+	chunk->state = CHUNK_FULL;
+	recorder->current = (recorder->current + 1) % RECORD_NCHUNKS;
+	pthread_cond_broadcast(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	return 0;
+}
+
+static void _sfile_recorderdestroy(FileRecorder_t *recorder)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	FileChunk_t *chunk = &recorder->chunks[recorder->current];
+	if (chunk->length > 0)
+		chunk->state = CHUNK_FULL;
+	recorder->run = 0;
+	pthread_cond_broadcast(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+	fdatasync(recorder->fd);
+	if (recorder->drops)
+		warn("sfile: recording dropped %u frames", recorder->drops);
+	for (int i = 0; i < RECORD_NCHUNKS; i++)
+		free(recorder->chunks[i].mem);
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->cond);
+	free(recorder);
+}
+
+/**
+ * @return 1 if the data is dropped by the recorder, -1 on error, 0 otherwise.
+ */
+static int _sfile_outputv(File_t *dev, const struct iovec *iov, int niov)
+{
+	int ret = 0;
+	if (dev->recorder)
+		ret = _sfile_record(dev->recorder, iov, niov);
+	for (int i = 0; !dev->recorder && ret == 0 && i < niov; i++)
+		ret = _sfile_writeall(dev->fd, iov[i].iov_base, iov[i].iov_len);
+	if (ret != 0)
+		return ret;
+	for (int i = 0; i < niov; i++)
+	{
+		dev->offset += iov[i].iov_len;
+		if (dev->segmenter)
+			dev->segmenter->current->bytes += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int _sfile_output(File_t *dev, const char *mem, size_t length)
+{
+	struct iovec iov = {.iov_base = (void *)mem, .iov_len = length};
+	return _sfile_outputv(dev, &iov, 1);
+}
+
+static uint32_t _sfile_planes(uint32_t fourcc)
+{
+	switch (fourcc)
+	{
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+			return 2;
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		case FOURCC('4','2','2','P'):
+			return 3;
+		default:
+			break;
+	}
+	return 1;
+}
+
+static int _sfile_containerheader(File_t *dev)
 {
 	FileConfig_t *config = dev->config;
-	dev->lastbufferid = 0;
-	if (config->direction & File_Input_e)
+	FileHeader_t header = {
+		.magic = FILE_HEADER_MAGIC,
+		.version = FILE_VERSION,
+		.size = sizeof(FileHeader_t),
+		.fourcc = config->parent.fourcc,
+		.width = config->parent.width,
+		.height = config->parent.height,
+		.stride = config->parent.stride,
+		.planes = _sfile_planes(config->parent.fourcc),
+		.compression = config->compression,
+	};
+	if (config->compression)
+		header.filter = scompress_filter(config->parent.fourcc, config->parent.stride);
+	memcpy(dev->header, &header, sizeof(header));
+	if (dev->index == NULL)
+	{
+		dev->maxindex = 1024;
+		dev->index = calloc(dev->maxindex, sizeof(*dev->index));
+	}
+	dev->nindex = 0;
+	return sizeof(header);
+}
+
+static int _sfile_containerframe(File_t *dev, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	FileFrame_t frame = {
+		.magic = FILE_FRAME_MAGIC,
+		.sequence = sequence,
+		.timestamp = timestamp,
+		.bytesused = length,
+	};
+	off_t offset = dev->offset;
+	struct iovec iov[2] = {
+		{.iov_base = &frame, .iov_len = sizeof(frame)},
+		{.iov_base = (void *)mem, .iov_len = length},
+	};
+	int ret = _sfile_outputv(dev, iov, 2);
+	if (ret != 0)
+		return ret;
+	if (dev->nindex == dev->maxindex)
+	{
+		FileIndexEntry_t *index = realloc(dev->index, dev->maxindex * 2 * sizeof(*index));
+		if (index == NULL)
+			return 0;
+		dev->index = index;
+		dev->maxindex *= 2;
+	}
+	dev->index[dev->nindex].offset = offset;
+	dev->index[dev->nindex].timestamp = timestamp;
+	dev->nindex++;
+	return 0;
+}
+
+static int _sfile_jpegextension(const char *path)
+{
+	const char *extension = strrchr(path, '.');
+	return extension && (!strcasecmp(extension, ".jpg") || !strcasecmp(extension, ".jpeg") ||
+		!strcasecmp(extension, ".mjpg") || !strcasecmp(extension, ".mjpeg"));
+}
+
+int sfile_compressed(const char *filename, FileConfig_t *config)
+{
+	if (config->filename != NULL)
+		filename = config->filename;
+	if (!(config->direction & File_Input_e) || config->compression)
+		return 0;
+	if (config->mode & FILE_MODE_CONTAINER)
+		return 1;
+	if (config->mode & (FILE_MODE_Y4M | FILE_MODE_PNM | FILE_MODE_RAW))
+		return 0;
+	return (config->mode & FILE_MODE_JPEG) || _sfile_jpegextension(filename);
+}
+
+/**
+ * the format comes from the configuration, or from the extension of
+ * the file. The RGBA frames are written as PAM by default.
+ */
+static int _sfile_outputformat(File_t *dev)
+{
+	FileConfig_t *config = dev->config;
+	/// the container keeps the size of each compressed frame
+	if ((config->mode & FILE_MODE_CONTAINER) || config->compression)
+		return FORMAT_CONTAINER;
+	if (config->mode & FILE_MODE_Y4M)
+		return FORMAT_Y4M;
+	if (config->mode & FILE_MODE_PNM)
+		return FORMAT_PNM;
+	if (config->mode & FILE_MODE_RAW)
+		return FORMAT_RAW;
+	const char *extension = strrchr(dev->path, '.');
+	int jpeg = (config->mode & FILE_MODE_JPEG) || _sfile_jpegextension(dev->path);
+	int compressed = (config->parent.fourcc == FOURCC('J','P','E','G') ||
+		config->parent.fourcc == FOURCC('M','J','P','G'));
+	/// the frames of a JPEG camera are already compressed
+	if (jpeg && compressed)
+		return FORMAT_RAW;
+#ifdef HAVE_LIBJPEG
+	if (jpeg && sjpeg_supported(config->parent.fourcc))
+		return FORMAT_JPEG;
+#endif
+	if (jpeg)
+		warn("sfile: %.4s frames can't be encoded to JPEG", (char *)&config->parent.fourcc);
+	if (extension && !strcasecmp(extension, ".y4m"))
+		return FORMAT_Y4M;
+	if (extension && (!strcasecmp(extension, ".pam") || !strcasecmp(extension, ".pnm") ||
+		!strcasecmp(extension, ".pgm") || !strcasecmp(extension, ".ppm")))
+		return FORMAT_PNM;
+	if (config->parent.fourcc == FOURCC('R','G','B','A') || config->parent.fourcc == FOURCC('A','B','2','4'))
+		return FORMAT_PNM;
+	/// the size of the compressed frames changes, the index of the container keeps it
+	if (compressed)
+		return FORMAT_CONTAINER;
+	return FORMAT_RAW;
+}
+
+/**
+ * the frames are packed when their lines are padded or their planes
+ * interleaved, otherwise they are written from the buffer.
+ *
+ * @return the length of the stream header, -1 on error.
+ */
+static int _sfile_imageheader(File_t *dev)
+{
+	FileConfig_t *config = dev->config;
+	uint32_t fourcc = config->parent.fourcc;
+	uint32_t width = config->parent.width;
+	uint32_t height = config->parent.height;
+	uint32_t stride = config->parent.stride;
+	int length = 0;
+	char header[128];
+	if (dev->format == FORMAT_Y4M)
+		length = sformat_y4mheader(dev->header, sizeof(dev->header), fourcc, width, height, config->fps);
+	else if (sformat_pnmheader(header, sizeof(header), fourcc, width, height) < 0)
+		length = -1;
+	dev->packsize = sformat_packedsize(fourcc, width, height);
+	if (length < 0 || dev->packsize == 0)
+		return -1;
+	if (stride == 0)
+		stride = dev->packsize / height;
+	dev->framesize = sformat_framesize(fourcc, width, height, stride);
+	if (dev->nbuffers > 0 && dev->buffers[0].size < dev->framesize)
 	{
-		switch (config->parent.fourcc)
+		err("sfile: buffers of %zu bytes too small for %ux%u", dev->buffers[0].size, width, height);
+		return -1;
+	}
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	free(dev->pack);
+	dev->pack = NULL;
+	if (sformat_layout(fourcc, width, height, stride, planes) == 0 ||
+		dev->framesize != dev->packsize || fourcc == FOURCC('Y','V','1','2'))
+		dev->pack = malloc(dev->packsize);
+	return length;
+}
+
+static int _sfile_imageframe(File_t *dev, const char *mem, size_t length)
+{
+	FileConfig_t *config = dev->config;
+	char header[128];
+	int hlength = 0;
+	if (dev->format == FORMAT_Y4M)
+		hlength = snprintf(header, sizeof(header), "FRAME\n");
+	else
+		hlength = sformat_pnmheader(header, sizeof(header), config->parent.fourcc,
+			config->parent.width, config->parent.height);
+	const char *data = mem;
+	if (dev->pack)
+	{
+		uint32_t stride = config->parent.stride;
+		if (stride == 0)
+			stride = dev->packsize / config->parent.height;
+		sformat_pack(config->parent.fourcc, config->parent.width, config->parent.height,
+			stride, mem, dev->pack);
+		data = dev->pack;
+	}
+	else if (length < dev->packsize)
+		dbg("sfile: frame of %zu bytes completed to %zu", length, dev->packsize);
+	struct iovec iov[2] = {
+		{.iov_base = header, .iov_len = hlength},
+		{.iov_base = (void *)data, .iov_len = dev->packsize},
+	};
+	return _sfile_outputv(dev, iov, 2);
+}
+
+/**
+ * the index is dropped with the recorder too slow, the reader scans
+ * the frames in this case.
+ */
+static int _sfile_containerindex(File_t *dev)
+{
+	FileIndex_t index = {
+		.magic = FILE_INDEX_MAGIC,
+		.count = dev->nindex,
+	};
+	FileTrailer_t trailer = {
+		.magic = FILE_TRAILER_MAGIC,
+		.count = dev->nindex,
+		.offset = dev->offset,
+	};
+	struct iovec iov[3] = {
+		{.iov_base = &index, .iov_len = sizeof(index)},
+		{.iov_base = dev->index, .iov_len = dev->nindex * sizeof(*dev->index)},
+		{.iov_base = &trailer, .iov_len = sizeof(trailer)},
+	};
+	return _sfile_outputv(dev, iov, 3);
+}
+
+/**
+ * the next segment is already opened by the helper thread, the frame
+ * loop only swaps the descriptors. Without it, the current segment grows.
+ */
+static int _sfile_rotate(File_t *dev)
+{
+	FileSegmenter_t *segmenter = dev->segmenter;
+	pthread_mutex_lock(&segmenter->mutex);
+	FileSegment_t *next = segmenter->ahead;
+	if (next == NULL && segmenter->failed)
+	{
+		segmenter->failed = 0;
+		pthread_cond_broadcast(&segmenter->cond);
+	}
+	pthread_mutex_unlock(&segmenter->mutex);
+	if (next == NULL)
+	{
+		warn("sfile: next segment not ready");
+		return -1;
+	}
+	FileSegment_t *closed = segmenter->current;
+	/// a failed rotation continues the segment, the next index covers all its frames
+	if (dev->index && _sfile_containerindex(dev) < 0)
+		err("sfile: segment index error %m");
+	if (dev->recorder && _sfile_recordrotate(dev->recorder, next->fd, closed))
+		return -1;
+	pthread_mutex_lock(&segmenter->mutex);
+	segmenter->ahead = NULL;
+	pthread_cond_broadcast(&segmenter->cond);
+	pthread_mutex_unlock(&segmenter->mutex);
+	segmenter->current = next;
+	dev->fd = next->fd;
+	dev->offset = 0;
+	dev->nindex = 0;
+	if (dev->recorder == NULL)
+		_sfile_segmentclose(segmenter, closed);
+	if (dev->headerlength > 0)
+		return _sfile_output(dev, dev->header, dev->headerlength);
+	return 0;
+}
+
+static int _sfile_store(File_t *dev, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	FileSegmenter_t *segmenter = dev->segmenter;
+	if (segmenter == NULL && dev->index)
+		return _sfile_containerframe(dev, mem, length, timestamp, sequence);
+	if (segmenter == NULL && (dev->format == FORMAT_Y4M || dev->format == FORMAT_PNM))
+		return _sfile_imageframe(dev, mem, length);
+	if (segmenter == NULL)
+		return _sfile_output(dev, mem, length);
+	FileConfig_t *config = dev->config;
+	FileSegment_t *segment = segmenter->current;
+	if (segment->frames > 0 &&
+		((config->segmentframes > 0 && segment->frames >= config->segmentframes) ||
+		(config->segmentsize > 0 && segment->bytes + length > config->segmentsize) ||
+		(config->segmentduration > 0 &&
+			timestamp - segment->first >= (uint64_t)config->segmentduration * 1000000000ULL)))
+	{
+		_sfile_rotate(dev);
+		segment = segmenter->current;
+	}
+	if (segment->frames == 0)
+		segment->first = timestamp;
+	segment->last = timestamp;
+	segment->frames++;
+	if (dev->index)
+		return _sfile_containerframe(dev, mem, length, timestamp, sequence);
+	if (dev->format == FORMAT_Y4M || dev->format == FORMAT_PNM)
+		return _sfile_imageframe(dev, mem, length);
+	return _sfile_output(dev, mem, length);
+}
+
+/**
+ * the encoder and the compressor call it from their workers, one at a
+ * time and in the order of the capture.
+ */
+static int _sfile_encoded(void *arg, const char *data, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	return _sfile_store((File_t *)arg, data, length, timestamp, sequence);
+}
+
+static int _sfile_frame(File_t *dev, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+#ifdef HAVE_LIBJPEG
+	if (dev->encoder)
+		return (sjpeg_push(dev->encoder, mem, length, timestamp, sequence) < 0)? -1: 0;
+#endif
+	if (dev->compressor)
+		return (scompress_push(dev->compressor, mem, length, timestamp, sequence) < 0)? -1: 0;
+	return _sfile_store(dev, mem, length, timestamp, sequence);
+}
+
+static void *_sfile_ringthread(void *arg)
+{
+	File_t *dev = arg;
+	FileRing_t *ring = dev->ring;
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->run || (ring->state == RING_TRIGGERED && ring->count > 0))
+	{
+		if (ring->state != RING_TRIGGERED || ring->count == 0)
+		{
+			pthread_cond_wait(&ring->cond, &ring->mutex);
+			continue;
+		}
+		/// the slot belongs to the thread until the tail moves
+		int index = ring->tail;
+		FileSlot_t *slot = &ring->slots[index];
+		pthread_mutex_unlock(&ring->mutex);
+		if (_sfile_frame(dev, ring->arena + index * ring->slotsize, slot->length,
+				slot->timestamp, slot->sequence) < 0)
+			err("sfile: pre trigger writing error %m");
+		pthread_mutex_lock(&ring->mutex);
+		ring->tail = (ring->tail + 1) % ring->nslots;
+		ring->count--;
+		if (ring->count == 0 && ring->end && sclock_now() > ring->end)
+		{
+			warn("sfile: end of trigger");
+			ring->state = RING_ARMED;
+		}
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return NULL;
+}
+
+static FileRing_t *_sfile_ringcreate(File_t *dev)
+{
+	FileConfig_t *config = dev->config;
+	int fps = (config->fps > 0)? config->fps: RING_DEFAULTFPS;
+	FileRing_t *ring = calloc(1, sizeof(*ring));
+	ring->nslots = config->pretrigger * fps;
+	ring->slotsize = dev->buffers[0].size;
+	ring->arenasize = ring->nslots * ring->slotsize;
+	ring->arena = mmap(NULL, ring->arenasize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->arena == MAP_FAILED)
+	{
+		err("sfile: pre trigger memory of %zu bytes error %m", ring->arenasize);
+		free(ring);
+		return NULL;
+	}
+	ring->slots = calloc(ring->nslots, sizeof(*ring->slots));
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	ring->state = RING_ARMED;
+	ring->run = 1;
+	dev->ring = ring;
+	if (pthread_create(&ring->thread, NULL, _sfile_ringthread, dev))
+	{
+		err("sfile: pre trigger thread error %m");
+		munmap(ring->arena, ring->arenasize);
+		free(ring->slots);
+		free(ring);
+		dev->ring = NULL;
+		return NULL;
+	}
+	dbg("sfile: pre trigger of %d frames", ring->nslots);
+	return ring;
+}
+
+/**
+ * before the trigger the oldest frame is overwritten, after it the new
+ * frame is dropped when the writing is too slow.
+ */
+static int _sfile_ringpush(FileRing_t *ring, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	if (length > ring->slotsize)
+		length = ring->slotsize;
+	pthread_mutex_lock(&ring->mutex);
+	if (ring->count == ring->nslots)
+	{
+		if (ring->state == RING_TRIGGERED)
+		{
+			ring->drops++;
+			pthread_mutex_unlock(&ring->mutex);
+			return 0;
+		}
+		ring->tail = (ring->tail + 1) % ring->nslots;
+		ring->count--;
+	}
+	int index = ring->head;
+	pthread_mutex_unlock(&ring->mutex);
+	/// the head slot isn't visible by the thread before the count
+	memcpy(ring->arena + index * ring->slotsize, mem, length);
+	pthread_mutex_lock(&ring->mutex);
+	ring->slots[index].length = length;
+	ring->slots[index].timestamp = timestamp;
+	ring->slots[index].sequence = sequence;
+	ring->head = (ring->head + 1) % ring->nslots;
+	ring->count++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+	return 0;
+}
+
+static void _sfile_ringdestroy(FileRing_t *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->run = 0;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+	pthread_join(ring->thread, NULL);
+	if (ring->drops)
+		warn("sfile: pre trigger dropped %u frames", ring->drops);
+	munmap(ring->arena, ring->arenasize);
+	free(ring->slots);
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+	free(ring);
+}
+
+int sfile_trigger(File_t *dev)
+{
+	FileRing_t *ring = dev->ring;
+	if (ring == NULL)
+		return -1;
+	FileConfig_t *config = dev->config;
+	uint64_t now = sclock_now();
+	pthread_mutex_lock(&ring->mutex);
+	if (ring->state == RING_ARMED)
+	{
+		/// the frames older than the pre trigger time are forgotten
+		uint64_t start = now - (uint64_t)config->pretrigger * 1000000000ULL;
+		while (ring->count > 0 && ring->slots[ring->tail].timestamp < start)
+		{
+			ring->tail = (ring->tail + 1) % ring->nslots;
+			ring->count--;
+		}
+		ring->state = RING_TRIGGERED;
+		warn("sfile: trigger with %d frames", ring->count);
+	}
+	ring->end = 0;
+	if (config->posttrigger > 0)
+		ring->end = now + (uint64_t)config->posttrigger * 1000000000ULL;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+	return 0;
+}
+
+static int _sfile_containerload(File_t *dev)
+{
+	FileTrailer_t trailer;
+	if (dev->mapsize < sizeof(FileHeader_t) + sizeof(FileIndex_t) + sizeof(trailer))
+		return -1;
+	memcpy(&trailer, dev->map + dev->mapsize - sizeof(trailer), sizeof(trailer));
+	if (trailer.magic != FILE_TRAILER_MAGIC)
+		return -1;
+	size_t length = (size_t)trailer.count * sizeof(FileIndexEntry_t);
+	if (trailer.offset + sizeof(FileIndex_t) + length + sizeof(trailer) != dev->mapsize)
+		return -1;
+	FileIndex_t index;
+	memcpy(&index, dev->map + trailer.offset, sizeof(index));
+	if (index.magic != FILE_INDEX_MAGIC || index.count != trailer.count)
+		return -1;
+	dev->frames = malloc(length + sizeof(FileIndexEntry_t));
+	memcpy(dev->frames, dev->map + trailer.offset + sizeof(index), length);
+	dev->nframes = trailer.count;
+	return 0;
+}
+
+static int _sfile_indexframe(File_t *dev, uint32_t *maxframes, uint64_t offset, uint64_t timestamp)
+{
+	if (dev->nframes == *maxframes)
+	{
+		FileIndexEntry_t *frames = realloc(dev->frames, *maxframes * 2 * sizeof(*frames));
+		if (frames == NULL)
+			return -1;
+		dev->frames = frames;
+		*maxframes *= 2;
+	}
+	dev->frames[dev->nframes].offset = offset;
+	dev->frames[dev->nframes].timestamp = timestamp;
+	dev->nframes++;
+	return 0;
+}
+
+/**
+ * the index of an interrupted recording is rebuilt from the frames,
+ * until the first truncated one.
+ */
+static int _sfile_containerscan(File_t *dev, size_t offset)
+{
+	uint32_t maxframes = 1024;
+	dev->frames = calloc(maxframes, sizeof(*dev->frames));
+	dev->nframes = 0;
+	while (offset + sizeof(uint32_t) <= dev->mapsize)
+	{
+		uint32_t magic;
+		memcpy(&magic, dev->map + offset, sizeof(magic));
+		if (magic == FILE_FRAME_MAGIC && offset + sizeof(FileFrame_t) <= dev->mapsize)
 		{
-			case FOURCC('R','G', 'B', 'A'):
-				dprintf(dev->fd, "P7 WIDTH %d HEIGHT %d DEPTH %d MAXVAL 255 TUPLTYPE RGB_ALPHA ENDHDR", config->parent.width, config->parent.height, config->parent.stride / config->parent.width);
+			FileFrame_t frame;
+			memcpy(&frame, dev->map + offset, sizeof(frame));
+			if (frame.bytesused > dev->mapsize - offset - sizeof(frame) ||
+				_sfile_indexframe(dev, &maxframes, offset, frame.timestamp))
+				break;
+			offset += sizeof(frame) + frame.bytesused;
+		}
+		else if (magic == FILE_INDEX_MAGIC && offset + sizeof(FileIndex_t) <= dev->mapsize)
+		{
+			FileIndex_t index;
+			memcpy(&index, dev->map + offset, sizeof(index));
+			offset += sizeof(index) + (size_t)index.count * sizeof(FileIndexEntry_t) + sizeof(FileTrailer_t);
+		}
+		else if (magic == FILE_HEADER_MAGIC && offset + sizeof(FileHeader_t) <= dev->mapsize)
+		{
+			FileHeader_t header;
+			memcpy(&header, dev->map + offset, sizeof(header));
+			offset += (header.size > 0)? header.size: sizeof(header);
+		}
+		else
 			break;
-			case FOURCC('J','P','E','G'):
-			case FOURCC('M','J','P','G'):
+	}
+	warn("sfile: container \"%s\" without index, %u frames found", dev->path, dev->nframes);
+	return 0;
+}
+
+static int _sfile_containeropen(File_t *dev)
+{
+	FileConfig_t *config = dev->config;
+	FileHeader_t header;
+	memcpy(&header, dev->map, sizeof(header));
+	if (header.version != FILE_VERSION)
+		warn("sfile: container version %u unknown", header.version);
+	config->parent.fourcc = header.fourcc;
+	config->parent.width = header.width;
+	config->parent.height = header.height;
+	config->parent.stride = header.stride;
+	if (_sfile_containerload(dev))
+		_sfile_containerscan(dev, (header.size > 0)? header.size: sizeof(header));
+	if (header.compression)
+		dev->decoder = scompress_decodercreate(header.compression, header.filter, header.stride);
+	if (header.compression && dev->decoder == NULL)
+	{
+		err("sfile: \"%s\" compressed with the method %u", dev->path, header.compression);
+		dev->nframes = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * the Y4M and PNM images are packed into the file, the stride of the
+ * configuration is kept if it is large enough.
+ */
+static int _sfile_imagescan(File_t *dev, SFormat_t *format, size_t offset)
+{
+	FileConfig_t *config = dev->config;
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	int nplanes = sformat_layout(format->fourcc, format->width, format->height, 0, planes);
+	uint32_t stride = config->parent.stride;
+	if (stride < planes[0].width)
+		stride = planes[0].width;
+	/// the chroma lines are half of the luma lines
+	if (nplanes > 1)
+		stride = (stride + 1) & ~1;
+	config->parent.fourcc = format->fourcc;
+	config->parent.width = format->width;
+	config->parent.height = format->height;
+	config->parent.stride = stride;
+	dev->packsize = sformat_packedsize(format->fourcc, format->width, format->height);
+	dev->framesize = sformat_framesize(format->fourcc, format->width, format->height, stride);
+	uint64_t period = 0;
+	if (format->fpsnum > 0)
+		period = 1000000000ULL * format->fpsden / format->fpsnum;
+	else if (config->fps > 0)
+		period = 1000000000ULL / config->fps;
+
+	uint32_t maxframes = 1024;
+	dev->frames = calloc(maxframes, sizeof(*dev->frames));
+	dev->nframes = 0;
+	while (offset < dev->mapsize)
+	{
+		size_t available = dev->mapsize - offset;
+		if (available > 4096)
+			available = 4096;
+		int length = -1;
+		SFormat_t next;
+		if (dev->format == FORMAT_Y4M)
+			length = sformat_y4mframe(dev->map + offset, available);
+		/// all the images of a PNM stream have the same definition
+		else if ((length = sformat_pnmparse(dev->map + offset, available, &next)) > 0 &&
+			(next.fourcc != format->fourcc || next.width != format->width || next.height != format->height))
+			length = -1;
+		if (length < 0 || offset + length + dev->packsize > dev->mapsize)
+			break;
+		offset += length;
+		uint64_t timestamp = (period > 0)? 1 + dev->nframes * period: 0;
+		if (_sfile_indexframe(dev, &maxframes, offset, timestamp))
+			break;
+		offset += dev->packsize;
+	}
+	return 0;
+}
+
+/**
+ * the file is read through its mapping when its format is known,
+ * the other files are read frame by frame.
+ */
+static int _sfile_sourceopen(File_t *dev)
+{
+	dev->map = mmap(NULL, dev->size, PROT_READ, MAP_SHARED, dev->fd, 0);
+	if (dev->map == MAP_FAILED)
+	{
+		err("sfile: \"%s\" mapping error %m", dev->path);
+		dev->map = NULL;
+		return -1;
+	}
+	dev->mapsize = dev->size;
+	madvise(dev->map, dev->mapsize, MADV_SEQUENTIAL);
+	size_t available = (dev->mapsize > 4096)? 4096: dev->mapsize;
+	uint32_t magic = 0;
+	memcpy(&magic, dev->map, sizeof(magic));
+	SFormat_t format;
+	int length = 0;
+	if (magic == FILE_HEADER_MAGIC && dev->mapsize >= sizeof(FileHeader_t))
+	{
+		dev->format = FORMAT_CONTAINER;
+		_sfile_containeropen(dev);
+	}
+	else if ((length = sformat_y4mparse(dev->map, available, &format)) > 0)
+	{
+		dev->format = FORMAT_Y4M;
+		_sfile_imagescan(dev, &format, length);
+	}
+	else if (sformat_pnmparse(dev->map, available, &format) > 0)
+	{
+		dev->format = FORMAT_PNM;
+		_sfile_imagescan(dev, &format, 0);
+	}
+	else
+	{
+		munmap(dev->map, dev->mapsize);
+		dev->map = NULL;
+		return 0;
+	}
+	dev->timerfd = timerfd_create(SCLOCK_DOMAIN, TFD_NONBLOCK);
+	FileConfig_t *config = dev->config;
+	dbg("sfile: \"%s\" of %u frames %.4s %ux%u", dev->path, dev->nframes,
+		(char *)&config->parent.fourcc, config->parent.width, config->parent.height);
+	return 0;
+}
+
+static void _sfile_sourceclose(File_t *dev)
+{
+	munmap(dev->map, dev->mapsize);
+	dev->map = NULL;
+	free(dev->frames);
+	dev->frames = NULL;
+	if (dev->decoder)
+		scompress_decoderdestroy(dev->decoder);
+	dev->decoder = NULL;
+}
+
+static int _sfile_framedata(File_t *dev, uint32_t index, const char **data, size_t *length, uint64_t *timestamp)
+{
+	FileIndexEntry_t *entry = &dev->frames[index];
+	if (dev->format != FORMAT_CONTAINER)
+	{
+		*data = dev->map + entry->offset;
+		*length = dev->packsize;
+		*timestamp = entry->timestamp;
+		return 0;
+	}
+	FileFrame_t frame;
+	if (entry->offset + sizeof(frame) > dev->mapsize)
+		return -1;
+	memcpy(&frame, dev->map + entry->offset, sizeof(frame));
+	if (frame.magic != FILE_FRAME_MAGIC ||
+		frame.bytesused > dev->mapsize - entry->offset - sizeof(frame))
+		return -1;
+	*data = dev->map + entry->offset + sizeof(frame);
+	*length = frame.bytesused;
+	*timestamp = frame.timestamp;
+	return 0;
+}
+
+/**
+ * the copy comes from the page cache, the next frame is read ahead
+ * by the kernel during the copy.
+ */
+static ssize_t _sfile_sourceread(File_t *dev, FileBuffer_t *buffer, size_t bytesused)
+{
+	FileConfig_t *config = dev->config;
+	buffer->timestamp = 0;
+	if (dev->cursor >= dev->nframes)
+		return 0;
+	const char *data = NULL;
+	size_t length = 0;
+	uint64_t timestamp = 0;
+	if (_sfile_framedata(dev, dev->cursor++, &data, &length, &timestamp))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (dev->cursor < dev->nframes)
+	{
+		size_t pagesize = sysconf(_SC_PAGESIZE);
+		size_t start = dev->frames[dev->cursor].offset & ~(pagesize - 1);
+		if (start < dev->mapsize)
+		{
+			size_t ahead = dev->mapsize - start;
+			if (ahead > length + pagesize)
+				ahead = length + pagesize;
+			madvise(dev->map + start, ahead, MADV_WILLNEED);
+		}
+	}
+	if (dev->decoder)
+	{
+		ssize_t ret = scompress_decode(dev->decoder, data, length, buffer->mem, bytesused);
+		if (ret < 0)
+		{
+			err("sfile: frame %u decompression error", dev->cursor - 1);
+			errno = EINVAL;
+			return -1;
+		}
+		length = ret;
+	}
+	else if (dev->format == FORMAT_CONTAINER)
+	{
+		if (length > bytesused)
+		{
+			warn("sfile: buffer too small for the frame %u", dev->cursor - 1);
+			length = bytesused;
+		}
+		memcpy(buffer->mem, data, length);
+	}
+	else
+	{
+		if (dev->framesize > bytesused)
+		{
+			err("sfile: buffer too small %zu for %zu", bytesused, dev->framesize);
+			errno = ENOMEM;
+			return -1;
+		}
+		length = sformat_unpack(config->parent.fourcc, config->parent.width, config->parent.height,
+			config->parent.stride, data, buffer->mem);
+	}
+	buffer->timestamp = timestamp;
+	buffer->resync = dev->resync;
+	dev->resync = 0;
+	return length;
+}
+
+/**
+ * a few page aligned places of a memfd are exported as dmabuf and mapped.
+ * They are filled at each queuing like the memory buffers, from the
+ * mapping of the file or from the decoder.
+ */
+static int _sfile_export(File_t *dev, int *ntargets, int **targets, size_t *size)
+{
+	FileConfig_t *config = dev->config;
+	if (!(config->direction & File_Output_e))
+	{
+		err("sfile: only a source exports its buffers");
+		return -1;
+	}
+	size_t framesize = 0;
+	uint32_t nframes = 0;
+	if (dev->map && dev->format != FORMAT_CONTAINER)
+	{
+		nframes = dev->nframes;
+		framesize = dev->framesize;
+	}
+	else if (dev->map && dev->decoder)
+	{
+		/// the compressed frames are as large as the frames of the recording
+		nframes = dev->nframes;
+		framesize = sformat_framesize(config->parent.fourcc, config->parent.width, config->parent.height,
+			config->parent.stride);
+		if (framesize == 0)
+			framesize = (size_t)config->parent.stride * config->parent.height;
+	}
+	else if (dev->map)
+	{
+		nframes = dev->nframes;
+		for (uint32_t i = 0; i < nframes; i++)
+		{
+			/// the entries of a corrupted index are refused by the reading too
+			FileFrame_t frame;
+			if (dev->frames[i].offset + sizeof(frame) > dev->mapsize)
+				continue;
+			memcpy(&frame, dev->map + dev->frames[i].offset, sizeof(frame));
+			if (frame.magic != FILE_FRAME_MAGIC ||
+				frame.bytesused > dev->mapsize - dev->frames[i].offset - sizeof(frame))
+				continue;
+			if (frame.bytesused > framesize)
+				framesize = frame.bytesused;
+		}
+	}
+	else
+	{
+		/// the raw file is read frame by frame
+		framesize = (size_t)config->parent.stride * config->parent.height;
+		if (framesize > 0)
+			nframes = dev->size / framesize;
+		dev->framesize = framesize;
+	}
+	if (nframes == 0 || framesize == 0)
+	{
+		err("sfile: \"%s\" without frame to export", dev->path);
+		return -1;
+	}
+	int nbuffers = EXPORT_NBUFFERS;
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t slotsize = (framesize + pagesize - 1) & ~(pagesize - 1);
+	size_t length = slotsize * nbuffers;
+
+	int udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf < 0)
+	{
+		err("sfile: udmabuf not available %m");
+		return -1;
+	}
+	/// udmabuf accepts only the memfd which can't shrink
+	int memfd = memfd_create("sfile", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, length) || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+	{
+		err("sfile: memfd of %zu bytes error %m", length);
+		if (memfd >= 0)
+			close(memfd);
+		close(udmabuf);
+		return -1;
+	}
+	FileBuffer_t *buffers = calloc(nbuffers, sizeof(FileBuffer_t));
+	int ret = 0;
+	for (int i = 0; i < nbuffers; i++)
+	{
+		FileBuffer_t *buffer = &buffers[i];
+		buffer->size = slotsize;
+		struct udmabuf_create create = {
+			.memfd = memfd,
+			.flags = UDMABUF_FLAGS_CLOEXEC,
+			.offset = i * slotsize,
+			.size = slotsize,
+		};
+		buffer->dma_buf = ioctl(udmabuf, UDMABUF_CREATE, &create);
+		if (buffer->dma_buf < 0)
+		{
+			err("sfile: udmabuf %d error %m", i);
+			ret = -1;
 			break;
-			default:
+		}
+		buffer->exported = 1;
+		if (_sfile_mapdma(dev, buffer))
+		{
+			ret = -1;
 			break;
 		}
+		if (i < (nbuffers - 1))
+			buffer->next = &buffers[i + 1];
+	}
+	/// the dmabuf keep the pages of the memfd
+	close(memfd);
+	close(udmabuf);
+	_sfile_freebuffers(dev);
+	dev->buffers = buffers;
+	dev->nbuffers = nbuffers;
+	if (ret)
+	{
+		_sfile_freebuffers(dev);
+		return -1;
+	}
+	dev->cursor = 0;
+	if (dev->timerfd < 0)
+		dev->timerfd = timerfd_create(SCLOCK_DOMAIN, TFD_NONBLOCK);
+	dbg("sfile: %d buffers of %zu bytes exported", nbuffers, slotsize);
+	if (ntargets != NULL)
+		*ntargets = nbuffers;
+	if (targets != NULL)
+	{
+		*targets = calloc(nbuffers, sizeof(int));
+		for (int i = 0; i < nbuffers; i++)
+			(*targets)[i] = buffers[i].dma_buf;
+	}
+	/// the importer computes the pitch from the size of the frame
+	if (size != NULL)
+		*size = framesize;
+	return 0;
+}
 
+/**
+ * the replay keeps the intervals between the frames, from the time
+ * of the first frame or of the first frame after a seek.
+ */
+static uint64_t _sfile_replaytime(File_t *dev, FileBuffer_t *buffer)
+{
+	if (buffer->timestamp == 0)
+		return 0;
+	if (dev->start == 0 || buffer->resync || buffer->timestamp < dev->first)
+	{
+		dev->start = sclock_now();
+		dev->first = buffer->timestamp;
+		buffer->resync = 0;
+	}
+	return dev->start + (buffer->timestamp - dev->first);
+}
+
+static void _sfile_replayarm(File_t *dev)
+{
+	FileBuffer_t *buffer = &dev->buffers[dev->lastbufferid];
+	if (!buffer->queued)
+		return;
+	uint64_t due = _sfile_replaytime(dev, buffer);
+	/// a time in the past wakes up immediately, 0 would disarm the timer
+	if (due == 0)
+		due = 1;
+	struct itimerspec timeout = {
+		.it_value = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL},
+	};
+	timerfd_settime(dev->timerfd, TFD_TIMER_ABSTIME, &timeout, NULL);
+}
+
+int sfile_eventfd(File_t *dev)
+{
+	return dev->timerfd;
+}
+
+int sfile_seek(File_t *dev, uint32_t frame)
+{
+	if (dev->map == NULL || frame >= dev->nframes)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	dev->cursor = frame;
+	dev->resync = 1;
+	return 0;
+}
+
+int sfile_stamp(File_t *dev, int index, uint64_t timestamp, uint32_t sequence)
+{
+	if (index < 0 || index >= dev->nbuffers)
+		return -1;
+	dev->buffers[index].stamp = timestamp;
+	dev->buffers[index].sequence = sequence;
+	dev->buffers[index].stamped = 1;
+	return 0;
+}
+
+uint64_t sfile_timestamp(File_t *dev, int index)
+{
+	if (index < 0 || index >= dev->nbuffers)
+		return 0;
+	if (dev->timerfd >= 0)
+		return _sfile_replaytime(dev, &dev->buffers[index]);
+	return dev->buffers[index].timestamp;
+}
+
+static void _sfile_containerend(File_t *dev)
+{
+	if (dev->index == NULL)
+		return;
+	/// the recorder may leave the file in direct mode
+	int flags = fcntl(dev->fd, F_GETFL);
+	if (flags & O_DIRECT)
+		fcntl(dev->fd, F_SETFL, flags & ~O_DIRECT);
+	if (_sfile_containerindex(dev))
+		err("sfile: container index error %m");
+	free(dev->index);
+	dev->index = NULL;
+	dev->nindex = 0;
+}
+
+int sfile_start(File_t *dev)
+{
+	FileConfig_t *config = dev->config;
+	dev->lastbufferid = 0;
+	if (config->direction & File_Input_e)
+	{
+		char *header = dev->header;
+		int length = 0;
+		dev->format = _sfile_outputformat(dev);
+		if (dev->format == FORMAT_CONTAINER)
+			length = _sfile_containerheader(dev);
+		else if ((dev->format == FORMAT_Y4M || dev->format == FORMAT_PNM) &&
+				(length = _sfile_imageheader(dev)) < 0)
+			return -1;
+#ifdef HAVE_LIBJPEG
+		if (dev->format == FORMAT_JPEG && dev->encoder == NULL)
+			dev->encoder = sjpeg_create(config->parent.fourcc, config->parent.width, config->parent.height,
+				config->parent.stride, config->quality, config->encoders, _sfile_encoded, dev);
+		if (dev->format == FORMAT_JPEG && dev->encoder == NULL)
+			return -1;
+#endif
+		if (config->compression && dev->compressor == NULL)
+			dev->compressor = scompress_create(config->compression, config->level,
+				scompress_filter(config->parent.fourcc, config->parent.stride), config->parent.stride,
+				config->encoders, _sfile_encoded, dev);
+		if (config->compression && dev->compressor == NULL)
+			return -1;
+		/// each segment starts with the header
+		dev->headerlength = length;
+		if (dev->segmenter && _sfile_segmenterstart(dev))
+			return -1;
+		if ((config->mode & FILE_MODE_RECORD) && dev->recorder == NULL)
+			dev->recorder = _sfile_recordercreate(dev);
+		dev->offset = lseek(dev->fd, 0, SEEK_CUR);
+		if (length > 0 && _sfile_output(dev, header, length) < 0)
+			return -1;
+		if (config->pretrigger > 0 && dev->ring == NULL && dev->nbuffers > 0)
+			_sfile_ringcreate(dev);
 	}
 	else
 	{
 		dbg("start buffers enqueuing");
+		dev->start = 0;
 		for (int i = 0; i < dev->nbuffers; i++)
 		{
 			if (sfile_queue(dev, i, 0))
@@ -198,6 +1900,23 @@ int sfile_start(File_t *dev)
 
 int sfile_stop(File_t *dev)
 {
+	/// the ring writes through the recorder
+	if (dev->ring)
+		_sfile_ringdestroy(dev->ring);
+	dev->ring = NULL;
+	/// the encoder flushes its frames through the recorder
+#ifdef HAVE_LIBJPEG
+	if (dev->encoder)
+		sjpeg_destroy(dev->encoder);
+#endif
+	dev->encoder = NULL;
+	if (dev->compressor)
+		scompress_destroy(dev->compressor);
+	dev->compressor = NULL;
+	if (dev->recorder)
+		_sfile_recorderdestroy(dev->recorder);
+	dev->recorder = NULL;
+	_sfile_containerend(dev);
 	return 0;
 }
 
@@ -206,19 +1925,47 @@ int sfile_dequeue(File_t *dev, void **mem, size_t *bytesused)
 	FileConfig_t *config = dev->config;
 	int ret = dev->lastbufferid;
 	FileBuffer_t *buffer = &dev->buffers[dev->lastbufferid];
+	if (dev->timerfd >= 0)
+	{
+		uint64_t expirations;
+		if (read(dev->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+			dbg("sfile: timer error %m");
+		if (!buffer->queued)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		/// the end of the container stops the stream
+		if (buffer->bytesused == 0 && dev->cursor >= dev->nframes)
+		{
+			warn("sfile: end of \"%s\"", dev->path);
+			errno = 0;
+			return -1;
+		}
+		uint64_t due = _sfile_replaytime(dev, buffer);
+		if (due > sclock_now())
+		{
+			_sfile_replayarm(dev);
+			errno = EAGAIN;
+			return -1;
+		}
+		buffer->queued = 0;
+	}
 	if (bytesused)
 		*bytesused = buffer->bytesused;
 	if (mem && buffer->mem)
 		*mem = buffer->mem;
 	dev->lastbufferid++;
 	dev->lastbufferid %= dev->nbuffers;
+	if (dev->timerfd >= 0)
+		_sfile_replayarm(dev);
 	return ret;
 }
 
 int sfile_queue(File_t *dev, int index, size_t bytesused)
 {
 	FileConfig_t *config = dev->config;
-	if (index > dev->nbuffers)
+	if (index < 0 || index >= dev->nbuffers)
 	{
 		err("unkown %d buffer index to queue", index);
 		return -1;
@@ -232,20 +1979,25 @@ int sfile_queue(File_t *dev, int index, size_t bytesused)
 	}
 	if (config->direction & File_Input_e)
 	{
-		if (buffer->dma_buf > 0)
-		{
-			struct dma_buf_sync sync = { 0 };
-			sync.flags = DMA_BUF_SYNC_READ | DMA_BUF_SYNC_START;
-			ioctl(buffer->dma_buf, DMA_BUF_IOCTL_SYNC, sync);
-			buffer->mem = mmap(NULL, buffer->size, PROT_READ, MAP_SHARED, buffer->dma_buf, 0 );
-		}
-		ssize_t ret = write(dev->fd, buffer->mem, bytesused);
-		if (buffer->dma_buf > 0)
-		{
-			struct dma_buf_sync sync = { 0 };
-			sync.flags = DMA_BUF_SYNC_READ | DMA_BUF_SYNC_END;
-			ioctl(buffer->dma_buf, DMA_BUF_IOCTL_SYNC, sync);
-		}
+		if (buffer->mapped)
+			_sfile_syncdma(buffer, DMA_BUF_SYNC_READ | DMA_BUF_SYNC_START);
+		ssize_t ret = 0;
+		buffer->timestamp = sclock_now();
+		/// the frame keeps the time and the number given by its source
+		if (!buffer->stamped || buffer->stamp == 0)
+			buffer->stamp = buffer->timestamp;
+		if (!buffer->stamped)
+			buffer->sequence = dev->sequence++;
+		buffer->stamped = 0;
+		if (dev->ring)
+			ret = (_sfile_ringpush(dev->ring, buffer->mem, bytesused,
+					buffer->stamp, buffer->sequence) == 0)? bytesused: -1;
+		else if (dev->recorder || dev->segmenter || dev->format != FORMAT_RAW)
+			ret = (_sfile_frame(dev, buffer->mem, bytesused, buffer->stamp, buffer->sequence) < 0)? -1: bytesused;
+		else
+			ret = write(dev->fd, buffer->mem, bytesused);
+		if (buffer->mapped)
+			_sfile_syncdma(buffer, DMA_BUF_SYNC_READ | DMA_BUF_SYNC_END);
 		if (ret < 0)
 		{
 			err("sfile: write to file \"%s\" error: %m", dev->path);
@@ -255,35 +2007,59 @@ int sfile_queue(File_t *dev, int index, size_t bytesused)
 	}
 	else if (config->direction & File_Output_e)
 	{
-		if (buffer->dma_buf > 0)
+		if (buffer->mapped)
+			_sfile_syncdma(buffer, DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_START);
+		ssize_t ret = 0;
+		if (dev->map)
+			ret = _sfile_sourceread(dev, buffer, bytesused);
+		else
 		{
-			struct dma_buf_sync sync = { 0 };
-			sync.flags = DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_START;
-			ioctl(buffer->dma_buf, DMA_BUF_IOCTL_SYNC, sync);
-			buffer->mem = mmap(NULL, buffer->size, PROT_WRITE, MAP_SHARED, buffer->dma_buf, 0 );
-		}
-		ssize_t ret = read(dev->fd, buffer->mem, bytesused);
-		if (buffer->dma_buf > 0)
-		{
-			struct dma_buf_sync sync = { 0 };
-			sync.flags = DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_END;
-			ioctl(buffer->dma_buf, DMA_BUF_IOCTL_SYNC, sync);
+			if (dev->framesize > 0 && bytesused > dev->framesize)
+				bytesused = dev->framesize;
+			ret = read(dev->fd, buffer->mem, bytesused);
+			/// the exported raw frames are replayed at the configured rate
+			if (dev->timerfd >= 0 && config->fps > 0)
+				buffer->timestamp = 1 + (uint64_t)dev->cursor++ * 1000000000ULL / config->fps;
 		}
+		if (buffer->mapped)
+			_sfile_syncdma(buffer, DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_END);
 		if (ret < 0)
 		{
 			err("sfile: read from file \"%s\" error: %m", dev->path);
 			return -1;
 		}
 		buffer->bytesused = ret;
+		buffer->queued = 1;
+		if (dev->timerfd >= 0 && index == dev->lastbufferid)
+			_sfile_replayarm(dev);
 	}
 	return 0;
 }
 
 void sfile_destroy(File_t *dev)
 {
-	close(dev->fd);
-	if (dev->nbuffers > 0)
-		free(dev->buffers);
+	if (dev->ring)
+		_sfile_ringdestroy(dev->ring);
+#ifdef HAVE_LIBJPEG
+	if (dev->encoder)
+		sjpeg_destroy(dev->encoder);
+#endif
+	if (dev->compressor)
+		scompress_destroy(dev->compressor);
+	if (dev->recorder)
+		_sfile_recorderdestroy(dev->recorder);
+	_sfile_containerend(dev);
+	if (dev->map)
+		_sfile_sourceclose(dev);
+	if (dev->timerfd >= 0)
+		close(dev->timerfd);
+	/// the segmenter closes the current file
+	if (dev->segmenter)
+		_sfile_segmenterdestroy(dev->segmenter);
+	else
+		close(dev->fd);
+	_sfile_freebuffers(dev);
+	free(dev->pack);
 	free(dev);
 }
 
@@ -305,6 +2081,71 @@ int sfile_loadjsonconfiguration(void *arg, void *entry)
 			config->filename = filepath;
 		}
 	}
+	json_t *record = json_object_get(jconfig, "record");
+	if (record && json_is_boolean(record) && json_is_true(record))
+		config->mode |= FILE_MODE_RECORD;
+	json_t *container = json_object_get(jconfig, "container");
+	if (container && json_is_boolean(container) && json_is_true(container))
+		config->mode |= FILE_MODE_CONTAINER;
+	json_t *format = json_object_get(jconfig, "format");
+	if (format && json_is_string(format))
+	{
+		const char *value = json_string_value(format);
+		if (!strcmp(value, "container"))
+			config->mode |= FILE_MODE_CONTAINER;
+		else if (!strcmp(value, "y4m"))
+			config->mode |= FILE_MODE_Y4M;
+		else if (!strcmp(value, "pnm") || !strcmp(value, "pam"))
+			config->mode |= FILE_MODE_PNM;
+		else if (!strcmp(value, "raw"))
+			config->mode |= FILE_MODE_RAW;
+		else if (!strcmp(value, "jpeg") || !strcmp(value, "mjpeg"))
+			config->mode |= FILE_MODE_JPEG;
+		else
+			warn("sfile: format %s unknown", value);
+	}
+	json_t *pretrigger = json_object_get(jconfig, "pretrigger");
+	if (pretrigger && json_is_integer(pretrigger))
+		config->pretrigger = json_integer_value(pretrigger);
+	json_t *posttrigger = json_object_get(jconfig, "posttrigger");
+	if (posttrigger && json_is_integer(posttrigger))
+		config->posttrigger = json_integer_value(posttrigger);
+	json_t *fps = json_object_get(jconfig, "fps");
+	if (fps && json_is_integer(fps))
+		config->fps = json_integer_value(fps);
+	json_t *segmentframes = json_object_get(jconfig, "segmentframes");
+	if (segmentframes && json_is_integer(segmentframes))
+		config->segmentframes = json_integer_value(segmentframes);
+	json_t *segmentsize = json_object_get(jconfig, "segmentsize");
+	if (segmentsize && json_is_integer(segmentsize))
+		config->segmentsize = json_integer_value(segmentsize);
+	json_t *segmentduration = json_object_get(jconfig, "segmentduration");
+	if (segmentduration && json_is_integer(segmentduration))
+		config->segmentduration = json_integer_value(segmentduration);
+	json_t *quality = json_object_get(jconfig, "quality");
+	if (quality && json_is_integer(quality))
+		config->quality = json_integer_value(quality);
+	json_t *encoders = json_object_get(jconfig, "encoders");
+	if (encoders && json_is_integer(encoders))
+		config->encoders = json_integer_value(encoders);
+	json_t *compression = json_object_get(jconfig, "compression");
+	/// zstd keeps the rate of a sensor on one core, LZ4 is faster and compresses less
+	if (compression && json_is_boolean(compression) && json_is_true(compression))
+		config->compression = SCOMPRESS_ZSTD;
+	else if (compression && json_is_string(compression))
+	{
+		int method = scompress_method(json_string_value(compression));
+		if (method < 0)
+			warn("sfile: compression %s unknown", json_string_value(compression));
+		else
+			config->compression = method;
+	}
+	json_t *level = json_object_get(jconfig, "level");
+	if (level && json_is_integer(level))
+		config->level = json_integer_value(level);
+	json_t *segmentindex = json_object_get(jconfig, "segmentindex");
+	if (segmentindex && json_is_string(segmentindex))
+		config->segmentindex = json_string_value(segmentindex);
 	json_t *path = json_object_get(jconfig, "path");
 	if (path && json_is_string(path))
 	{
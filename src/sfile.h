@@ -8,6 +8,137 @@
 	.DEVICECONFIG(parent, config, sfile_loadconfiguration), \
 	}
 
+/**
+ * the recording writes the frames from a thread, without the page cache
+ * when the filesystem supports O_DIRECT.
+ */
+#define FILE_MODE_RECORD 0x01
+/**
+ * the frames are written into the container described below, a file
+ * starting with the container header is always read as a container.
+ * The MJPG and JPEG frames and the compressed frames use it by default,
+ * the index gives the size of each frame.
+ */
+#define FILE_MODE_CONTAINER 0x02
+/**
+ * the frames are written as a Y4M stream (YUV 4:2:0, 4:2:2 and GREY) or
+ * as PGM, PPM and PAM images (GREY, RGB3 and RGBA), without the padding
+ * of the lines. Without these flags, the extension of the file selects
+ * the format. The reading recognizes these files.
+ */
+#define FILE_MODE_Y4M 0x04
+#define FILE_MODE_PNM 0x08
+/**
+ * the frames are written as they are, the RGBA frames included.
+ */
+#define FILE_MODE_RAW 0x10
+/**
+ * the frames are encoded to JPEG by a pool of threads and written in the
+ * order of the capture, as a MJPEG stream or, with segmentframes set to 1,
+ * one image per file ("snapshot-%04u.jpg"). The extensions ".jpg" and
+ * ".mjpg" select it too. The frames of a JPEG camera are written as they are.
+ */
+#define FILE_MODE_JPEG 0x20
+
+/**
+ * The container starts with FileHeader_t, followed by the frames. Each
+ * frame is a FileFrame_t followed by bytesused bytes of data. The end of
+ * the file is the index, a FileIndex_t followed by count FileIndexEntry_t,
+ * and the FileTrailer_t. Without trailer (interrupted recording), the
+ * reader rebuilds the index from the frames. All the fields are in the
+ * byte order of the host.
+ * With compression (cf scompress.h), the data of each frame is filtered
+ * with the filter of the header and compressed alone, bytesused is the
+ * compressed size.
+ */
+#define FILE_HEADER_MAGIC FOURCC('S','R','A','W')
+#define FILE_FRAME_MAGIC FOURCC('S','F','R','M')
+#define FILE_INDEX_MAGIC FOURCC('S','I','D','X')
+#define FILE_TRAILER_MAGIC FOURCC('S','E','N','D')
+#define FILE_VERSION 1
+
+typedef struct FileHeader_s FileHeader_t;
+struct FileHeader_s
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t planes;
+	uint16_t compression;
+	uint16_t filter;
+};
+
+typedef struct FileFrame_s FileFrame_t;
+struct FileFrame_s
+{
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint64_t bytesused;
+};
+
+typedef struct FileIndex_s FileIndex_t;
+struct FileIndex_s
+{
+	uint32_t magic;
+	uint32_t count;
+};
+
+/**
+ * @param offset the position of the FileFrame_t from the start of the file.
+ * @param timestamp the time of the frame in ns (cf sclock.h).
+ */
+typedef struct FileIndexEntry_s FileIndexEntry_t;
+struct FileIndexEntry_s
+{
+	uint64_t offset;
+	uint64_t timestamp;
+};
+
+/**
+ * @param offset the position of the FileIndex_t.
+ */
+typedef struct FileTrailer_s FileTrailer_t;
+struct FileTrailer_s
+{
+	uint32_t magic;
+	uint32_t count;
+	uint64_t offset;
+};
+
+/**
+ * @param rootpath the directory of the file.
+ * @param filename the path of the file.
+ * @param direction File_Input_e to write the frames into the file,
+ * File_Output_e to read them.
+ * @param mode a bits field build with the FILE_MODE_ flags.
+ * @param pretrigger the number of seconds kept in memory before a trigger,
+ * 0 writes all the frames.
+ * @param posttrigger the number of seconds written after a trigger,
+ * 0 until the stop.
+ * @param fps the rate of the frames to size the pre trigger memory and
+ * the segments.
+ * @param segmentframes the number of frames of a segment.
+ * @param segmentsize the maximum size of a segment in bytes.
+ * @param segmentduration the number of seconds of a segment.
+ * @param segmentindex the path of the index of the segments, by default
+ * the filename followed by ".idx".
+ * @param quality the JPEG quality from 1 to 100, 0 for the default.
+ * @param encoders the number of JPEG or compression threads, 0 for the
+ * number of CPUs.
+ * @param compression the lossless compression of the frames into the
+ * container, SCOMPRESS_LZ4 or SCOMPRESS_ZSTD (cf scompress.h).
+ * @param level the level of the compression, 0 for the default.
+ *
+ * With one of the segment limits, the filename is a pattern receiving the
+ * number of the segment (ie "video-%04u.raw"), or the number is appended
+ * to it. Each line of the index gives the number, the name, the first and
+ * the last timestamps (cf sclock.h), the frames and the bytes of a segment.
+ */
 typedef struct FileConfig_s FileConfig_t;
 struct FileConfig_s
 {
@@ -19,6 +150,18 @@ struct FileConfig_s
 		File_Input_e = 0x01,
 		File_Output_e = 0x02,
 	} direction;
+	int mode;
+	int pretrigger;
+	int posttrigger;
+	int fps;
+	uint32_t segmentframes;
+	size_t segmentsize;
+	int segmentduration;
+	const char *segmentindex;
+	int quality;
+	int encoders;
+	int compression;
+	int level;
 };
 
 typedef struct File_s File_t;
@@ -28,10 +171,73 @@ DeviceConf_t * sfile_createconfig();
 File_t * sfile_create(const char *name, FileConfig_t *config);
 int sfile_requestbuffer(File_t *dev, enum buf_type_e t, ...);
 int sfile_fd(File_t *dev);
+/**
+ * @brief the descriptor to wait the next frame of a container.
+ * The frames are given back at the rate of their timestamps.
+ *
+ * @param dev the File_t object.
+ *
+ * @return the descriptor, -1 when the file isn't a container source.
+ */
+int sfile_eventfd(File_t *dev);
 int sfile_start(File_t *dev);
 int sfile_stop(File_t *dev);
 int sfile_dequeue(File_t *dev, void **mem, size_t *bytesused);
 int sfile_queue(File_t *dev, int index, size_t bytesused);
+/**
+ * @brief give the time and the number of the frame of a buffer before
+ * its queuing. The container records them in place of the time of the
+ * queuing and of its own counter.
+ *
+ * @param dev the File_t object.
+ * @param index the buffer index.
+ * @param timestamp the time of the capture in ns (cf sclock.h), 0 if unknown.
+ * @param sequence the sequence number of the source.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sfile_stamp(File_t *dev, int index, uint64_t timestamp, uint32_t sequence);
+/**
+ * @brief check before the creation that the file stores the compressed
+ * frames (MJPG, JPEG) as they are: the container without compression,
+ * or the JPEG format selected by the mode or the extension.
+ *
+ * @param filename the name given to sfile_create.
+ * @param config the configuration of the file.
+ *
+ * @return 1 if the compressed frames are accepted, 0 otherwise.
+ */
+int sfile_compressed(const char *filename, FileConfig_t *config);
+/**
+ * @brief write the pre trigger frames and the next ones into the file.
+ * A new trigger during the writing extends the post trigger time.
+ *
+ * @param dev the File_t object, configured with pretrigger.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sfile_trigger(File_t *dev);
+/**
+ * @brief move the reading of a container to a frame.
+ * The buffers already queued are given before the new frame.
+ *
+ * @param dev the File_t object.
+ * @param frame the number of the frame into the container.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sfile_seek(File_t *dev, uint32_t frame);
+/**
+ * @brief get the time of a buffer read from a container.
+ * The times keep the intervals of the recording, from the start
+ * of the replay.
+ *
+ * @param dev the File_t object.
+ * @param index the buffer index.
+ *
+ * @return the time in ns (cf sclock.h), 0 if unknown.
+ */
+uint64_t sfile_timestamp(File_t *dev, int index);
 void sfile_destroy(File_t *dev);
 
 #ifdef HAVE_JANSSON
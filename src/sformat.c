@@ -0,0 +1,489 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "log.h"
+#include "sformat.h"
+
+int sformat_layout(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, SFormatPlane_t planes[SFORMAT_MAXPLANES])
+{
+	uint32_t cwidth = (width + 1) / 2;
+	uint32_t cheight = (height + 1) / 2;
+	uint32_t cstride = stride / 2;
+	size_t luma = (size_t)stride * height;
+	uint32_t bpp = 0;
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		{
+			size_t u = luma;
+			size_t v = luma + (size_t)cstride * cheight;
+			/// YV12 stores V before U
+			if (fourcc == FOURCC('Y','V','1','2'))
+			{
+				v = luma;
+				u = luma + (size_t)cstride * cheight;
+			}
+			planes[0] = (SFormatPlane_t){0, stride, width, height};
+			planes[1] = (SFormatPlane_t){u, cstride, cwidth, cheight};
+			planes[2] = (SFormatPlane_t){v, cstride, cwidth, cheight};
+		}
+		return 3;
+		case FOURCC('4','2','2','P'):
+			planes[0] = (SFormatPlane_t){0, stride, width, height};
+			planes[1] = (SFormatPlane_t){luma, cstride, cwidth, height};
+			planes[2] = (SFormatPlane_t){luma + (size_t)cstride * height, cstride, cwidth, height};
+		return 3;
+		case FOURCC('G','R','E','Y'):
+			bpp = 1;
+		break;
+		case FOURCC('R','G','B','3'):
+			bpp = 3;
+		break;
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+			bpp = 4;
+		break;
+		default:
+		return 0;
+	}
+	planes[0] = (SFormatPlane_t){0, stride, width * bpp, height};
+	return 1;
+}
+
+size_t sformat_framesize(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride)
+{
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	int nplanes = sformat_layout(fourcc, width, height, stride, planes);
+	size_t size = 0;
+	for (int i = 0; i < nplanes; i++)
+	{
+		size_t end = planes[i].offset + (size_t)planes[i].stride * planes[i].height;
+		if (end > size)
+			size = end;
+	}
+	if (nplanes > 0)
+		return size;
+	switch (fourcc)
+	{
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+			return (size_t)stride * (height + (height + 1) / 2);
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+			return (size_t)stride * height * 2;
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+			return (size_t)stride * height;
+		default:
+		break;
+	}
+	return 0;
+}
+
+size_t sformat_packedsize(uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	size_t luma = (size_t)width * height;
+	size_t cwidth = (width + 1) / 2;
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+			return luma + 2 * cwidth * ((height + 1) / 2);
+		case FOURCC('4','2','2','P'):
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+			return luma + 2 * cwidth * height;
+		case FOURCC('G','R','E','Y'):
+			return luma;
+		case FOURCC('R','G','B','3'):
+			return luma * 3;
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+			return luma * 4;
+		default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * the formats named differently by DRM and V4L2. The other codes are
+ * shared by the two APIs. A null code has no equivalent: some V4L2
+ * Bayer formats use the code of an unrelated RGB format of DRM.
+ */
+static const struct
+{
+	uint32_t v4l2;
+	uint32_t drm;
+} _sformat_drm[] = {
+	{FOURCC('G','R','E','Y'), FOURCC('R','8',' ',' ')},
+	{FOURCC('Y','1','6',' '), FOURCC('R','1','6',' ')},
+	{FOURCC('R','G','B','P'), FOURCC('R','G','1','6')},
+	{FOURCC('X','R','1','2'), FOURCC('R','G','1','2')},
+	{FOURCC('X','B','1','2'), FOURCC('B','G','1','2')},
+	{FOURCC('G','A','1','2'), FOURCC('B','A','1','2')},
+	{FOURCC('B','G','R','3'), FOURCC('R','G','2','4')},
+	{FOURCC('R','G','B','3'), FOURCC('B','G','2','4')},
+	{FOURCC('4','2','2','P'), FOURCC('Y','U','1','6')},
+	{0, FOURCC('B','G','1','6')},
+	{FOURCC('R','G','1','6'), 0},
+	{FOURCC('R','G','1','2'), 0},
+	{FOURCC('B','G','1','2'), 0},
+	{FOURCC('B','A','1','2'), 0},
+};
+
+uint32_t sformat_fromdrm(uint32_t fourcc)
+{
+	if (fourcc == 0)
+		return 0;
+	for (size_t i = 0; i < sizeof(_sformat_drm) / sizeof(*_sformat_drm); i++)
+	{
+		if (_sformat_drm[i].drm == fourcc)
+			return _sformat_drm[i].v4l2;
+	}
+	return fourcc;
+}
+
+uint32_t sformat_todrm(uint32_t fourcc)
+{
+	if (fourcc == 0)
+		return 0;
+	for (size_t i = 0; i < sizeof(_sformat_drm) / sizeof(*_sformat_drm); i++)
+	{
+		if (_sformat_drm[i].v4l2 == fourcc)
+			return _sformat_drm[i].drm;
+	}
+	return fourcc;
+}
+
+/**
+ * the lines are copied by memcpy, a single copy when both sides
+ * are without padding.
+ */
+static void _sformat_rows(char *dst, size_t dststride, const char *src, size_t srcstride, size_t width, uint32_t rows)
+{
+	if (dststride == width && srcstride == width)
+	{
+		memcpy(dst, src, width * rows);
+		return;
+	}
+	for (uint32_t i = 0; i < rows; i++)
+		memcpy(dst + i * dststride, src + i * srcstride, width);
+}
+
+/**
+ * the loops are written to be vectorized by the compiler.
+ */
+static void _sformat_split(uint8_t *restrict u, uint8_t *restrict v, const uint8_t *restrict uv, uint32_t width)
+{
+	for (uint32_t x = 0; x < width; x++)
+	{
+		u[x] = uv[2 * x];
+		v[x] = uv[2 * x + 1];
+	}
+}
+
+static void _sformat_splitpacked(uint8_t *restrict y, uint8_t *restrict u, uint8_t *restrict v,
+				const uint8_t *restrict line, uint32_t width, uint32_t cwidth, int first)
+{
+	for (uint32_t x = 0; x < width; x++)
+		y[x] = line[2 * x + first];
+	/// the chroma is on the other bytes of the macro pixel
+	int chroma = 1 - first;
+	for (uint32_t x = 0; x < cwidth; x++)
+	{
+		u[x] = line[4 * x + chroma];
+		v[x] = line[4 * x + chroma + 2];
+	}
+}
+
+size_t sformat_pack(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, const char *src, char *dst)
+{
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	int nplanes = sformat_layout(fourcc, width, height, stride, planes);
+	size_t length = 0;
+	for (int i = 0; i < nplanes; i++)
+	{
+		_sformat_rows(dst + length, planes[i].width, src + planes[i].offset, planes[i].stride,
+			planes[i].width, planes[i].height);
+		length += (size_t)planes[i].width * planes[i].height;
+	}
+	if (nplanes > 0)
+		return length;
+
+	uint32_t cwidth = (width + 1) / 2;
+	uint32_t cheight = height;
+	uint8_t *y = (uint8_t *)dst;
+	switch (fourcc)
+	{
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+			cheight = (height + 1) / 2;
+		/// fallthrough
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+		{
+			uint8_t *u = y + (size_t)width * height;
+			uint8_t *v = u + (size_t)cwidth * cheight;
+			if (fourcc == FOURCC('N','V','2','1') || fourcc == FOURCC('N','V','6','1'))
+			{
+				uint8_t *tmp = u;
+				u = v;
+				v = tmp;
+			}
+			_sformat_rows(dst, width, src, stride, width, height);
+			const uint8_t *uv = (const uint8_t *)src + (size_t)stride * height;
+			for (uint32_t i = 0; i < cheight; i++)
+				_sformat_split(u + (size_t)i * cwidth, v + (size_t)i * cwidth, uv + (size_t)i * stride, cwidth);
+		}
+		break;
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+		{
+			uint8_t *u = y + (size_t)width * height;
+			uint8_t *v = u + (size_t)cwidth * height;
+			int first = (fourcc == FOURCC('U','Y','V','Y'))? 1: 0;
+			for (uint32_t i = 0; i < height; i++)
+				_sformat_splitpacked(y + (size_t)i * width, u + (size_t)i * cwidth, v + (size_t)i * cwidth,
+					(const uint8_t *)src + (size_t)i * stride, width, cwidth, first);
+		}
+		break;
+		default:
+			err("sformat: format %.4s not supported", (char *)&fourcc);
+		return 0;
+	}
+	return sformat_packedsize(fourcc, width, height);
+}
+
+size_t sformat_unpack(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, const char *src, char *dst)
+{
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	int nplanes = sformat_layout(fourcc, width, height, stride, planes);
+	size_t length = 0;
+	for (int i = 0; i < nplanes; i++)
+	{
+		_sformat_rows(dst + planes[i].offset, planes[i].stride, src + length, planes[i].width,
+			planes[i].width, planes[i].height);
+		length += (size_t)planes[i].width * planes[i].height;
+	}
+	if (nplanes == 0)
+		return 0;
+	return sformat_framesize(fourcc, width, height, stride);
+}
+
+int sformat_y4mheader(char *header, size_t length, uint32_t fourcc, uint32_t width, uint32_t height, uint32_t fps)
+{
+	const char *colorspace = NULL;
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+			colorspace = "420jpeg";
+		break;
+		case FOURCC('4','2','2','P'):
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+			colorspace = "422";
+		break;
+		case FOURCC('G','R','E','Y'):
+			colorspace = "mono";
+		break;
+		default:
+			err("sformat: format %.4s not supported by Y4M", (char *)&fourcc);
+		return -1;
+	}
+	if (fps == 0)
+		return snprintf(header, length, "YUV4MPEG2 W%u H%u F0:0 Ip A1:1 C%s\n", width, height, colorspace);
+	return snprintf(header, length, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C%s\n", width, height, fps, colorspace);
+}
+
+int sformat_y4mparse(const char *data, size_t length, SFormat_t *format)
+{
+	static const char magic[] = "YUV4MPEG2 ";
+	if (length < sizeof(magic) - 1 || memcmp(data, magic, sizeof(magic) - 1))
+		return -1;
+	const char *end = memchr(data, '\n', length);
+	if (end == NULL)
+		return -1;
+	memset(format, 0, sizeof(*format));
+	format->fourcc = FOURCC('Y','U','1','2');
+	const char *token = data + sizeof(magic) - 1;
+	while (token < end)
+	{
+		const char *next = memchr(token, ' ', end - token);
+		if (next == NULL)
+			next = end;
+		size_t tlength = next - token;
+		char value[32] = {0};
+		if (tlength > 1 && tlength < sizeof(value))
+			memcpy(value, token + 1, tlength - 1);
+		switch (token[0])
+		{
+			case 'W':
+				format->width = strtoul(value, NULL, 10);
+			break;
+			case 'H':
+				format->height = strtoul(value, NULL, 10);
+			break;
+			case 'F':
+				if (sscanf(value, "%u:%u", &format->fpsnum, &format->fpsden) != 2 || format->fpsden == 0)
+					format->fpsnum = 0;
+			break;
+			case 'C':
+				if (!strncmp(value, "420", 3))
+					format->fourcc = FOURCC('Y','U','1','2');
+				else if (!strcmp(value, "422"))
+					format->fourcc = FOURCC('4','2','2','P');
+				else if (!strcmp(value, "mono"))
+					format->fourcc = FOURCC('G','R','E','Y');
+				else
+				{
+					err("sformat: Y4M colorspace %s not supported", value);
+					return -1;
+				}
+			break;
+			default:
+			break;
+		}
+		token = next + 1;
+	}
+	if (format->width == 0 || format->height == 0)
+		return -1;
+	return end + 1 - data;
+}
+
+int sformat_y4mframe(const char *data, size_t length)
+{
+	if (length < 6 || memcmp(data, "FRAME", 5))
+		return -1;
+	const char *end = memchr(data, '\n', length);
+	if (end == NULL)
+		return -1;
+	return end + 1 - data;
+}
+
+int sformat_pnmheader(char *header, size_t length, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	switch (fourcc)
+	{
+		case FOURCC('G','R','E','Y'):
+			return snprintf(header, length, "P5\n%u %u\n255\n", width, height);
+		case FOURCC('R','G','B','3'):
+			return snprintf(header, length, "P6\n%u %u\n255\n", width, height);
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+			return snprintf(header, length,
+				"P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+				width, height);
+		default:
+			err("sformat: format %.4s not supported by PNM", (char *)&fourcc);
+		break;
+	}
+	return -1;
+}
+
+/**
+ * the numbers of the PGM and PPM headers are separated by spaces
+ * and comments.
+ */
+static const char *_sformat_number(const char *data, const char *end, uint32_t *value)
+{
+	while (data < end && (isspace((unsigned char)*data) || *data == '#'))
+	{
+		if (*data == '#')
+		{
+			while (data < end && *data != '\n')
+				data++;
+		}
+		else
+			data++;
+	}
+	if (data == end || !isdigit((unsigned char)*data))
+		return NULL;
+	*value = 0;
+	while (data < end && isdigit((unsigned char)*data))
+		*value = *value * 10 + (*data++ - '0');
+	return data;
+}
+
+static int _sformat_pamparse(const char *data, size_t length, SFormat_t *format)
+{
+	const char *end = data + length;
+	const char *line = data + 3;
+	uint32_t depth = 0;
+	uint32_t maxval = 0;
+	while (line < end)
+	{
+		const char *next = memchr(line, '\n', end - line);
+		if (next == NULL)
+			return -1;
+		char key[16] = {0};
+		uint32_t value = 0;
+		if (!strncmp(line, "ENDHDR", 6))
+		{
+			if (maxval != 255 || format->width == 0 || format->height == 0)
+				return -1;
+			if (depth == 1)
+				format->fourcc = FOURCC('G','R','E','Y');
+			else if (depth == 3)
+				format->fourcc = FOURCC('R','G','B','3');
+			else if (depth == 4)
+				format->fourcc = FOURCC('A','B','2','4');
+			else
+				return -1;
+			return next + 1 - data;
+		}
+		if (sscanf(line, "%15s %u", key, &value) == 2)
+		{
+			if (!strcmp(key, "WIDTH"))
+				format->width = value;
+			else if (!strcmp(key, "HEIGHT"))
+				format->height = value;
+			else if (!strcmp(key, "DEPTH"))
+				depth = value;
+			else if (!strcmp(key, "MAXVAL"))
+				maxval = value;
+		}
+		line = next + 1;
+	}
+	return -1;
+}
+
+int sformat_pnmparse(const char *data, size_t length, SFormat_t *format)
+{
+	if (length < 3 || data[0] != 'P' || !isspace((unsigned char)data[2]))
+		return -1;
+	memset(format, 0, sizeof(*format));
+	if (data[1] == '7')
+		return _sformat_pamparse(data, length, format);
+	if (data[1] == '5')
+		format->fourcc = FOURCC('G','R','E','Y');
+	else if (data[1] == '6')
+		format->fourcc = FOURCC('R','G','B','3');
+	else
+		return -1;
+	const char *end = data + length;
+	uint32_t maxval = 0;
+	const char *cursor = data + 2;
+	if ((cursor = _sformat_number(cursor, end, &format->width)) == NULL ||
+		(cursor = _sformat_number(cursor, end, &format->height)) == NULL ||
+		(cursor = _sformat_number(cursor, end, &maxval)) == NULL)
+		return -1;
+	/// one white space separates the header and the data
+	if (cursor == end || !isspace((unsigned char)*cursor) || maxval != 255)
+		return -1;
+	return cursor + 1 - data;
+}
@@ -0,0 +1,146 @@
+#ifndef __SFORMAT_H__
+#define __SFORMAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SFORMAT_MAXPLANES 3
+
+/**
+ * @brief a plane into a frame buffer.
+ *
+ * @param offset the position of the first line from the start of the buffer.
+ * @param stride the number of bytes between two lines.
+ * @param width the number of bytes of data of a line.
+ * @param height the number of lines.
+ */
+typedef struct SFormatPlane_s SFormatPlane_t;
+struct SFormatPlane_s
+{
+	size_t offset;
+	uint32_t stride;
+	uint32_t width;
+	uint32_t height;
+};
+
+/**
+ * @brief the definition of the images of a Y4M or PNM stream.
+ *
+ * @param fourcc the V4L2 format of the frames, once unpacked.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param fpsnum the numerator of the frame rate, 0 if unknown.
+ * @param fpsden the denominator of the frame rate.
+ */
+typedef struct SFormat_s SFormat_t;
+struct SFormat_s
+{
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fpsnum;
+	uint32_t fpsden;
+};
+
+/**
+ * @brief get the planes of a frame, in the order Y, U, V for the YUV
+ * formats. The interleaved formats (NV12, YUYV...) have no planes.
+ *
+ * @param fourcc the format of the frame.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param stride the number of bytes of a line of the first plane.
+ * @param planes the table to fill.
+ *
+ * @return the number of planes, 0 if the format isn't planar.
+ */
+int sformat_layout(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, SFormatPlane_t planes[SFORMAT_MAXPLANES]);
+/**
+ * @brief the size of a frame into a buffer with padded lines.
+ *
+ * @return the size in bytes, 0 if the format is unknown.
+ */
+size_t sformat_framesize(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride);
+/**
+ * @brief the size of a frame into a Y4M or PNM stream, without padding
+ * and with separated planes.
+ *
+ * @return the size in bytes, 0 if the format can't be stored.
+ */
+size_t sformat_packedsize(uint32_t fourcc, uint32_t width, uint32_t height);
+/**
+ * @brief the V4L2 code of a DRM format. The devices of the pipeline
+ * negotiate with the V4L2 codes.
+ *
+ * @return the V4L2 fourcc, 0 if the format has no V4L2 equivalent.
+ */
+uint32_t sformat_fromdrm(uint32_t fourcc);
+/**
+ * @brief the DRM code of a V4L2 format.
+ *
+ * @return the DRM fourcc, 0 if the format has no DRM equivalent.
+ */
+uint32_t sformat_todrm(uint32_t fourcc);
+/**
+ * @brief remove the padding of the lines and separate the chroma planes.
+ *
+ * @param fourcc the format of the source.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param stride the number of bytes of a line of the source.
+ * @param src the frame buffer.
+ * @param dst the memory of sformat_packedsize bytes.
+ *
+ * @return the number of bytes written into dst, 0 on error.
+ */
+size_t sformat_pack(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, const char *src, char *dst);
+/**
+ * @brief the inverse of sformat_pack for the planar formats.
+ *
+ * @return the number of bytes written into dst, 0 on error.
+ */
+size_t sformat_unpack(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride, const char *src, char *dst);
+
+/**
+ * @brief write the header of a Y4M stream.
+ *
+ * @param header the memory of the header.
+ * @param length the size of the memory.
+ * @param fourcc the format of the frames, YUV 4:2:0, YUV 4:2:2 or GREY.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param fps the frame rate, 0 for unknown.
+ *
+ * @return the length of the header, -1 if the format can't be stored.
+ */
+int sformat_y4mheader(char *header, size_t length, uint32_t fourcc, uint32_t width, uint32_t height, uint32_t fps);
+/**
+ * @brief read the header of a Y4M stream.
+ *
+ * @param data the start of the stream.
+ * @param length the available size.
+ * @param format the definition to fill.
+ *
+ * @return the length of the header, -1 on error.
+ */
+int sformat_y4mparse(const char *data, size_t length, SFormat_t *format);
+/**
+ * @brief read the header of a Y4M frame.
+ *
+ * @return the length of the header, -1 if data isn't a frame.
+ */
+int sformat_y4mframe(const char *data, size_t length);
+/**
+ * @brief write the header of a PGM, PPM or PAM image, following the fourcc.
+ *
+ * @return the length of the header, -1 if the format can't be stored.
+ */
+int sformat_pnmheader(char *header, size_t length, uint32_t fourcc, uint32_t width, uint32_t height);
+/**
+ * @brief read the header of a PGM, PPM or PAM image.
+ *
+ * @return the length of the header, -1 on error.
+ */
+int sformat_pnmparse(const char *data, size_t length, SFormat_t *format);
+
+#endif
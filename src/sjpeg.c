@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include <jpeglib.h>
+
+#include "config.h"
+#include "log.h"
+#include "sformat.h"
+#include "sjpeg.h"
+
+#define SJPEG_MAXWORKERS 16
+
+/**
+ * a component of the frame, step is the distance between two samples of
+ * a line, 2 or 4 for the interleaved formats.
+ */
+typedef struct SJpegComponent_s SJpegComponent_t;
+struct SJpegComponent_s
+{
+	size_t offset;
+	uint32_t stride;
+	uint32_t step;
+	uint32_t width;
+	uint32_t height;
+	/// the samples of a line read by libjpeg, a multiple of the block
+	uint32_t padded;
+	int hsamp;
+	int vsamp;
+};
+
+enum
+{
+	WORKER_IDLE,
+	WORKER_FILLING,
+	WORKER_PENDING,
+	WORKER_BUSY,
+};
+
+typedef struct SJpegError_s SJpegError_t;
+struct SJpegError_s
+{
+	struct jpeg_error_mgr parent;
+	jmp_buf jump;
+};
+
+typedef struct SJpegWorker_s SJpegWorker_t;
+struct SJpegWorker_s
+{
+	SJpeg_t *encoder;
+	struct jpeg_compress_struct cinfo;
+	SJpegError_t jerr;
+	char *input;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t framesequence;
+	int state;
+	/// the JPEG output, grown by libjpeg when it's too small
+	unsigned char *output;
+	unsigned long outputsize;
+	/// the lines of an iMCU row, when they can't be read from the frame
+	JSAMPLE *scratch;
+	JSAMPROW rows[3][2 * DCTSIZE];
+	pthread_t thread;
+};
+
+struct SJpeg_s
+{
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	int quality;
+	size_t framesize;
+	J_COLOR_SPACE colorspace;
+	int ncomponents;
+	SJpegComponent_t components[3];
+	SJpegOutput_t output;
+	void *arg;
+	SJpegWorker_t *workers;
+	int nworkers;
+	/// the sequence of the next pushed frame, and of the next written
+	uint32_t sequence;
+	uint32_t written;
+	uint32_t drops;
+	int run;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void _sjpeg_errorexit(j_common_ptr cinfo)
+{
+	SJpegError_t *jerr = (SJpegError_t *)cinfo->err;
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, message);
+	err("sjpeg: %s", message);
+	longjmp(jerr->jump, 1);
+}
+
+int sjpeg_supported(uint32_t fourcc)
+{
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		case FOURCC('4','2','2','P'):
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+		case FOURCC('G','R','E','Y'):
+		case FOURCC('R','G','B','3'):
+#ifdef JCS_EXTENSIONS
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+#endif
+		return 1;
+		default:
+		break;
+	}
+	return 0;
+}
+
+static uint32_t _sjpeg_bytesperpixel(uint32_t fourcc)
+{
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','Y','V'):
+		case FOURCC('U','Y','V','Y'):
+			return 2;
+		case FOURCC('R','G','B','3'):
+			return 3;
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+			return 4;
+		default:
+		break;
+	}
+	return 1;
+}
+
+/**
+ * the YUV formats are read as components for the raw data interface of
+ * libjpeg, the others are given as scanlines.
+ */
+static int _sjpeg_layout(SJpeg_t *encoder)
+{
+	uint32_t width = encoder->width;
+	uint32_t height = encoder->height;
+	uint32_t stride = encoder->stride;
+	uint32_t cwidth = (width + 1) / 2;
+	uint32_t cheight = (height + 1) / 2;
+	SJpegComponent_t *c = encoder->components;
+	size_t luma = (size_t)stride * height;
+	SFormatPlane_t planes[SFORMAT_MAXPLANES];
+	encoder->colorspace = JCS_YCbCr;
+	encoder->ncomponents = 3;
+	switch (encoder->fourcc)
+	{
+		case FOURCC('Y','U','1','2'):
+		case FOURCC('Y','V','1','2'):
+		case FOURCC('4','2','2','P'):
+			sformat_layout(encoder->fourcc, width, height, stride, planes);
+			for (int i = 0; i < 3; i++)
+				c[i] = (SJpegComponent_t){.offset = planes[i].offset, .stride = planes[i].stride, .step = 1,
+					.width = planes[i].width, .height = planes[i].height};
+		break;
+		case FOURCC('N','V','1','2'):
+		case FOURCC('N','V','2','1'):
+			c[0] = (SJpegComponent_t){.offset = 0, .stride = stride, .step = 1, .width = width, .height = height};
+			c[1] = (SJpegComponent_t){.offset = luma, .stride = stride, .step = 2, .width = cwidth, .height = cheight};
+			c[2] = (SJpegComponent_t){.offset = luma + 1, .stride = stride, .step = 2, .width = cwidth, .height = cheight};
+		break;
+		case FOURCC('N','V','1','6'):
+		case FOURCC('N','V','6','1'):
+			c[0] = (SJpegComponent_t){.offset = 0, .stride = stride, .step = 1, .width = width, .height = height};
+			c[1] = (SJpegComponent_t){.offset = luma, .stride = stride, .step = 2, .width = cwidth, .height = height};
+			c[2] = (SJpegComponent_t){.offset = luma + 1, .stride = stride, .step = 2, .width = cwidth, .height = height};
+		break;
+		case FOURCC('Y','U','Y','V'):
+			c[0] = (SJpegComponent_t){.offset = 0, .stride = stride, .step = 2, .width = width, .height = height};
+			c[1] = (SJpegComponent_t){.offset = 1, .stride = stride, .step = 4, .width = cwidth, .height = height};
+			c[2] = (SJpegComponent_t){.offset = 3, .stride = stride, .step = 4, .width = cwidth, .height = height};
+		break;
+		case FOURCC('U','Y','V','Y'):
+			c[0] = (SJpegComponent_t){.offset = 1, .stride = stride, .step = 2, .width = width, .height = height};
+			c[1] = (SJpegComponent_t){.offset = 0, .stride = stride, .step = 4, .width = cwidth, .height = height};
+			c[2] = (SJpegComponent_t){.offset = 2, .stride = stride, .step = 4, .width = cwidth, .height = height};
+		break;
+		case FOURCC('G','R','E','Y'):
+			c[0] = (SJpegComponent_t){.offset = 0, .stride = stride, .step = 1, .width = width, .height = height};
+			encoder->colorspace = JCS_GRAYSCALE;
+			encoder->ncomponents = 1;
+		break;
+		case FOURCC('R','G','B','3'):
+			encoder->colorspace = JCS_RGB;
+			encoder->ncomponents = 0;
+		return 0;
+#ifdef JCS_EXTENSIONS
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+			encoder->colorspace = JCS_EXT_RGBA;
+			encoder->ncomponents = 0;
+		return 0;
+#endif
+		default:
+		return -1;
+	}
+	/// NV21 and NV61 store V before U
+	if (encoder->fourcc == FOURCC('N','V','2','1') || encoder->fourcc == FOURCC('N','V','6','1'))
+	{
+		c[1].offset++;
+		c[2].offset--;
+	}
+	int hmax = (encoder->ncomponents > 1)? 2: 1;
+	int vmax = (encoder->ncomponents > 1 && c[1].height < height)? 2: 1;
+	uint32_t mcuwidth = hmax * DCTSIZE;
+	uint32_t padded = (width + mcuwidth - 1) / mcuwidth * mcuwidth;
+	c[0].hsamp = hmax;
+	c[0].vsamp = vmax;
+	c[0].padded = padded;
+	for (int i = 1; i < encoder->ncomponents; i++)
+	{
+		c[i].hsamp = 1;
+		c[i].vsamp = 1;
+		c[i].padded = padded / hmax;
+	}
+	return 0;
+}
+
+static int _sjpeg_workerinit(SJpegWorker_t *worker)
+{
+	SJpeg_t *encoder = worker->encoder;
+	struct jpeg_compress_struct *cinfo = &worker->cinfo;
+	cinfo->err = jpeg_std_error(&worker->jerr.parent);
+	worker->jerr.parent.error_exit = _sjpeg_errorexit;
+	if (setjmp(worker->jerr.jump))
+		return -1;
+	jpeg_create_compress(cinfo);
+	cinfo->image_width = encoder->width;
+	cinfo->image_height = encoder->height;
+	cinfo->in_color_space = encoder->colorspace;
+	switch (encoder->colorspace)
+	{
+		case JCS_GRAYSCALE:
+			cinfo->input_components = 1;
+		break;
+#ifdef JCS_EXTENSIONS
+		case JCS_EXT_RGBA:
+			cinfo->input_components = 4;
+		break;
+#endif
+		default:
+			cinfo->input_components = 3;
+		break;
+	}
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, encoder->quality, TRUE);
+	size_t scratch = 0;
+	if (encoder->ncomponents > 0)
+	{
+		cinfo->raw_data_in = TRUE;
+		for (int i = 0; i < encoder->ncomponents; i++)
+		{
+			cinfo->comp_info[i].h_samp_factor = encoder->components[i].hsamp;
+			cinfo->comp_info[i].v_samp_factor = encoder->components[i].vsamp;
+			scratch += (size_t)encoder->components[i].padded * encoder->components[i].vsamp * DCTSIZE;
+		}
+	}
+	worker->input = malloc(encoder->framesize);
+	worker->scratch = malloc(scratch + 1);
+	worker->outputsize = encoder->width * encoder->height;
+	worker->output = malloc(worker->outputsize);
+	if (worker->input == NULL || worker->scratch == NULL || worker->output == NULL)
+		return -1;
+	JSAMPLE *row = worker->scratch;
+	for (int i = 0; i < encoder->ncomponents; i++)
+	{
+		for (int j = 0; j < encoder->components[i].vsamp * DCTSIZE; j++)
+		{
+			worker->rows[i][j] = row;
+			row += encoder->components[i].padded;
+		}
+	}
+	return 0;
+}
+
+/**
+ * a line is read from the frame when libjpeg doesn't need more samples,
+ * otherwise it's gathered into the scratch line and the last sample is
+ * repeated until the end of the block. The last line is repeated for the
+ * blocks after the image.
+ */
+static JSAMPROW _sjpeg_line(SJpegWorker_t *worker, int index, uint32_t line, JSAMPROW scratch)
+{
+	SJpegComponent_t *c = &worker->encoder->components[index];
+	if (line >= c->height)
+		line = c->height - 1;
+	const JSAMPLE *src = (const JSAMPLE *)worker->input + c->offset + (size_t)line * c->stride;
+	if (c->step == 1 && c->width == c->padded)
+		return (JSAMPROW)src;
+	if (c->step == 1)
+		memcpy(scratch, src, c->width);
+	else for (uint32_t x = 0; x < c->width; x++)
+		scratch[x] = src[x * c->step];
+	for (uint32_t x = c->width; x < c->padded; x++)
+		scratch[x] = scratch[c->width - 1];
+	return scratch;
+}
+
+static int _sjpeg_encode(SJpegWorker_t *worker, unsigned char **output, unsigned long *length)
+{
+	SJpeg_t *encoder = worker->encoder;
+	struct jpeg_compress_struct *cinfo = &worker->cinfo;
+	*output = worker->output;
+	*length = worker->outputsize;
+	if (setjmp(worker->jerr.jump))
+	{
+		jpeg_abort_compress(cinfo);
+		return -1;
+	}
+	jpeg_mem_dest(cinfo, output, length);
+	jpeg_start_compress(cinfo, TRUE);
+	if (encoder->ncomponents == 0)
+	{
+		JSAMPROW rows[DCTSIZE];
+		while (cinfo->next_scanline < cinfo->image_height)
+		{
+			int nrows = 0;
+			for (; nrows < DCTSIZE && cinfo->next_scanline + nrows < cinfo->image_height; nrows++)
+				rows[nrows] = (JSAMPROW)worker->input + (size_t)(cinfo->next_scanline + nrows) * encoder->stride;
+			jpeg_write_scanlines(cinfo, rows, nrows);
+		}
+	}
+	else
+	{
+		JSAMPARRAY planes[3];
+		JSAMPROW lines[3][2 * DCTSIZE];
+		int vmax = encoder->components[0].vsamp;
+		for (int i = 0; i < encoder->ncomponents; i++)
+			planes[i] = lines[i];
+		for (uint32_t y = 0; y < encoder->height; y += vmax * DCTSIZE)
+		{
+			for (int i = 0; i < encoder->ncomponents; i++)
+			{
+				int nlines = encoder->components[i].vsamp * DCTSIZE;
+				uint32_t first = y / vmax * encoder->components[i].vsamp;
+				for (int j = 0; j < nlines; j++)
+					lines[i][j] = _sjpeg_line(worker, i, first + j, worker->rows[i][j]);
+			}
+			jpeg_write_raw_data(cinfo, planes, vmax * DCTSIZE);
+		}
+	}
+	jpeg_finish_compress(cinfo);
+	return 0;
+}
+
+static void *_sjpeg_workerthread(void *arg)
+{
+	SJpegWorker_t *worker = arg;
+	SJpeg_t *encoder = worker->encoder;
+	pthread_mutex_lock(&encoder->mutex);
+	while (encoder->run || worker->state == WORKER_PENDING)
+	{
+		if (worker->state != WORKER_PENDING)
+		{
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+			continue;
+		}
+		worker->state = WORKER_BUSY;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		unsigned char *output = NULL;
+		unsigned long length = 0;
+		int ret = _sjpeg_encode(worker, &output, &length);
+		/// libjpeg replaced a too small output
+		if (ret == 0 && output != worker->output)
+		{
+			free(worker->output);
+			worker->output = output;
+			worker->outputsize = length;
+		}
+
+		pthread_mutex_lock(&encoder->mutex);
+		while (encoder->written != worker->sequence)
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		pthread_mutex_unlock(&encoder->mutex);
+		/// the other workers wait their turn, the output is never concurrent
+		if (ret == 0 && encoder->output(encoder->arg, (const char *)output, length,
+				worker->timestamp, worker->framesequence) < 0)
+			err("sjpeg: frame %u output error %m", worker->sequence);
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->written++;
+		worker->state = WORKER_IDLE;
+		pthread_cond_broadcast(&encoder->cond);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+	return NULL;
+}
+
+static void _sjpeg_workerrelease(SJpegWorker_t *worker)
+{
+	jpeg_destroy_compress(&worker->cinfo);
+	free(worker->input);
+	free(worker->scratch);
+	free(worker->output);
+}
+
+SJpeg_t *sjpeg_create(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride,
+		int quality, int nworkers, SJpegOutput_t output, void *arg)
+{
+	if (!sjpeg_supported(fourcc) || width == 0 || height == 0)
+	{
+		err("sjpeg: format %.4s %ux%u not supported", (char *)&fourcc, width, height);
+		return NULL;
+	}
+	if (stride == 0)
+		stride = width * _sjpeg_bytesperpixel(fourcc);
+	if (quality <= 0 || quality > 100)
+		quality = SJPEG_DEFAULTQUALITY;
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+	if (nworkers > SJPEG_MAXWORKERS)
+		nworkers = SJPEG_MAXWORKERS;
+
+	SJpeg_t *encoder = calloc(1, sizeof(*encoder));
+	encoder->fourcc = fourcc;
+	encoder->width = width;
+	encoder->height = height;
+	encoder->stride = stride;
+	encoder->quality = quality;
+	encoder->output = output;
+	encoder->arg = arg;
+	encoder->framesize = sformat_framesize(fourcc, width, height, stride);
+	_sjpeg_layout(encoder);
+	encoder->workers = calloc(nworkers, sizeof(*encoder->workers));
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+	encoder->run = 1;
+	for (int i = 0; i < nworkers; i++)
+	{
+		SJpegWorker_t *worker = &encoder->workers[i];
+		worker->encoder = encoder;
+		if (_sjpeg_workerinit(worker) < 0)
+		{
+			err("sjpeg: worker %d initialization error", i);
+			_sjpeg_workerrelease(worker);
+			break;
+		}
+		if (pthread_create(&worker->thread, NULL, _sjpeg_workerthread, worker))
+		{
+			err("sjpeg: worker %d thread error %m", i);
+			_sjpeg_workerrelease(worker);
+			break;
+		}
+		encoder->nworkers++;
+	}
+	if (encoder->nworkers == 0)
+	{
+		sjpeg_destroy(encoder);
+		return NULL;
+	}
+	dbg("sjpeg: %d workers for %.4s %ux%u quality %d", encoder->nworkers, (char *)&fourcc, width, height, quality);
+	return encoder;
+}
+
+int sjpeg_push(SJpeg_t *encoder, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence)
+{
+	SJpegWorker_t *worker = NULL;
+	pthread_mutex_lock(&encoder->mutex);
+	for (int i = 0; i < encoder->nworkers && worker == NULL; i++)
+	{
+		if (encoder->workers[i].state == WORKER_IDLE)
+			worker = &encoder->workers[i];
+	}
+	if (worker == NULL)
+	{
+		encoder->drops++;
+		pthread_mutex_unlock(&encoder->mutex);
+		return 1;
+	}
+	/// the sequence fixes the place of the frame into the output
+	worker->state = WORKER_FILLING;
+	worker->sequence = encoder->sequence++;
+	worker->timestamp = timestamp;
+	worker->framesequence = sequence;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (length > encoder->framesize)
+		length = encoder->framesize;
+	/// the end of a short frame keeps the data of a previous one
+	if (length < encoder->framesize)
+		dbg("sjpeg: frame of %zu bytes instead of %zu", length, encoder->framesize);
+	memcpy(worker->input, mem, length);
+
+	pthread_mutex_lock(&encoder->mutex);
+	worker->state = WORKER_PENDING;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+	return 0;
+}
+
+void sjpeg_destroy(SJpeg_t *encoder)
+{
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->run = 0;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+	for (int i = 0; i < encoder->nworkers; i++)
+	{
+		pthread_join(encoder->workers[i].thread, NULL);
+		_sjpeg_workerrelease(&encoder->workers[i]);
+	}
+	if (encoder->drops)
+		warn("sjpeg: %u frames dropped, all the workers were busy", encoder->drops);
+	pthread_mutex_destroy(&encoder->mutex);
+	pthread_cond_destroy(&encoder->cond);
+	free(encoder->workers);
+	free(encoder);
+}
+
+struct SJpegDecoder_s
+{
+	struct jpeg_decompress_struct dinfo;
+	SJpegError_t jerr;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	JSAMPLE *scratch;
+	size_t scratchsize;
+	int mismatch;
+};
+
+int sjpeg_decodable(uint32_t fourcc)
+{
+	switch (fourcc)
+	{
+		case FOURCC('Y','U','Y','V'):
+#ifdef JCS_EXTENSIONS
+		case FOURCC('A','B','2','4'):
+		case FOURCC('R','G','B','A'):
+#endif
+		return 1;
+		default:
+		break;
+	}
+	return 0;
+}
+
+SJpegDecoder_t *sjpeg_decodercreate(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride)
+{
+	if (!sjpeg_decodable(fourcc) || width == 0 || height == 0)
+	{
+		err("sjpeg: decoding to %.4s %ux%u not supported", (char *)&fourcc, width, height);
+		return NULL;
+	}
+	SJpegDecoder_t *decoder = calloc(1, sizeof(*decoder));
+	decoder->fourcc = fourcc;
+	decoder->width = width;
+	decoder->height = height;
+	decoder->stride = (stride > 0)? stride: width * _sjpeg_bytesperpixel(fourcc);
+	decoder->dinfo.err = jpeg_std_error(&decoder->jerr.parent);
+	decoder->jerr.parent.error_exit = _sjpeg_errorexit;
+	if (setjmp(decoder->jerr.jump))
+	{
+		free(decoder);
+		return NULL;
+	}
+	jpeg_create_decompress(&decoder->dinfo);
+	return decoder;
+}
+
+static JSAMPLE *_sjpeg_scratch(SJpegDecoder_t *decoder, size_t size)
+{
+	if (size > decoder->scratchsize)
+	{
+		free(decoder->scratch);
+		decoder->scratch = malloc(size);
+		decoder->scratchsize = (decoder->scratch)? size: 0;
+	}
+	return decoder->scratch;
+}
+
+/**
+ * u and v are read every step samples, each one for two pixels.
+ */
+static void _sjpeg_packyuyv(const JSAMPLE *y, const JSAMPLE *u, const JSAMPLE *v,
+		int ystep, int cstep, uint32_t width, JSAMPLE *restrict dst)
+{
+	uint32_t x = 0;
+	for (; x + 1 < width; x += 2)
+	{
+		dst[2 * x] = y[x * ystep];
+		dst[2 * x + 1] = u[x / 2 * cstep];
+		dst[2 * x + 2] = y[(x + 1) * ystep];
+		dst[2 * x + 3] = v[x / 2 * cstep];
+	}
+	if (x < width)
+	{
+		dst[2 * x] = y[x * ystep];
+		dst[2 * x + 1] = u[x / 2 * cstep];
+	}
+}
+
+/**
+ * the 4:2:2 and 4:2:0 images are read as raw samples, without the
+ * upsampling and the color conversion of libjpeg. A 4:2:0 chroma line
+ * is used for two lines of the frame.
+ */
+static int _sjpeg_rawyuyv(SJpegDecoder_t *decoder, char *frame)
+{
+	struct jpeg_decompress_struct *dinfo = &decoder->dinfo;
+	dinfo->raw_data_out = TRUE;
+	jpeg_start_decompress(dinfo);
+	int vsamp = dinfo->comp_info[0].v_samp_factor;
+	int nlines = vsamp * DCTSIZE;
+	size_t lwidth = dinfo->comp_info[0].width_in_blocks * DCTSIZE;
+	size_t cwidth = dinfo->comp_info[1].width_in_blocks * DCTSIZE;
+	JSAMPLE *scratch = _sjpeg_scratch(decoder, nlines * lwidth + 2 * DCTSIZE * cwidth);
+	if (scratch == NULL)
+	{
+		jpeg_abort_decompress(dinfo);
+		return -1;
+	}
+	JSAMPROW lines[3][2 * DCTSIZE];
+	JSAMPARRAY planes[3] = {lines[0], lines[1], lines[2]};
+	for (int i = 0; i < nlines; i++)
+		lines[0][i] = scratch + i * lwidth;
+	for (int i = 0; i < DCTSIZE; i++)
+	{
+		lines[1][i] = scratch + nlines * lwidth + i * cwidth;
+		lines[2][i] = scratch + nlines * lwidth + (DCTSIZE + i) * cwidth;
+	}
+	while (dinfo->output_scanline < dinfo->output_height)
+	{
+		uint32_t first = dinfo->output_scanline;
+		if (jpeg_read_raw_data(dinfo, planes, nlines) == 0)
+			break;
+		for (int i = 0; i < nlines && first + i < decoder->height; i++)
+			_sjpeg_packyuyv(lines[0][i], lines[1][i / vsamp], lines[2][i / vsamp], 1, 1,
+				decoder->width, (JSAMPLE *)frame + (size_t)(first + i) * decoder->stride);
+	}
+	jpeg_finish_decompress(dinfo);
+	return 0;
+}
+
+static int _sjpeg_scanlines(SJpegDecoder_t *decoder, char *frame)
+{
+	struct jpeg_decompress_struct *dinfo = &decoder->dinfo;
+	if (decoder->fourcc != FOURCC('Y','U','Y','V'))
+	{
+#ifdef JCS_EXTENSIONS
+		dinfo->out_color_space = JCS_EXT_RGBA;
+#endif
+		dinfo->do_fancy_upsampling = FALSE;
+		jpeg_start_decompress(dinfo);
+		while (dinfo->output_scanline < dinfo->output_height)
+		{
+			JSAMPROW line = (JSAMPROW)frame + (size_t)dinfo->output_scanline * decoder->stride;
+			jpeg_read_scanlines(dinfo, &line, 1);
+		}
+		jpeg_finish_decompress(dinfo);
+		return 0;
+	}
+	/// the other samplings are upsampled by libjpeg and the chroma is subsampled here
+	static const JSAMPLE neutral[1] = {128};
+	int gray = (dinfo->num_components == 1);
+	dinfo->out_color_space = gray? JCS_GRAYSCALE: JCS_YCbCr;
+	jpeg_start_decompress(dinfo);
+	JSAMPROW line = _sjpeg_scratch(decoder, (size_t)dinfo->output_width * dinfo->output_components);
+	if (line == NULL)
+	{
+		jpeg_abort_decompress(dinfo);
+		return -1;
+	}
+	while (dinfo->output_scanline < dinfo->output_height)
+	{
+		JSAMPLE *dst = (JSAMPLE *)frame + (size_t)dinfo->output_scanline * decoder->stride;
+		jpeg_read_scanlines(dinfo, &line, 1);
+		if (gray)
+			_sjpeg_packyuyv(line, neutral, neutral, 1, 0, decoder->width, dst);
+		else
+			_sjpeg_packyuyv(line, line + 1, line + 2, 3, 6, decoder->width, dst);
+	}
+	jpeg_finish_decompress(dinfo);
+	return 0;
+}
+
+int sjpeg_decode(SJpegDecoder_t *decoder, const char *data, size_t length, char *frame)
+{
+	struct jpeg_decompress_struct *dinfo = &decoder->dinfo;
+	if (setjmp(decoder->jerr.jump))
+	{
+		jpeg_abort_decompress(dinfo);
+		return -1;
+	}
+	jpeg_mem_src(dinfo, (unsigned char *)data, length);
+	jpeg_read_header(dinfo, TRUE);
+	if (dinfo->image_width != decoder->width || dinfo->image_height != decoder->height)
+	{
+		if (!decoder->mismatch++)
+			err("sjpeg: image of %ux%u instead of %ux%u", dinfo->image_width, dinfo->image_height,
+				decoder->width, decoder->height);
+		jpeg_abort_decompress(dinfo);
+		return -1;
+	}
+	jpeg_component_info *comp = dinfo->comp_info;
+	if (decoder->fourcc == FOURCC('Y','U','Y','V') &&
+		dinfo->num_components == 3 && dinfo->jpeg_color_space == JCS_YCbCr &&
+		comp[0].h_samp_factor == 2 && (comp[0].v_samp_factor == 1 || comp[0].v_samp_factor == 2) &&
+		comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1 &&
+		comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1)
+		return _sjpeg_rawyuyv(decoder, frame);
+	return _sjpeg_scanlines(decoder, frame);
+}
+
+void sjpeg_decoderdestroy(SJpegDecoder_t *decoder)
+{
+	jpeg_destroy_decompress(&decoder->dinfo);
+	free(decoder->scratch);
+	free(decoder);
+}
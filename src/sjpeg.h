@@ -0,0 +1,102 @@
+#ifndef __SJPEG_H__
+#define __SJPEG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SJPEG_DEFAULTQUALITY 85
+
+/**
+ * @brief receive an encoded frame, the calls follow the order of
+ * sjpeg_push and never overlap.
+ *
+ * @param arg the argument of sjpeg_create.
+ * @param data the JPEG image.
+ * @param length the size of the image.
+ * @param timestamp the timestamp given to sjpeg_push.
+ * @param sequence the sequence given to sjpeg_push.
+ *
+ * @return 0 on success, -1 on error.
+ */
+typedef int (*SJpegOutput_t)(void *arg, const char *data, size_t length, uint64_t timestamp, uint32_t sequence);
+
+typedef struct SJpeg_s SJpeg_t;
+
+/**
+ * @brief check the encoding of a format. The YUV formats are encoded
+ * without RGB conversion, with the 4:2:0 or 4:2:2 sampling of the frame.
+ *
+ * @return 1 if the frames of this format are encoded.
+ */
+int sjpeg_supported(uint32_t fourcc);
+/**
+ * @brief create a pool of encoders. Each worker owns its compressor, a
+ * copy of the frame and the JPEG output.
+ *
+ * @param fourcc the format of the frames.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param stride the number of bytes of a line of the first plane.
+ * @param quality the JPEG quality from 1 to 100, 0 for the default.
+ * @param nworkers the number of threads, 0 for the number of CPUs.
+ * @param output the function receiving the images.
+ * @param arg the first argument of output.
+ *
+ * @return the pool, NULL on error.
+ */
+SJpeg_t *sjpeg_create(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride,
+		int quality, int nworkers, SJpegOutput_t output, void *arg);
+/**
+ * @brief copy a frame to an idle worker. The frame is dropped when all
+ * the workers are busy.
+ *
+ * @param encoder the pool.
+ * @param mem the frame.
+ * @param length the size of the frame.
+ * @param timestamp the value given back to the output function.
+ * @param sequence the number of the frame, given back to the output function.
+ *
+ * @return 0 on success, 1 if the frame is dropped, -1 on error.
+ */
+int sjpeg_push(SJpeg_t *encoder, const char *mem, size_t length, uint64_t timestamp, uint32_t sequence);
+/**
+ * @brief encode and output the pending frames, then stop the workers.
+ */
+void sjpeg_destroy(SJpeg_t *encoder);
+
+typedef struct SJpegDecoder_s SJpegDecoder_t;
+
+/**
+ * @brief check the decoding to a format. YUYV is built from the YCbCr
+ * samples of the image without color conversion.
+ *
+ * @return 1 if the images are decoded to this format.
+ */
+int sjpeg_decodable(uint32_t fourcc);
+/**
+ * @brief create a decoder for one thread.
+ *
+ * @param fourcc the format of the frames, YUYV or RGBA.
+ * @param width the number of pixels of a line.
+ * @param height the number of lines.
+ * @param stride the number of bytes of a line of the frame.
+ *
+ * @return the decoder, NULL on error.
+ */
+SJpegDecoder_t *sjpeg_decodercreate(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t stride);
+/**
+ * @brief decode an image into a frame. The Huffman tables missing from
+ * the MJPEG images are the default ones of libjpeg-turbo.
+ *
+ * @param decoder the decoder.
+ * @param data the JPEG image.
+ * @param length the size of the image.
+ * @param frame the memory of stride * height bytes.
+ *
+ * @return 0 on success, -1 on error or if the size of the image isn't the
+ * size of the frame.
+ */
+int sjpeg_decode(SJpegDecoder_t *decoder, const char *data, size_t length, char *frame);
+void sjpeg_decoderdestroy(SJpegDecoder_t *decoder);
+
+#endif
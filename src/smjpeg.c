@@ -0,0 +1,740 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#ifdef HAVE_JANSSON
+#include <jansson.h>
+#endif
+
+#include "config.h"
+#include "log.h"
+#include "sclock.h"
+#include "sjpeg.h"
+#include "smjpeg.h"
+
+#define MJPEG_MAXBUFFERS 32
+/// the display and the gpu import at most 4 decoded frames
+#define MJPEG_MAXFRAMES 4
+#define MJPEG_MAXWORKERS 16
+#define MJPEG_MAXSIZE 16384
+
+enum
+{
+	FRAME_FREE,
+	FRAME_DECODING,
+	FRAME_DONE,
+	FRAME_FAILED,
+	FRAME_READY,
+	FRAME_OUT,
+};
+
+/**
+ * the buffers move between the states through these queues of indexes,
+ * the capacity is the maximum number of buffers.
+ */
+typedef struct MJpegFifo_s MJpegFifo_t;
+struct MJpegFifo_s
+{
+	int items[MJPEG_MAXBUFFERS];
+	int head;
+	int count;
+};
+
+typedef struct MJpegInput_s MJpegInput_t;
+struct MJpegInput_s
+{
+	int dma_buf;
+	char *mem;
+	size_t size;
+	size_t bytesused;
+	uint64_t timestamp;
+};
+
+typedef struct MJpegFrame_s MJpegFrame_t;
+struct MJpegFrame_s
+{
+	int dma_buf;
+	char *mem;
+	int state;
+	int input;
+	uint32_t sequence;
+	uint64_t timestamp;
+};
+
+typedef struct MJpegWorker_s MJpegWorker_t;
+struct MJpegWorker_s
+{
+	MJpeg_t *dev;
+	SJpegDecoder_t *decoder;
+	pthread_t thread;
+};
+
+/**
+ * the inputs are the dmabuf of the camera, the frames are the slots of
+ * a memfd exported with udmabuf.
+ */
+typedef struct MJpegCore_s MJpegCore_t;
+struct MJpegCore_s
+{
+	MJpegConfig_t *config;
+	size_t framesize;
+	MJpegInput_t inputs[MJPEG_MAXBUFFERS];
+	int ninputs;
+	MJpegFrame_t frames[MJPEG_MAXBUFFERS];
+	int nframes;
+	char *arena;
+	size_t arenasize;
+	MJpegWorker_t workers[MJPEG_MAXWORKERS];
+	int nworkers;
+	MJpegFifo_t free;
+	MJpegFifo_t pending;
+	MJpegFifo_t released;
+	MJpegFifo_t ready;
+	/// the sequence of the next queued image, and of the next ready frame
+	uint32_t sequence;
+	uint32_t nextout;
+	uint32_t drops;
+	uint32_t errors;
+	int run;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct MJpeg_s
+{
+	MJpegCore_t *core;
+	DeviceConf_t *config;
+	int issink;
+	int eventfd;
+	MJpeg_t *sink;
+};
+
+static void _smjpeg_push(MJpegFifo_t *fifo, int index)
+{
+	fifo->items[(fifo->head + fifo->count) % MJPEG_MAXBUFFERS] = index;
+	fifo->count++;
+}
+
+static int _smjpeg_pop(MJpegFifo_t *fifo)
+{
+	if (fifo->count == 0)
+		return -1;
+	int index = fifo->items[fifo->head];
+	fifo->head = (fifo->head + 1) % MJPEG_MAXBUFFERS;
+	fifo->count--;
+	return index;
+}
+
+/**
+ * the eventfd are semaphores, one read for one buffer.
+ */
+static void _smjpeg_signal(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0)
+		dbg("smjpeg: event error %m");
+}
+
+static int _smjpeg_wait(int fd)
+{
+	uint64_t value;
+	return (read(fd, &value, sizeof(value)) < 0)? -1: 0;
+}
+
+static void _smjpeg_syncdma(int dma_buf, uint64_t flags)
+{
+	struct dma_buf_sync sync = { 0 };
+	sync.flags = flags;
+	if (ioctl(dma_buf, DMA_BUF_IOCTL_SYNC, &sync))
+		dbg("smjpeg: dmabuf %d sync error %m", dma_buf);
+}
+
+DeviceConf_t *smjpeg_createconfig()
+{
+	MJpegConfig_t *devconfig = NULL;
+	devconfig = calloc(1, sizeof(MJpegConfig_t));
+	devconfig->parent.ops.loadconfiguration = smjpeg_loadconfiguration;
+	return (DeviceConf_t *)devconfig;
+}
+
+MJpeg_t *smjpeg_create(const char *devicename, MJpegConfig_t *config)
+{
+	if (config->parent.fourcc == 0)
+		config->parent.fourcc = FOURCC('Y','U','Y','V');
+	if (!sjpeg_decodable(config->parent.fourcc))
+	{
+		err("smjpeg: decoding to %.4s not supported", (char *)&config->parent.fourcc);
+		return NULL;
+	}
+	if (config->sink.fourcc == 0)
+		config->sink.fourcc = FOURCC('M','J','P','G');
+	if (config->nbuffers <= 0)
+		config->nbuffers = MJPEG_DEFAULTBUFFERS;
+	if (config->nbuffers > MJPEG_MAXFRAMES)
+		config->nbuffers = MJPEG_MAXFRAMES;
+	config->sink.name = config->parent.name;
+
+	MJpegCore_t *core = calloc(1, sizeof(*core));
+	core->config = config;
+	pthread_mutex_init(&core->mutex, NULL);
+	pthread_cond_init(&core->cond, NULL);
+	MJpeg_t *dev = calloc(1, sizeof(*dev));
+	dev->core = core;
+	dev->config = &config->parent;
+	dev->sink = calloc(1, sizeof(*dev->sink));
+	dev->sink->core = core;
+	dev->sink->config = &config->sink;
+	dev->sink->issink = 1;
+	dev->eventfd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+	dev->sink->eventfd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+	if (dev->eventfd < 0 || dev->sink->eventfd < 0)
+	{
+		err("smjpeg: eventfd error %m");
+		smjpeg_destroy(dev);
+		return NULL;
+	}
+	dbg("smjpeg: %.4s => %.4s", (char *)&config->sink.fourcc, (char *)&config->parent.fourcc);
+	return dev;
+}
+
+MJpeg_t *smjpeg_sink(MJpeg_t *dev)
+{
+	return dev->sink;
+}
+
+DeviceConf_t *smjpeg_config(MJpeg_t *dev)
+{
+	return dev->config;
+}
+
+int smjpeg_eventfd(MJpeg_t *dev)
+{
+	return dev->eventfd;
+}
+
+static void _smjpeg_unmapinputs(MJpegCore_t *core)
+{
+	for (int i = 0; i < core->ninputs; i++)
+	{
+		if (core->inputs[i].mem)
+			munmap(core->inputs[i].mem, core->inputs[i].size);
+	}
+	core->ninputs = 0;
+}
+
+static int _smjpeg_importinputs(MJpegCore_t *core, int ntargets, int *targets, size_t size)
+{
+	_smjpeg_unmapinputs(core);
+	if (ntargets > MJPEG_MAXBUFFERS)
+	{
+		err("smjpeg: too many buffers %d", ntargets);
+		return -1;
+	}
+	for (int i = 0; i < ntargets; i++)
+	{
+		MJpegInput_t *input = &core->inputs[i];
+		memset(input, 0, sizeof(*input));
+		input->dma_buf = targets[i];
+		input->size = size;
+		input->mem = mmap(NULL, size, PROT_READ, MAP_SHARED, targets[i], 0);
+		if (input->mem == MAP_FAILED)
+		{
+			err("smjpeg: dmabuf %d mapping error %m", targets[i]);
+			input->mem = NULL;
+			core->ninputs = i;
+			_smjpeg_unmapinputs(core);
+			return -1;
+		}
+		core->ninputs = i + 1;
+	}
+	return 0;
+}
+
+static void _smjpeg_freeframes(MJpegCore_t *core)
+{
+	for (int i = 0; i < core->nframes; i++)
+	{
+		if (core->frames[i].dma_buf >= 0)
+			close(core->frames[i].dma_buf);
+	}
+	if (core->arena)
+		munmap(core->arena, core->arenasize);
+	core->arena = NULL;
+	core->nframes = 0;
+}
+
+/**
+ * the frames are the page aligned slots of a memfd, the memfd stays
+ * mapped for the decoding and each slot is exported as a dmabuf.
+ * The size given to the display is the size of the frame, the pitch
+ * is computed from it.
+ */
+static int _smjpeg_exportframes(MJpegCore_t *core, int *ntargets, int **targets, size_t *size)
+{
+	MJpegConfig_t *config = core->config;
+	uint32_t bpp = (config->parent.fourcc == FOURCC('Y','U','Y','V'))? 2: 4;
+	if (config->parent.width == 0 || config->parent.height == 0)
+	{
+		err("smjpeg: size of the frames unknown");
+		return -1;
+	}
+	config->parent.stride = config->parent.width * bpp;
+	core->framesize = (size_t)config->parent.stride * config->parent.height;
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t slotsize = (core->framesize + pagesize - 1) & ~(pagesize - 1);
+	int nframes = config->nbuffers;
+
+	_smjpeg_freeframes(core);
+	int udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf < 0)
+	{
+		err("smjpeg: udmabuf not available %m");
+		return -1;
+	}
+	core->arenasize = slotsize * nframes;
+	/// udmabuf accepts only the memfd which can't shrink
+	int memfd = memfd_create("smjpeg", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, core->arenasize) || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+	{
+		err("smjpeg: memfd of %zu bytes error %m", core->arenasize);
+		if (memfd >= 0)
+			close(memfd);
+		close(udmabuf);
+		return -1;
+	}
+	core->arena = mmap(NULL, core->arenasize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (core->arena == MAP_FAILED)
+	{
+		err("smjpeg: memfd mapping error %m");
+		core->arena = NULL;
+		close(memfd);
+		close(udmabuf);
+		return -1;
+	}
+	int ret = 0;
+	for (int i = 0; i < nframes; i++)
+	{
+		MJpegFrame_t *frame = &core->frames[i];
+		memset(frame, 0, sizeof(*frame));
+		frame->mem = core->arena + i * slotsize;
+		struct udmabuf_create create = {
+			.memfd = memfd,
+			.flags = UDMABUF_FLAGS_CLOEXEC,
+			.offset = i * slotsize,
+			.size = slotsize,
+		};
+		frame->dma_buf = ioctl(udmabuf, UDMABUF_CREATE, &create);
+		core->nframes = i + 1;
+		if (frame->dma_buf < 0)
+		{
+			err("smjpeg: udmabuf of the frame %d error %m", i);
+			ret = -1;
+			break;
+		}
+	}
+	close(memfd);
+	close(udmabuf);
+	if (ret)
+	{
+		_smjpeg_freeframes(core);
+		return -1;
+	}
+	*targets = calloc(nframes, sizeof(int));
+	for (int i = 0; i < nframes; i++)
+		(*targets)[i] = core->frames[i].dma_buf;
+	*ntargets = nframes;
+	*size = core->framesize;
+	dbg("smjpeg: %d frames of %zu bytes", nframes, core->framesize);
+	return 0;
+}
+
+int smjpeg_requestbuffer(MJpeg_t *dev, enum buf_type_e t, ...)
+{
+	MJpegCore_t *core = dev->core;
+	va_list ap;
+	va_start(ap, t);
+	int ret = -1;
+	switch (t)
+	{
+		case buf_type_dmabuf:
+		{
+			int ntargets = va_arg(ap, int);
+			int *targets = va_arg(ap, int *);
+			size_t size = va_arg(ap, size_t);
+			if (!dev->issink)
+				err("smjpeg: the decoded frames are exported");
+			else
+				ret = _smjpeg_importinputs(core, ntargets, targets, size);
+		}
+		break;
+		case buf_type_dmabuf | buf_type_master:
+		{
+			int *ntargets = va_arg(ap, int *);
+			int **targets = va_arg(ap, int **);
+			size_t *size = va_arg(ap, size_t *);
+			if (dev->issink)
+				err("smjpeg: the compressed frames are imported");
+			else
+				ret = _smjpeg_exportframes(core, ntargets, targets, size);
+		}
+		break;
+		default:
+			err("smjpeg: support only dmabuf");
+		break;
+	}
+	va_end(ap);
+	return ret;
+}
+
+/**
+ * the frames are given in the order of the images, a failed image
+ * releases its frame.
+ */
+static void _smjpeg_advance(MJpeg_t *dev)
+{
+	MJpegCore_t *core = dev->core;
+	int found = 1;
+	while (found)
+	{
+		found = 0;
+		for (int i = 0; i < core->nframes && !found; i++)
+		{
+			MJpegFrame_t *frame = &core->frames[i];
+			if (frame->sequence != core->nextout ||
+				(frame->state != FRAME_DONE && frame->state != FRAME_FAILED))
+				continue;
+			found = 1;
+			core->nextout++;
+			if (frame->state == FRAME_FAILED)
+			{
+				frame->state = FRAME_FREE;
+				_smjpeg_push(&core->free, i);
+				continue;
+			}
+			frame->state = FRAME_READY;
+			_smjpeg_push(&core->ready, i);
+			_smjpeg_signal(dev->eventfd);
+		}
+	}
+}
+
+static void *_smjpeg_workerthread(void *arg)
+{
+	MJpegWorker_t *worker = arg;
+	MJpeg_t *dev = worker->dev;
+	MJpegCore_t *core = dev->core;
+	pthread_mutex_lock(&core->mutex);
+	while (core->run || core->pending.count > 0)
+	{
+		int index = _smjpeg_pop(&core->pending);
+		if (index < 0)
+		{
+			pthread_cond_wait(&core->cond, &core->mutex);
+			continue;
+		}
+		MJpegFrame_t *frame = &core->frames[index];
+		MJpegInput_t *input = &core->inputs[frame->input];
+		pthread_mutex_unlock(&core->mutex);
+
+		_smjpeg_syncdma(input->dma_buf, DMA_BUF_SYNC_READ | DMA_BUF_SYNC_START);
+		_smjpeg_syncdma(frame->dma_buf, DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_START);
+		int ret = sjpeg_decode(worker->decoder, input->mem, input->bytesused, frame->mem);
+		_smjpeg_syncdma(frame->dma_buf, DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_END);
+		_smjpeg_syncdma(input->dma_buf, DMA_BUF_SYNC_READ | DMA_BUF_SYNC_END);
+
+		pthread_mutex_lock(&core->mutex);
+		frame->timestamp = input->timestamp = sclock_now();
+		frame->state = (ret < 0)? FRAME_FAILED: FRAME_DONE;
+		if (ret < 0)
+			core->errors++;
+		/// the compressed image goes back to the camera at once
+		_smjpeg_push(&core->released, frame->input);
+		_smjpeg_signal(dev->sink->eventfd);
+		_smjpeg_advance(dev);
+	}
+	pthread_mutex_unlock(&core->mutex);
+	return NULL;
+}
+
+static void _smjpeg_poolstop(MJpegCore_t *core)
+{
+	pthread_mutex_lock(&core->mutex);
+	core->run = 0;
+	pthread_cond_broadcast(&core->cond);
+	pthread_mutex_unlock(&core->mutex);
+	for (int i = 0; i < core->nworkers; i++)
+	{
+		pthread_join(core->workers[i].thread, NULL);
+		sjpeg_decoderdestroy(core->workers[i].decoder);
+	}
+	core->nworkers = 0;
+	if (core->drops || core->errors)
+		warn("smjpeg: %u images dropped, %u decoding errors", core->drops, core->errors);
+}
+
+static int _smjpeg_poolstart(MJpeg_t *dev)
+{
+	MJpegCore_t *core = dev->core;
+	MJpegConfig_t *config = core->config;
+	if (core->run)
+		return 0;
+	/// the eventfd are drained with the queues
+	while (_smjpeg_wait(dev->eventfd) == 0);
+	while (_smjpeg_wait(dev->sink->eventfd) == 0);
+	memset(&core->free, 0, sizeof(core->free));
+	memset(&core->pending, 0, sizeof(core->pending));
+	memset(&core->released, 0, sizeof(core->released));
+	memset(&core->ready, 0, sizeof(core->ready));
+	for (int i = 0; i < core->nframes; i++)
+	{
+		core->frames[i].state = FRAME_FREE;
+		_smjpeg_push(&core->free, i);
+	}
+	core->sequence = 0;
+	core->nextout = 0;
+	int nworkers = config->workers;
+	if (nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+	if (nworkers > MJPEG_MAXWORKERS)
+		nworkers = MJPEG_MAXWORKERS;
+	core->run = 1;
+	for (int i = 0; i < nworkers; i++)
+	{
+		MJpegWorker_t *worker = &core->workers[i];
+		worker->dev = dev;
+		worker->decoder = sjpeg_decodercreate(config->parent.fourcc, config->parent.width,
+				config->parent.height, config->parent.stride);
+		if (worker->decoder == NULL)
+			break;
+		if (pthread_create(&worker->thread, NULL, _smjpeg_workerthread, worker))
+		{
+			err("smjpeg: worker %d thread error %m", i);
+			sjpeg_decoderdestroy(worker->decoder);
+			break;
+		}
+		core->nworkers++;
+	}
+	if (core->nworkers == 0)
+	{
+		core->run = 0;
+		return -1;
+	}
+	dbg("smjpeg: %d decoding workers", core->nworkers);
+	return 0;
+}
+
+/**
+ * the pool is started by the source, which is ready before the camera,
+ * and stopped by the first side to stop.
+ */
+int smjpeg_start(MJpeg_t *dev)
+{
+	if (dev->issink)
+		return 0;
+	return _smjpeg_poolstart(dev);
+}
+
+int smjpeg_stop(MJpeg_t *dev)
+{
+	if (dev->core->run)
+		_smjpeg_poolstop(dev->core);
+	return 0;
+}
+
+int smjpeg_dequeue(MJpeg_t *dev, void **mem, size_t *bytesused)
+{
+	MJpegCore_t *core = dev->core;
+	if (_smjpeg_wait(dev->eventfd) < 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	pthread_mutex_lock(&core->mutex);
+	int index = -1;
+	if (dev->issink)
+	{
+		index = _smjpeg_pop(&core->released);
+		if (index >= 0 && bytesused)
+			*bytesused = core->inputs[index].bytesused;
+		if (index >= 0 && mem)
+			*mem = core->inputs[index].mem;
+	}
+	else
+	{
+		index = _smjpeg_pop(&core->ready);
+		if (index >= 0)
+			core->frames[index].state = FRAME_OUT;
+		if (index >= 0 && bytesused)
+			*bytesused = core->framesize;
+		if (index >= 0 && mem)
+			*mem = core->frames[index].mem;
+	}
+	pthread_mutex_unlock(&core->mutex);
+	if (index < 0)
+		errno = EAGAIN;
+	return index;
+}
+
+int smjpeg_queue(MJpeg_t *dev, int index, size_t bytesused)
+{
+	MJpegCore_t *core = dev->core;
+	if (index < 0 || (dev->issink && index >= core->ninputs) || (!dev->issink && index >= core->nframes))
+	{
+		err("smjpeg: unknown buffer %d", index);
+		return -1;
+	}
+	pthread_mutex_lock(&core->mutex);
+	if (!dev->issink)
+	{
+		core->frames[index].state = FRAME_FREE;
+		_smjpeg_push(&core->free, index);
+		pthread_mutex_unlock(&core->mutex);
+		return 0;
+	}
+	MJpegInput_t *input = &core->inputs[index];
+	input->bytesused = (bytesused > 0 && bytesused <= input->size)? bytesused: input->size;
+	int frameid = _smjpeg_pop(&core->free);
+	if (frameid < 0 || !core->run)
+	{
+		/// all the frames are decoding or displayed, the image is skipped
+		if (frameid >= 0)
+			_smjpeg_push(&core->free, frameid);
+		core->drops++;
+		_smjpeg_push(&core->released, index);
+		_smjpeg_signal(dev->eventfd);
+		pthread_mutex_unlock(&core->mutex);
+		return 0;
+	}
+	MJpegFrame_t *frame = &core->frames[frameid];
+	frame->state = FRAME_DECODING;
+	frame->input = index;
+	frame->sequence = core->sequence++;
+	_smjpeg_push(&core->pending, frameid);
+	pthread_cond_signal(&core->cond);
+	pthread_mutex_unlock(&core->mutex);
+	return 0;
+}
+
+int smjpeg_formats(MJpeg_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg)
+{
+	MJpegConfig_t *config = dev->core->config;
+	static const uint32_t compressed[] = {FOURCC('M','J','P','G'), FOURCC('J','P','E','G')};
+	static const uint32_t decoded[] = {FOURCC('Y','U','Y','V'), FOURCC('A','B','2','4')};
+	const uint32_t *fourccs = dev->issink? compressed: decoded;
+	DeviceFormat_t format = {
+		.minwidth = 1,
+		.maxwidth = MJPEG_MAXSIZE,
+		.stepwidth = 1,
+		.minheight = 1,
+		.maxheight = MJPEG_MAXSIZE,
+		.stepheight = 1,
+	};
+	/// the decoding keeps the size of the images
+	if (!dev->issink && config->sink.width && config->sink.height)
+	{
+		format.minwidth = format.maxwidth = config->sink.width;
+		format.minheight = format.maxheight = config->sink.height;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		format.fourcc = fourccs[i];
+		cb(arg, &format);
+	}
+	return 2;
+}
+
+int smjpeg_setformat(MJpeg_t *dev, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	MJpegConfig_t *config = dev->core->config;
+	if (dev->core->run)
+	{
+		err("smjpeg: format is locked by the decoding");
+		return -1;
+	}
+	if (dev->issink)
+	{
+		if (fourcc != FOURCC('M','J','P','G') && fourcc != FOURCC('J','P','E','G'))
+		{
+			err("smjpeg: %.4s isn't compressed", (char *)&fourcc);
+			return -1;
+		}
+		config->sink.fourcc = fourcc;
+		config->sink.width = width;
+		config->sink.height = height;
+	}
+	else
+	{
+		if (!sjpeg_decodable(fourcc) ||
+			(config->sink.width && (width != config->sink.width || height != config->sink.height)))
+		{
+			err("smjpeg: decoding to %.4s %ux%u not supported", (char *)&fourcc, width, height);
+			return -1;
+		}
+		config->parent.fourcc = fourcc;
+	}
+	config->parent.width = width;
+	config->parent.height = height;
+	return 0;
+}
+
+uint64_t smjpeg_timestamp(MJpeg_t *dev, int index)
+{
+	MJpegCore_t *core = dev->core;
+	if (dev->issink && index >= 0 && index < core->ninputs)
+		return core->inputs[index].timestamp;
+	if (!dev->issink && index >= 0 && index < core->nframes)
+		return core->frames[index].timestamp;
+	return 0;
+}
+
+/**
+ * the source owns the sink and the pool
+ */
+void smjpeg_destroy(MJpeg_t *dev)
+{
+	if (dev->issink)
+		return;
+	MJpegCore_t *core = dev->core;
+	if (core->run)
+		_smjpeg_poolstop(core);
+	_smjpeg_unmapinputs(core);
+	_smjpeg_freeframes(core);
+	if (dev->eventfd >= 0)
+		close(dev->eventfd);
+	if (dev->sink->eventfd >= 0)
+		close(dev->sink->eventfd);
+	pthread_mutex_destroy(&core->mutex);
+	pthread_cond_destroy(&core->cond);
+	free(dev->sink);
+	free(core);
+	free(dev);
+}
+
+#ifdef HAVE_JANSSON
+int smjpeg_loadjsonconfiguration(void *arg, void *entry)
+{
+	json_t *jconfig = entry;
+	MJpegConfig_t *config = (MJpegConfig_t *)arg;
+	json_t *workers = json_object_get(jconfig, "workers");
+	if (workers && json_is_integer(workers))
+		config->workers = json_integer_value(workers);
+	json_t *nbuffers = json_object_get(jconfig, "nbuffers");
+	if (nbuffers && json_is_integer(nbuffers))
+		config->nbuffers = json_integer_value(nbuffers);
+	return 0;
+}
+#endif
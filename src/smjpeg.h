@@ -0,0 +1,74 @@
+#ifndef __SMJPEG_H__
+#define __SMJPEG_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define MJPEG_DEFAULTBUFFERS 4
+
+/**
+ * @brief configuration of the decoder.
+ *
+ * @param parent the definition of the decoded frames, YUYV by default,
+ * or RGBA (AB24).
+ * @param sink the definition of the compressed frames, MJPG or JPEG.
+ * @param workers the number of decoding threads, 0 for the number of CPUs.
+ * @param nbuffers the number of decoded frames, 4 at most.
+ */
+typedef struct MJpegConfig_s MJpegConfig_t;
+struct MJpegConfig_s
+{
+	DeviceConf_t parent;
+	DeviceConf_t sink;
+	int workers;
+	int nbuffers;
+};
+
+/**
+ * the decoder is a transform: its sink receives the dmabuf of the camera
+ * (see smjpeg_sink), and its source exports the decoded frames as dmabuf
+ * for the display. The images are decoded by a pool of threads and the
+ * frames leave the source in the order of their arrival.
+ */
+typedef struct MJpeg_s MJpeg_t;
+
+DeviceConf_t *smjpeg_createconfig();
+
+MJpeg_t *smjpeg_create(const char *devicename, MJpegConfig_t *config);
+/**
+ * @brief the side of the decoder receiving the compressed frames, it
+ * accepts the same functions as the decoder.
+ */
+MJpeg_t *smjpeg_sink(MJpeg_t *dev);
+DeviceConf_t *smjpeg_config(MJpeg_t *dev);
+/**
+ * @brief the sink imports the dmabuf of its source (buf_type_dmabuf), the
+ * source exports its frames (buf_type_dmabuf | buf_type_master).
+ */
+int smjpeg_requestbuffer(MJpeg_t *dev, enum buf_type_e t, ...);
+/**
+ * @brief the eventfd is readable when a compressed frame is released by
+ * the sink, or when a decoded frame is ready on the source.
+ */
+int smjpeg_eventfd(MJpeg_t *dev);
+int smjpeg_start(MJpeg_t *dev);
+int smjpeg_stop(MJpeg_t *dev);
+int smjpeg_dequeue(MJpeg_t *dev, void **mem, size_t *bytesused);
+int smjpeg_queue(MJpeg_t *dev, int index, size_t bytesused);
+int smjpeg_formats(MJpeg_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg);
+int smjpeg_setformat(MJpeg_t *dev, uint32_t fourcc, uint32_t width, uint32_t height);
+/**
+ * @brief the time of the end of the decoding of a frame (cf sclock.h).
+ */
+uint64_t smjpeg_timestamp(MJpeg_t *dev, int index);
+void smjpeg_destroy(MJpeg_t *dev);
+
+#ifdef HAVE_JANSSON
+int smjpeg_loadjsonconfiguration(void *arg, void *entry);
+
+# define smjpeg_loadconfiguration smjpeg_loadjsonconfiguration
+#else
+# define smjpeg_loadconfiguration NULL
+#endif
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/select.h>
+
+#include "log.h"
+#include "sv4l2.h"
+#include "ssync.h"
+
+/**
+ * each device keeps at most its last frame, waiting for the frames of
+ * the other devices.
+ */
+typedef struct SSyncDevice_s SSyncDevice_t;
+struct SSyncDevice_s
+{
+	V4L2_t *dev;
+	int fd;
+	int pending;
+	SSyncFrame_t frame;
+};
+
+struct SSync_s
+{
+	SSyncDevice_t *devices;
+	int ndevices;
+	uint64_t tolerance;
+	SSyncStats_t stats;
+};
+
+SSync_t *ssync_create(V4L2_t *devs[], int ndevs, uint64_t tolerance)
+{
+	if (ndevs < 1)
+		return NULL;
+	SSync_t *ctx = calloc(1, sizeof(*ctx));
+	ctx->devices = calloc(ndevs, sizeof(*ctx->devices));
+	ctx->ndevices = ndevs;
+	ctx->tolerance = tolerance;
+	if (ctx->tolerance == 0)
+		ctx->tolerance = SSYNC_TOLERANCE;
+	for (int i = 0; i < ndevs; i++)
+	{
+		ctx->devices[i].dev = devs[i];
+		ctx->devices[i].fd = sv4l2_fd(devs[i]);
+		ctx->devices[i].pending = 0;
+	}
+	return ctx;
+}
+
+static int _ssync_release(SSyncDevice_t *device)
+{
+	device->pending = 0;
+	return sv4l2_queue(device->dev, device->frame.id, 0);
+}
+
+/**
+ * the frames older than the newest one minus the tolerance will never
+ * have a partner.
+ */
+static int _ssync_group(SSync_t *ctx, int (*transfer)(void *arg, int nframes, SSyncFrame_t frames[]), void *transferarg)
+{
+	uint64_t first = UINT64_MAX;
+	uint64_t last = 0;
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		if (!ctx->devices[i].pending)
+			continue;
+		uint64_t timestamp = ctx->devices[i].frame.timestamp;
+		if (timestamp < first)
+			first = timestamp;
+		if (timestamp > last)
+			last = timestamp;
+	}
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		SSyncDevice_t *device = &ctx->devices[i];
+		if (device->pending && device->frame.timestamp + ctx->tolerance < last)
+		{
+			ctx->stats.drops++;
+			if (_ssync_release(device) < 0)
+				return -1;
+		}
+	}
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		if (!ctx->devices[i].pending)
+			return 0;
+	}
+
+	SSyncFrame_t frames[ctx->ndevices];
+	for (int i = 0; i < ctx->ndevices; i++)
+		frames[i] = ctx->devices[i].frame;
+	uint32_t skew = (last - first) / 1000;
+	ctx->stats.groups++;
+	ctx->stats.skew += skew;
+	if (skew > ctx->stats.maxskew)
+		ctx->stats.maxskew = skew;
+	int ret = transfer(transferarg, ctx->ndevices, frames);
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		if (_ssync_release(&ctx->devices[i]) < 0)
+			return -1;
+	}
+	/// the stop requested by transfer isn't an error
+	if (ret < 0)
+	{
+		errno = 0;
+		return -1;
+	}
+	return 1;
+}
+
+static int _ssync_dequeue(SSync_t *ctx, SSyncDevice_t *device)
+{
+	void *mem = NULL;
+	size_t bytesused = 0;
+	int index = sv4l2_dequeue(device->dev, &mem, &bytesused);
+	if (index < 0)
+		return (errno == EAGAIN)? 0: -1;
+	/// a newer frame replaces the frame still waiting
+	if (device->pending)
+	{
+		ctx->stats.drops++;
+		if (_ssync_release(device) < 0)
+			return -1;
+	}
+	device->frame.id = index;
+	device->frame.mem = mem;
+	device->frame.size = bytesused;
+	device->frame.timestamp = sv4l2_timestamp(device->dev, index);
+	device->pending = 1;
+	return 1;
+}
+
+int ssync_loop(SSync_t *ctx, int (*transfer)(void *arg, int nframes, SSyncFrame_t frames[]), void *transferarg)
+{
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		if (sv4l2_start(ctx->devices[i].dev))
+		{
+			err("ssync: device %d not started %m", i);
+			for (int j = 0; j < i; j++)
+				sv4l2_stop(ctx->devices[j].dev);
+			return -1;
+		}
+	}
+	int ret = 0;
+	int run = 1;
+	while (run)
+	{
+		fd_set rfds;
+		fd_set efds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&efds);
+		int maxfd = 0;
+		for (int i = 0; i < ctx->ndevices; i++)
+		{
+			FD_SET(ctx->devices[i].fd, &rfds);
+			FD_SET(ctx->devices[i].fd, &efds);
+			maxfd = (maxfd > ctx->devices[i].fd)? maxfd: ctx->devices[i].fd;
+		}
+		struct timeval timeout = {
+			.tv_sec = 2,
+			.tv_usec = 0,
+		};
+		int nfds = select(maxfd + 1, &rfds, NULL, &efds, &timeout);
+		if (nfds == -1 && errno == EINTR)
+			continue;
+		if (nfds == -1)
+		{
+			err("ssync: select error %m");
+			ret = -1;
+			break;
+		}
+		if (nfds == 0)
+			warn("ssync: frame timeout");
+		for (int i = 0; run && nfds > 0 && i < ctx->ndevices; i++)
+		{
+			SSyncDevice_t *device = &ctx->devices[i];
+			if (FD_ISSET(device->fd, &efds))
+			{
+				int event = sv4l2_event(device->dev);
+				/// the buffers of the group can't be renegotiated alone
+				if (event & (event_type_eos | event_type_sourcechange))
+				{
+					warn("ssync: device %d stopped the stream", i);
+					run = 0;
+					break;
+				}
+			}
+			if (!FD_ISSET(device->fd, &rfds))
+				continue;
+			int done = _ssync_dequeue(ctx, device);
+			if (done > 0)
+				done = _ssync_group(ctx, transfer, transferarg);
+			if (done < 0)
+			{
+				if (errno)
+					err("ssync: device %d buffer error %m", i);
+				run = 0;
+			}
+		}
+	}
+	for (int i = 0; i < ctx->ndevices; i++)
+	{
+		ctx->devices[i].pending = 0;
+		sv4l2_stop(ctx->devices[i].dev);
+	}
+	if (ctx->stats.drops)
+		warn("ssync: %u groups, %u frames dropped, skew max %u us",
+			ctx->stats.groups, ctx->stats.drops, ctx->stats.maxskew);
+	return ret;
+}
+
+int ssync_statistics(SSync_t *ctx, SSyncStats_t *stats, int reset)
+{
+	if (stats)
+		memcpy(stats, &ctx->stats, sizeof(*stats));
+	if (reset)
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+	return 0;
+}
+
+void ssync_destroy(SSync_t *ctx)
+{
+	free(ctx->devices);
+	free(ctx);
+}
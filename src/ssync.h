@@ -0,0 +1,90 @@
+#ifndef __SSYNC_H__
+#define __SSYNC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sv4l2.h"
+
+/**
+ * the default tolerance between the timestamps of a group, in ns.
+ */
+#define SSYNC_TOLERANCE 5000000
+
+/**
+ * @brief a frame of a group.
+ *
+ * @param id the index of the buffer into its device.
+ * @param mem the memory of the buffer, NULL with dmabuf buffers.
+ * @param size the size of the data.
+ * @param timestamp the time of the frame in ns (cf sclock.h).
+ */
+typedef struct SSyncFrame_s SSyncFrame_t;
+struct SSyncFrame_s
+{
+	int id;
+	const char *mem;
+	size_t size;
+	uint64_t timestamp;
+};
+
+/**
+ * @brief statistics of the pairing.
+ * The mean skew is stats->skew / stats->groups.
+ *
+ * @param groups the number of emitted groups.
+ * @param drops the number of frames requeued without group.
+ * @param skew the sum of the distances between the first and the last
+ * frame of each group, in us.
+ * @param maxskew the maximum distance inside a group, in us.
+ */
+typedef struct SSyncStats_s SSyncStats_t;
+struct SSyncStats_s
+{
+	uint32_t groups;
+	uint32_t drops;
+	uint64_t skew;
+	uint32_t maxskew;
+};
+
+typedef struct SSync_s SSync_t;
+
+/**
+ * @brief create a synchronizer of capture devices.
+ * The devices must have their buffers and must not be started.
+ *
+ * @param devs the table of the V4L2_t objects.
+ * @param ndevs the number of devices.
+ * @param tolerance the maximum distance between the timestamps of a group
+ * in ns, 0 for SSYNC_TOLERANCE.
+ *
+ * @return SSync_t object or NULL on error.
+ */
+SSync_t *ssync_create(V4L2_t *devs[], int ndevs, uint64_t tolerance);
+/**
+ * @brief capture the devices and call transfer for each group of frames.
+ * A frame without partner is requeued as soon as a newer frame of
+ * another device is too far. The buffers of a group are requeued when
+ * transfer returns.
+ *
+ * @param ctx the SSync_t object.
+ * @param transfer the callback, the frames are in the order of the devices.
+ * The loop stops when it returns a negative value.
+ * @param transferarg the first argument of transfer.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int ssync_loop(SSync_t *ctx, int (*transfer)(void *arg, int nframes, SSyncFrame_t frames[]), void *transferarg);
+/**
+ * @brief get the statistics of the pairing.
+ *
+ * @param ctx the SSync_t object.
+ * @param stats the structure to fill, it may be NULL.
+ * @param reset reset the counters after the copy.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int ssync_statistics(SSync_t *ctx, SSyncStats_t *stats, int reset);
+void ssync_destroy(SSync_t *ctx);
+
+#endif
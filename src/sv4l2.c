@@ -12,17 +12,22 @@
 #include <string.h>
 #include <stdarg.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include <linux/videodev2.h>
 #include <linux/v4l2-subdev.h>
+#include <linux/dma-buf.h>
 #ifdef HAVE_JANSSON
 #include <jansson.h>
 #endif
 
 #include "log.h"
 #include "sv4l2.h"
+#include "s3a.h"
+#include "sclock.h"
 
 #define MAX_BUFFERS 4
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 
 #define dbg_buffer_splane(v4l2) 		dbg("sv4l2: buf %d info:", v4l2->index); \
 		dbg("\ttype: %s", (v4l2->type == V4L2_BUF_TYPE_VIDEO_CAPTURE)? "CAPTURE":"OUTPUT"); \
@@ -41,8 +46,15 @@
 
 const char sv4l2_defaultdevice[20] = "/dev/video0";
 
+/**
+ * the compressed formats of the UVC cameras are decoded by the mjpeg
+ * transform, the driver order chooses between them and YUYV when the
+ * configuration allows the compressed formats.
+ */
 DeviceConf_t formats[] = {
 	{.fourcc = FOURCC('Y','U','Y','V')},
+	{.fourcc = FOURCC('M','J','P','G')},
+	{.fourcc = FOURCC('J','P','E','G')},
 	{.fourcc = 0, },
 };
 
@@ -53,6 +65,8 @@ struct V4L2Buffer_s
 	struct v4l2_plane planes[VIDEO_MAX_PLANES];
 	void *map;
 	size_t length;
+	uint64_t timestamp;
+	uint32_t sequence;
 	struct {
 		int (*getdmafd)(V4L2Buffer_t *buf);
 		size_t (*getsize)(V4L2Buffer_t *buf);
@@ -62,13 +76,29 @@ struct V4L2Buffer_s
 	} ops;
 };
 
+/**
+ * one anonymous mapping holds the USERPTR buffers of the master
+ * memory sharing.
+ */
+typedef struct V4L2Arena_s V4L2Arena_t;
+struct V4L2Arena_s
+{
+	void *mem;
+	size_t length;
+	size_t stride;
+	int hugetlb;
+};
+
 #define MODE_CAPTURE 0x01
 #define MODE_OUTPUT 0x02
 #define MODE_MASTER 0x04
 #define MODE_META 0x08
 #define MODE_MEDIACTL 0x10
+#define MODE_M2M 0x20
 #define MODE_MPLANE 0x80
 
+typedef struct V4L2Cache_s V4L2Cache_t;
+
 typedef struct V4L2_s V4L2_t;
 struct V4L2_s
 {
@@ -86,9 +116,22 @@ struct V4L2_s
 		V4L2Buffer_t *(*createbuffers)(V4L2_t *dev, int number, enum v4l2_memory memory);
 	} ops;
 	int (*transfer)(void *, int id, const char *mem, size_t size);
+	V4L2_t *m2m;
+	uint64_t period;
+	uint32_t sequence;
+	uint64_t timestamp;
+	clockid_t clock;
+	V4L2Stats_t stats;
+	V4L2Cache_t *cache;
+	V4L2_t *meta;
+	int metapending;
+	size_t metabytesused;
+	S3A_t *s3a;
+	V4L2Arena_t arena;
 };
 
 static int sv4l2_subdev_open(CameraConfig_t *config);
+static void _sv4l2_freebuffers(V4L2_t *dev);
 
 static int _v4l2buffer_exportdmafd(V4L2Buffer_t *buf, int fd)
 {
@@ -125,6 +168,7 @@ static void setmem_splane(V4L2Buffer_t *buf, void *mem, size_t size)
 	buf->v4l2.m.userptr = (uintptr_t)mem;
 	buf->v4l2.length = size;
 	buf->length = size;
+	buf->map = mem;
 }
 
 static void *mmap_splane(V4L2Buffer_t *buf, int fd)
@@ -157,6 +201,7 @@ static void setmem_mplane(V4L2Buffer_t *buf, void *mem, size_t size)
 	buf->v4l2.m.planes[0].m.userptr = (uintptr_t)mem;
 	buf->v4l2.m.planes[0].length = size;
 	buf->length = size;
+	buf->map = mem;
 }
 
 static void *mmap_mplane(V4L2Buffer_t *buf, int fd)
@@ -312,7 +357,309 @@ static int _v4l2_devicecapabilities(int fd, const char *interface, int *mode)
 	return 0;
 }
 
-static uint32_t _v4l2_setpixformat(int fd, enum v4l2_buf_type type, CameraConfig_t *config)
+#define V4L2CACHE_MAGIC FOURCC('S','V','4','C')
+#define V4L2CACHE_VERSION 1
+
+/**
+ * snapshot of the enumerations of a device queue.
+ * The file contains the header followed by the tables.
+ */
+struct V4L2Cache_s
+{
+	struct
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint8_t driver[16];
+		uint8_t card[32];
+		uint8_t bus_info[32];
+		uint32_t kversion;
+		uint32_t device_caps;
+		uint32_t type;
+		char subdevice[32];
+		uint32_t nformats;
+		uint32_t nframesizes;
+		uint32_t ncontrols;
+		uint32_t nsubcontrols;
+	} header;
+	struct v4l2_fmtdesc *formats;
+	struct v4l2_frmsizeenum *framesizes;
+	struct v4l2_queryctrl *controls;
+	struct v4l2_queryctrl *subcontrols;
+	char *path;
+	int loaded;
+	int dirty;
+};
+
+static void _v4l2_cache_free(V4L2Cache_t *cache)
+{
+	free(cache->formats);
+	free(cache->framesizes);
+	free(cache->controls);
+	free(cache->subcontrols);
+	cache->formats = NULL;
+	cache->framesizes = NULL;
+	cache->controls = NULL;
+	cache->subcontrols = NULL;
+	cache->header.nformats = 0;
+	cache->header.nframesizes = 0;
+	cache->header.ncontrols = 0;
+	cache->header.nsubcontrols = 0;
+}
+
+static void *_v4l2_cache_append(void *table, uint32_t *nitems, const void *item, size_t size)
+{
+	table = realloc(table, (*nitems + 1) * size);
+	memcpy((char *)table + *nitems * size, item, size);
+	(*nitems)++;
+	return table;
+}
+
+static int _v4l2_cache_queryctrls(int fd, struct v4l2_queryctrl **controls, uint32_t *ncontrols)
+{
+	struct v4l2_queryctrl qctrl = {0};
+	qctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (ioctl(fd, VIDIOC_QUERYCTRL, &qctrl) == 0)
+	{
+		*controls = _v4l2_cache_append(*controls, ncontrols, &qctrl, sizeof(qctrl));
+		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	return *ncontrols;
+}
+
+static int _v4l2_cache_probe(V4L2Cache_t *cache, int fd)
+{
+	_v4l2_cache_free(cache);
+	struct v4l2_fmtdesc fmtdesc = {0};
+	fmtdesc.type = cache->header.type;
+	for (fmtdesc.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index++)
+	{
+		cache->formats = _v4l2_cache_append(cache->formats, &cache->header.nformats, &fmtdesc, sizeof(fmtdesc));
+		struct v4l2_frmsizeenum frmsize = {0};
+		frmsize.pixel_format = fmtdesc.pixelformat;
+		for (frmsize.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0; frmsize.index++)
+		{
+			cache->framesizes = _v4l2_cache_append(cache->framesizes, &cache->header.nframesizes, &frmsize, sizeof(frmsize));
+			/// stepwise and continuous sizes have only one entry
+			if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+				break;
+		}
+	}
+	_v4l2_cache_queryctrls(fd, &cache->controls, &cache->header.ncontrols);
+	cache->loaded = 0;
+	cache->dirty = 1;
+	dbg("sv4l2: cache probe %u formats, %u sizes, %u controls", cache->header.nformats,
+		cache->header.nframesizes, cache->header.ncontrols);
+	return 0;
+}
+
+static int _v4l2_cache_read(V4L2Cache_t *cache)
+{
+	int fd = open(cache->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	typeof(cache->header) header;
+	int ret = -1;
+	if (read(fd, &header, sizeof(header)) != sizeof(header))
+		goto cache_read_end;
+	/// the key of the cache is the identity of the device and its driver
+	if (header.magic != V4L2CACHE_MAGIC || header.version != V4L2CACHE_VERSION ||
+		memcmp(header.driver, cache->header.driver, sizeof(header.driver)) ||
+		memcmp(header.card, cache->header.card, sizeof(header.card)) ||
+		memcmp(header.bus_info, cache->header.bus_info, sizeof(header.bus_info)) ||
+		header.kversion != cache->header.kversion ||
+		header.device_caps != cache->header.device_caps ||
+		header.type != cache->header.type ||
+		strncmp(header.subdevice, cache->header.subdevice, sizeof(header.subdevice)))
+	{
+		dbg("sv4l2: cache %s obsolete", cache->path);
+		goto cache_read_end;
+	}
+	size_t sizes[] = {
+		header.nformats * sizeof(*cache->formats),
+		header.nframesizes * sizeof(*cache->framesizes),
+		header.ncontrols * sizeof(*cache->controls),
+		header.nsubcontrols * sizeof(*cache->subcontrols),
+	};
+	void *tables[4] = {0};
+	for (int i = 0; i < 4; i++)
+	{
+		if (sizes[i] == 0)
+			continue;
+		tables[i] = malloc(sizes[i]);
+		if (read(fd, tables[i], sizes[i]) != sizes[i])
+		{
+			for (int j = 0; j <= i; j++)
+				free(tables[j]);
+			goto cache_read_end;
+		}
+	}
+	_v4l2_cache_free(cache);
+	memcpy(&cache->header, &header, sizeof(header));
+	cache->formats = tables[0];
+	cache->framesizes = tables[1];
+	cache->controls = tables[2];
+	cache->subcontrols = tables[3];
+	cache->loaded = 1;
+	cache->dirty = 0;
+	ret = 0;
+cache_read_end:
+	close(fd);
+	return ret;
+}
+
+static int _v4l2_cache_save(V4L2Cache_t *cache)
+{
+	if (!cache->dirty)
+		return 0;
+	int fd = open(cache->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		warn("sv4l2: cache %s not writable %m", cache->path);
+		return -1;
+	}
+	cache->header.magic = V4L2CACHE_MAGIC;
+	cache->header.version = V4L2CACHE_VERSION;
+	int ret = 0;
+	if (write(fd, &cache->header, sizeof(cache->header)) != sizeof(cache->header) ||
+		write(fd, cache->formats, cache->header.nformats * sizeof(*cache->formats)) < 0 ||
+		write(fd, cache->framesizes, cache->header.nframesizes * sizeof(*cache->framesizes)) < 0 ||
+		write(fd, cache->controls, cache->header.ncontrols * sizeof(*cache->controls)) < 0 ||
+		write(fd, cache->subcontrols, cache->header.nsubcontrols * sizeof(*cache->subcontrols)) < 0)
+	{
+		err("sv4l2: cache %s writing error %m", cache->path);
+		unlink(cache->path);
+		ret = -1;
+	}
+	close(fd);
+	cache->dirty = 0;
+	return ret;
+}
+
+/**
+ * the cache is obsolete for the device, it will be probed again on the next start
+ */
+static void _v4l2_cache_invalidate(V4L2Cache_t *cache)
+{
+	if (cache == NULL || !cache->loaded)
+		return;
+	warn("sv4l2: cache %s invalidated", cache->path);
+	unlink(cache->path);
+	cache->loaded = 0;
+}
+
+static V4L2Cache_t *_v4l2_cache_create(int fd, enum v4l2_buf_type type, CameraConfig_t *config)
+{
+	if (config->cachepath == NULL)
+		return NULL;
+	struct v4l2_capability cap = {0};
+	if (ioctl(fd, VIDIOC_QUERYCAP, &cap) != 0)
+		return NULL;
+	if (access(config->cachepath, W_OK) && mkdir(config->cachepath, 0755))
+	{
+		warn("sv4l2: cache directory %s unavailable %m", config->cachepath);
+		return NULL;
+	}
+
+	V4L2Cache_t *cache = calloc(1, sizeof(*cache));
+	memcpy(cache->header.driver, cap.driver, sizeof(cache->header.driver));
+	memcpy(cache->header.card, cap.card, sizeof(cache->header.card));
+	memcpy(cache->header.bus_info, cap.bus_info, sizeof(cache->header.bus_info));
+	cache->header.kversion = cap.version;
+	cache->header.device_caps = cap.device_caps;
+	cache->header.type = type;
+	if (config->subdevice)
+		strncpy(cache->header.subdevice, config->subdevice, sizeof(cache->header.subdevice) - 1);
+
+	char name[sizeof(cap.driver) + sizeof(cap.bus_info) + 16];
+	int length = snprintf(name, sizeof(name), "%s-%s-%u.cache", cap.driver, cap.bus_info, type);
+	for (int i = 0; i < length; i++)
+	{
+		if (name[i] == '/' || name[i] == ':' || name[i] == ' ')
+			name[i] = '_';
+	}
+	cache->path = malloc(strlen(config->cachepath) + length + 2);
+	sprintf(cache->path, "%s/%s", config->cachepath, name);
+
+	if (_v4l2_cache_read(cache) == 0)
+		dbg("sv4l2: cache %s loaded", cache->path);
+	else
+		_v4l2_cache_probe(cache, fd);
+	return cache;
+}
+
+static void _v4l2_cache_destroy(V4L2Cache_t *cache)
+{
+	if (cache == NULL)
+		return;
+	_v4l2_cache_free(cache);
+	free(cache->path);
+	free(cache);
+}
+
+static int _v4l2_enumformat(int fd, V4L2Cache_t *cache, struct v4l2_fmtdesc *fmtdesc)
+{
+	if (cache == NULL)
+		return ioctl(fd, VIDIOC_ENUM_FMT, fmtdesc);
+	if (fmtdesc->index >= cache->header.nformats)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(fmtdesc, &cache->formats[fmtdesc->index], sizeof(*fmtdesc));
+	return 0;
+}
+
+static int _v4l2_enumframesize(int fd, V4L2Cache_t *cache, struct v4l2_frmsizeenum *frmsize)
+{
+	if (cache == NULL)
+		return ioctl(fd, VIDIOC_ENUM_FRAMESIZES, frmsize);
+	uint32_t index = 0;
+	for (int i = 0; i < cache->header.nframesizes; i++)
+	{
+		if (cache->framesizes[i].pixel_format != frmsize->pixel_format)
+			continue;
+		if (index == frmsize->index)
+		{
+			memcpy(frmsize, &cache->framesizes[i], sizeof(*frmsize));
+			return 0;
+		}
+		index++;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static struct v4l2_queryctrl *_v4l2_cache_controls(V4L2Cache_t *cache, int sub, uint32_t *ncontrols)
+{
+	if (sub)
+	{
+		*ncontrols = cache->header.nsubcontrols;
+		return cache->subcontrols;
+	}
+	*ncontrols = cache->header.ncontrols;
+	return cache->controls;
+}
+
+static int _v4l2_queryctrl(int fd, V4L2Cache_t *cache, int sub, struct v4l2_queryctrl *qctrl)
+{
+	if (cache == NULL)
+		return ioctl(fd, VIDIOC_QUERYCTRL, qctrl);
+	uint32_t ncontrols = 0;
+	struct v4l2_queryctrl *controls = _v4l2_cache_controls(cache, sub, &ncontrols);
+	for (int i = 0; i < ncontrols; i++)
+	{
+		if (controls[i].id == qctrl->id)
+		{
+			memcpy(qctrl, &controls[i], sizeof(*qctrl));
+			return 0;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static uint32_t _v4l2_setpixformat(int fd, V4L2Cache_t *cache, enum v4l2_buf_type type, CameraConfig_t *config)
 {
 	uint32_t pixelformat = 0;
 
@@ -331,7 +678,7 @@ static uint32_t _v4l2_setpixformat(int fd, enum v4l2_buf_type type, CameraConfig
 	struct v4l2_fmtdesc fmtdesc = {0};
 	fmtdesc.type = type;
 	dbg("Formats:");
-	while (ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+	while (_v4l2_enumformat(fd, cache, &fmtdesc) == 0)
 	{
 		dbg("\t%.4s => %s", (char*)&fmtdesc.pixelformat,
 				fmtdesc.description);
@@ -342,11 +689,16 @@ static uint32_t _v4l2_setpixformat(int fd, enum v4l2_buf_type type, CameraConfig
 				continue;
 			pixelformat = fmtdesc.pixelformat;
 		}
+		/// the sink doesn't decode or store the compressed frames
+		else if ((fmtdesc.flags & V4L2_FMT_FLAG_COMPRESSED) && !config->compressed)
+			continue;
 		int i = 0;
 		while (formats[i].fourcc != 0 && formats[i].fourcc != fmtdesc.pixelformat) i++;
 		if (formats[i].fourcc != 0)
 		{
+			/// the driver lists its formats in preference order
 			pixelformat = formats[i].fourcc;
+			break;
 		}
 	}
 	if (type == V4L2_BUF_TYPE_META_CAPTURE || type == V4L2_BUF_TYPE_META_OUTPUT)
@@ -357,18 +709,21 @@ static uint32_t _v4l2_setpixformat(int fd, enum v4l2_buf_type type, CameraConfig
 	{
 		return -1;
 	}
-	dbg("V4l2 settings: %.4s", (char*)&fmt.fmt.pix.pixelformat);
-	config->parent.fourcc = fmt.fmt.pix.pixelformat;
+	if (type == V4L2_BUF_TYPE_META_CAPTURE || type == V4L2_BUF_TYPE_META_OUTPUT)
+		config->parent.fourcc = fmt.fmt.meta.dataformat;
+	else
+		config->parent.fourcc = fmt.fmt.pix.pixelformat;
+	dbg("V4l2 settings: %.4s", (char*)&config->parent.fourcc);
 	return pixelformat;
 }
 
-static uint32_t _v4l2_setframesize(int fd, enum v4l2_buf_type type, CameraConfig_t *config)
+static uint32_t _v4l2_setframesize(int fd, V4L2Cache_t *cache, enum v4l2_buf_type type, CameraConfig_t *config)
 {
 	uint32_t framesize = 0;
 	struct v4l2_frmsizeenum video_cap = {0};
 	video_cap.pixel_format = config->parent.fourcc;
 	video_cap.index = 0;
-	if (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &video_cap) != 0)
+	if (_v4l2_enumframesize(fd, cache, &video_cap) != 0)
 	{
 		err("framsesize enumeration error %m");
 		return -1;
@@ -398,18 +753,31 @@ static uint32_t _v4l2_setframesize(int fd, enum v4l2_buf_type type, CameraConfig
 	}
 	else if (video_cap.type == V4L2_FRMSIZE_TYPE_DISCRETE)
 	{
-		uint32_t nbpixels = config->parent.height * config->parent.width;
 		if (config->parent.height == 0 && config->parent.width > 0)
 			config->parent.height = (config->parent.width * 9) / 16;
-		for (video_cap.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &video_cap) != -1; video_cap.index++)
+		uint64_t best = UINT64_MAX;
+		uint64_t largest = 0;
+		/// without request, the driver keeps its default size
+		if (config->parent.width == 0 && config->parent.height == 0)
+			best = 0;
+		for (video_cap.index = 0; best > 0 && _v4l2_enumframesize(fd, cache, &video_cap) != -1; video_cap.index++)
 		{
 			dbg("\twidth %d, height %d", video_cap.discrete.width, video_cap.discrete.height);
-			if (config->parent.height > 0 && config->parent.height <= video_cap.discrete.height)
+			uint64_t nbpixels = (uint64_t)video_cap.discrete.height * video_cap.discrete.width;
+			/// the smallest size containing the request, otherwise the largest one
+			if (video_cap.discrete.height >= config->parent.height &&
+				video_cap.discrete.width >= config->parent.width &&
+				nbpixels < best)
 			{
+				best = nbpixels;
+				fmt.fmt.pix.height = video_cap.discrete.height;
+				fmt.fmt.pix.width = video_cap.discrete.width;
+			}
+			else if (best == UINT64_MAX && nbpixels > largest)
+			{
+				largest = nbpixels;
 				fmt.fmt.pix.height = video_cap.discrete.height;
 				fmt.fmt.pix.width = video_cap.discrete.width;
-				if (nbpixels == video_cap.discrete.height * video_cap.discrete.width)
-					break;
 			}
 		}
 	}
@@ -423,7 +791,77 @@ static uint32_t _v4l2_setframesize(int fd, enum v4l2_buf_type type, CameraConfig
 	return framesize;
 }
 
-static int _v4l2_setfps(int fd, enum v4l2_buf_type type, int fps)
+static uint64_t _v4l2_fractperiod(uint32_t numerator, uint32_t denominator)
+{
+	if (denominator == 0)
+		return 0;
+	return (uint64_t)numerator * 1000000000ULL / denominator;
+}
+
+/**
+ * the period requested by the configuration in ns, 0 without request
+ */
+static uint64_t _v4l2_requestperiod(CameraConfig_t *config)
+{
+	if (config->interval.numerator && config->interval.denominator)
+		return _v4l2_fractperiod(config->interval.numerator, config->interval.denominator);
+	if (config->fps > 0)
+		return 1000000000ULL / config->fps;
+	if (config->fps < 0)
+		return (uint64_t)-config->fps * 1000000000ULL;
+	return 0;
+}
+
+static uint64_t _v4l2_distance(uint64_t a, uint64_t b)
+{
+	return (a > b)? a - b: b - a;
+}
+
+/**
+ * select the supported interval nearest to the requested period
+ */
+static int _v4l2_nearestinterval(int fd, uint32_t fourcc, uint32_t width, uint32_t height,
+		uint64_t period, struct v4l2_fract *interval)
+{
+	struct v4l2_frmivalenum frmival = {0};
+	frmival.pixel_format = fourcc;
+	frmival.width = width;
+	frmival.height = height;
+	if (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) != 0)
+		return -1;
+	if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+	{
+		uint64_t best = UINT64_MAX;
+		do
+		{
+			uint64_t current = _v4l2_fractperiod(frmival.discrete.numerator, frmival.discrete.denominator);
+			dbg("\t%u/%u", frmival.discrete.numerator, frmival.discrete.denominator);
+			if (_v4l2_distance(current, period) < best)
+			{
+				best = _v4l2_distance(current, period);
+				*interval = frmival.discrete;
+			}
+			frmival.index++;
+		} while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0);
+		return 0;
+	}
+	/// stepwise and continuous ranges are expressed in us
+	uint64_t min = _v4l2_fractperiod(frmival.stepwise.min.numerator, frmival.stepwise.min.denominator) / 1000;
+	uint64_t max = _v4l2_fractperiod(frmival.stepwise.max.numerator, frmival.stepwise.max.denominator) / 1000;
+	uint64_t step = _v4l2_fractperiod(frmival.stepwise.step.numerator, frmival.stepwise.step.denominator) / 1000;
+	uint64_t value = period / 1000;
+	if (value < min)
+		value = min;
+	if (value > max)
+		value = max;
+	if (frmival.type == V4L2_FRMIVAL_TYPE_STEPWISE && step > 0)
+		value = min + ((value - min + step / 2) / step) * step;
+	interval->numerator = value;
+	interval->denominator = 1000000;
+	return 0;
+}
+
+static int _v4l2_setinterval(int fd, enum v4l2_buf_type type, CameraConfig_t *config)
 {
 	struct v4l2_streamparm streamparm = {0};
 	streamparm.type = type;
@@ -432,38 +870,72 @@ static int _v4l2_setfps(int fd, enum v4l2_buf_type type, int fps)
 		err("FPS info not available %m");
 		return -1;
 	}
-
-	if (fps == -1)
+	struct v4l2_fract *timeperframe = &streamparm.parm.capture.timeperframe;
+	uint32_t capability = streamparm.parm.capture.capability;
+	if (V4L2_TYPE_IS_OUTPUT(type))
 	{
-		fps = streamparm.parm.capture.timeperframe.denominator /
-				streamparm.parm.capture.timeperframe.numerator;
-		dbg("Frame per second:");
-		dbg("\t%d / %d %u", streamparm.parm.capture.timeperframe.denominator,
-					streamparm.parm.capture.timeperframe.numerator, fps);
+		timeperframe = &streamparm.parm.output.timeperframe;
+		capability = streamparm.parm.output.capability;
 	}
-	else if (fps >= 0 & fps != streamparm.parm.capture.timeperframe.denominator)
+
+	uint64_t period = _v4l2_requestperiod(config);
+	if (period > 0 && (capability & V4L2_CAP_TIMEPERFRAME))
 	{
-		streamparm.parm.capture.timeperframe.denominator = fps;
-		streamparm.parm.capture.timeperframe.numerator = 1;
-		if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1)
+		struct v4l2_fract interval = {0};
+		struct v4l2_format fmt = {0};
+		fmt.type = type;
+		dbg("Frame intervals:");
+		if (ioctl(fd, VIDIOC_G_FMT, &fmt) != 0 ||
+			_v4l2_nearestinterval(fd, fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height,
+				period, &interval) != 0)
 		{
-			err("FPS setting error %m");
-			return -1;
+			/// without enumeration, the driver adjusts the request
+			if (config->interval.numerator && config->interval.denominator)
+				interval = config->interval;
+			else if (config->fps > 0)
+				interval = (struct v4l2_fract){.numerator = 1, .denominator = config->fps};
+			else
+				interval = (struct v4l2_fract){.numerator = -config->fps, .denominator = 1};
 		}
-	}
-	else if (fps < 0 & -fps != streamparm.parm.capture.timeperframe.numerator)
-	{
-		streamparm.parm.capture.timeperframe.denominator = 1;
-		streamparm.parm.capture.timeperframe.numerator = fps;
-		if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1)
+		if (interval.numerator != timeperframe->numerator ||
+			interval.denominator != timeperframe->denominator)
 		{
-			err("FPS setting error %m");
-			return -1;
+			*timeperframe = interval;
+			if (ioctl(fd, VIDIOC_S_PARM, &streamparm) == -1)
+			{
+				err("FPS setting error %m");
+				return -1;
+			}
 		}
 	}
+	if (timeperframe->numerator == 0 || timeperframe->denominator == 0)
+		return 0;
+	/// the request is kept for the next format, after a source change
+	config->timeperframe = *timeperframe;
+	int fps;
+	if (timeperframe->denominator >= timeperframe->numerator)
+		fps = (timeperframe->denominator + timeperframe->numerator / 2) / timeperframe->numerator;
+	else
+		fps = -(int)((timeperframe->numerator + timeperframe->denominator / 2) / timeperframe->denominator);
+	dbg("Frame per second:");
+	dbg("\t%u / %u => %d", timeperframe->denominator, timeperframe->numerator, fps);
 	return fps;
 }
 
+static uint64_t _v4l2_getperiod(int fd, enum v4l2_buf_type type)
+{
+	struct v4l2_streamparm streamparm = {0};
+	streamparm.type = type;
+	if (ioctl(fd, VIDIOC_G_PARM, &streamparm) == -1)
+		return 0;
+	struct v4l2_fract *timeperframe = &streamparm.parm.capture.timeperframe;
+	if (V4L2_TYPE_IS_OUTPUT(type))
+		timeperframe = &streamparm.parm.output.timeperframe;
+	if (timeperframe->denominator == 0)
+		return 0;
+	return (uint64_t)timeperframe->numerator * 1000000000ULL / timeperframe->denominator;
+}
+
 static int _v4l2_getbufferfd(V4L2_t *dev, int i)
 {
 	if (dev->nbuffers <= i)
@@ -480,6 +952,8 @@ int sv4l2_requestbuffer_mmap(V4L2_t *dev)
 {
 	int ret = 0;
 	int count = MAX_BUFFERS;
+	if (dev->config->nbuffers > 0)
+		count = dev->config->nbuffers;
 	if (dev->buffers && dev->buffers[0].v4l2.memory == V4L2_MEMORY_MMAP)
 		return 0;
 	if (dev->buffers)
@@ -535,6 +1009,8 @@ int sv4l2_requestbuffer_mmap(V4L2_t *dev)
 int sv4l2_requestbuffer_dmabuf(V4L2_t *dev)
 {
 	int count = MAX_BUFFERS;
+	if (dev->config->nbuffers > 0)
+		count = dev->config->nbuffers;
 	if (dev->buffers && dev->buffers[0].v4l2.memory == V4L2_MEMORY_DMABUF)
 		return 0;
 	V4L2Buffer_t *oldbuffers = NULL;
@@ -596,6 +1072,8 @@ int sv4l2_requestbuffer_dmabuf(V4L2_t *dev)
 int sv4l2_requestbuffer_userptr(V4L2_t *dev, int nmems, void *mems[], size_t size)
 {
 	int count = MAX_BUFFERS;
+	if (dev->config->nbuffers > 0)
+		count = dev->config->nbuffers;
 	if (dev->buffers && dev->buffers[0].v4l2.memory == V4L2_MEMORY_USERPTR)
 		return 0;
 	if (dev->buffers)
@@ -610,7 +1088,9 @@ int sv4l2_requestbuffer_userptr(V4L2_t *dev, int nmems, void *mems[], size_t siz
 			err("sv4l2: Relsease buffer for mmap error %m");
 			return -1;
 		}
-		free(dev->buffers);
+		_sv4l2_freebuffers(dev);
+		dev->buffers = NULL;
+		dev->nbuffers = 0;
 	}
 	if (count > nmems)
 		count = nmems;
@@ -641,6 +1121,114 @@ int sv4l2_requestbuffer_userptr(V4L2_t *dev, int nmems, void *mems[], size_t siz
 	return 0;
 }
 
+static void _sv4l2_arena_free(V4L2Arena_t *arena)
+{
+	if (arena->mem)
+		munmap(arena->mem, arena->length);
+	arena->mem = NULL;
+	arena->length = 0;
+}
+
+/**
+ * the arena uses the huge pages of hugetlbfs when some are reserved,
+ * otherwise a region aligned on a huge page for the transparent huge pages.
+ */
+static int _sv4l2_arena_alloc(V4L2Arena_t *arena, int count, size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	arena->stride = (size + pagesize - 1) & ~(pagesize - 1);
+	size_t length = arena->stride * count;
+	size_t hugelength = (length + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+	void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	mem = mmap(NULL, hugelength, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+	if (mem != MAP_FAILED)
+	{
+		arena->mem = mem;
+		arena->length = hugelength;
+		arena->hugetlb = 1;
+		dbg("sv4l2: arena of %zu bytes on hugetlb pages", hugelength);
+		return 0;
+	}
+	mem = mmap(NULL, hugelength + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		err("sv4l2: arena allocation error %m");
+		return -1;
+	}
+	/// the unaligned head and the tail are given back
+	uintptr_t start = ((uintptr_t)mem + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1);
+	if (start > (uintptr_t)mem)
+		munmap(mem, start - (uintptr_t)mem);
+	size_t tail = (uintptr_t)mem + hugelength + HUGEPAGE_SIZE - (start + hugelength);
+	if (tail > 0)
+		munmap((void *)(start + hugelength), tail);
+	arena->mem = (void *)start;
+	arena->length = hugelength;
+	arena->hugetlb = 0;
+#ifdef MADV_HUGEPAGE
+	if (madvise(arena->mem, arena->length, MADV_HUGEPAGE))
+		dbg("sv4l2: transparent huge pages not available %m");
+#endif
+	dbg("sv4l2: arena of %zu bytes", hugelength);
+	return 0;
+}
+
+static size_t _v4l2_sizeimage(V4L2_t *dev)
+{
+	struct v4l2_format fmt = {0};
+	fmt.type = dev->type;
+	if (ioctl(dev->fd, VIDIOC_G_FMT, &fmt) != 0)
+		return 0;
+	if (dev->mode & MODE_MPLANE)
+		return fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+	return fmt.fmt.pix.sizeimage;
+}
+
+int sv4l2_requestbuffer_arena(V4L2_t *dev)
+{
+	if (dev->buffers && dev->buffers[0].v4l2.memory == V4L2_MEMORY_USERPTR)
+		return 0;
+	size_t size = _v4l2_sizeimage(dev);
+	/// the buffers of the arena are contiguous, one plane only
+	if (size == 0 || dev->nplanes > 1)
+		return sv4l2_requestbuffer_mmap(dev);
+	int count = MAX_BUFFERS;
+	if (dev->config->nbuffers > 0)
+		count = dev->config->nbuffers;
+	if (dev->buffers)
+		count = dev->nbuffers;
+	V4L2Arena_t arena = {0};
+	if (_sv4l2_arena_alloc(&arena, count, size))
+		return sv4l2_requestbuffer_mmap(dev);
+	void **mems = calloc(count, sizeof(*mems));
+	for (int i = 0; i < count; i++)
+		mems[i] = (char *)arena.mem + i * arena.stride;
+	if (sv4l2_requestbuffer_userptr(dev, count, mems, size))
+	{
+		free(mems);
+		_sv4l2_arena_free(&arena);
+		warn("sv4l2: %s uses mmap buffers", dev->config->parent.name);
+		return sv4l2_requestbuffer_mmap(dev);
+	}
+	free(mems);
+	/// the driver may require more buffers than requested
+	if (dev->nbuffers > count)
+	{
+		_sv4l2_arena_free(&arena);
+		if (_sv4l2_arena_alloc(&arena, dev->nbuffers, size))
+			return -1;
+		for (int i = 0; i < dev->nbuffers; i++)
+			dev->buffers[i].ops.setmem(&dev->buffers[i], (char *)arena.mem + i * arena.stride, size);
+	}
+	_sv4l2_arena_free(&dev->arena);
+	dev->arena = arena;
+	return 0;
+}
+
 int sv4l2_linkv4l2(V4L2_t *dev, V4L2_t *target)
 {
 	for (int i = 0; i < dev->nbuffers; i++)
@@ -701,7 +1289,24 @@ int sv4l2_requestbuffer(V4L2_t *dev, enum buf_type_e t, ...)
 		}
 		break;
 		case (buf_type_memory | buf_type_master):
-			ret = sv4l2_requestbuffer_mmap(dev);
+		{
+			ret = sv4l2_requestbuffer_arena(dev);
+			if (ret)
+				break;
+			int *nmems = va_arg(ap, int *);
+			void ***mems = va_arg(ap, void ***);
+			size_t *size = va_arg(ap, size_t *);
+			if (nmems != NULL)
+				*nmems = dev->nbuffers;
+			if (mems != NULL)
+			{
+				*mems = calloc(dev->nbuffers, sizeof(void *));
+				for (int i = 0; i < dev->nbuffers; i++)
+					(*mems)[i] = dev->buffers[i].map;
+			}
+			if (size != NULL)
+				*size = dev->buffers[0].ops.getsize(&dev->buffers[0]);
+		}
 		break;
 		case buf_type_dmabuf | buf_type_master:
 			ret = sv4l2_requestbuffer_dmabuf(dev);
@@ -747,23 +1352,119 @@ int sv4l2_requestbuffer(V4L2_t *dev, enum buf_type_e t, ...)
 	return ret;
 }
 
-int sv4l2_crop(V4L2_t *dev, struct v4l2_rect *r)
-{
+/**
+ * the crop of a sensor behind a media controller is on the source pad of
+ * its subdevice, otherwise it is on the video node.
+ */
+static int _v4l2_selection(V4L2_t *dev, unsigned long request, uint32_t target, uint32_t flags, struct v4l2_rect *r)
+{
+	if (dev->ctrlfd != dev->fd)
+	{
+		struct v4l2_subdev_selection sel = {0};
+		sel.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+		sel.target = target;
+		sel.flags = flags;
+		sel.r = *r;
+		unsigned long subrequest = VIDIOC_SUBDEV_G_SELECTION;
+		if (request == VIDIOC_S_SELECTION)
+			subrequest = VIDIOC_SUBDEV_S_SELECTION;
+		if (ioctl(dev->ctrlfd, subrequest, &sel) == 0)
+		{
+			*r = sel.r;
+			return 0;
+		}
+	}
 	struct v4l2_selection sel = {0};
 	sel.type = dev->type;
-	sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
-	if (r != NULL)
+	sel.target = target;
+	sel.flags = flags;
+	sel.r = *r;
+	if (ioctl(dev->fd, request, &sel))
+		return -1;
+	*r = sel.r;
+	return 0;
+}
+
+int sv4l2_crop(V4L2_t *dev, struct v4l2_rect *r)
+{
+	struct v4l2_rect rect = {0};
+	/// the default rectangle is only readable, it has to be set as crop
+	if (r == NULL && _v4l2_selection(dev, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP_DEFAULT, 0, &rect))
 	{
-		sel.target = V4L2_SEL_TGT_CROP;
-		memcpy(&sel.r, r, sizeof(sel.r));
+		err("sv4l2: default crop not available %m");
+		return -1;
 	}
-	sel.flags = V4L2_SEL_FLAG_GE | V4L2_SEL_FLAG_LE;
-	if (ioctl(dev->fd, VIDIOC_S_SELECTION, &sel))
+	if (r != NULL)
+		rect = *r;
+	if (_v4l2_selection(dev, VIDIOC_S_SELECTION, V4L2_SEL_TGT_CROP, V4L2_SEL_FLAG_GE | V4L2_SEL_FLAG_LE, &rect))
 	{
 		err("cropping error %m");
 		return -1;
 	}
-	dbg("sv4l2: croping requested (%d %d %d %d)", sel.r.left, sel.r.top, sel.r.width, sel.r.height);
+	dbg("sv4l2: croping requested (%d %d %d %d)", rect.left, rect.top, rect.width, rect.height);
+	return 0;
+}
+
+static int _v4l2_samesize(V4L2_t *dev)
+{
+	struct v4l2_format fmt = {0};
+	fmt.type = dev->type;
+	if (ioctl(dev->fd, VIDIOC_G_FMT, &fmt) != 0)
+		return 0;
+	if (dev->mode & MODE_MPLANE)
+		return fmt.fmt.pix_mp.width == dev->config->parent.width &&
+			fmt.fmt.pix_mp.height == dev->config->parent.height;
+	return fmt.fmt.pix.width == dev->config->parent.width &&
+		fmt.fmt.pix.height == dev->config->parent.height;
+}
+
+int sv4l2_roi(V4L2_t *dev, struct v4l2_rect *r)
+{
+	struct v4l2_rect bounds = {0};
+	if (_v4l2_selection(dev, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP_BOUNDS, 0, &bounds))
+	{
+		err("sv4l2: crop not supported %m");
+		return -1;
+	}
+	struct v4l2_rect previous = {0};
+	if (_v4l2_selection(dev, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP, 0, &previous))
+		previous = bounds;
+
+	struct v4l2_rect rect = bounds;
+	if (r != NULL)
+	{
+		/// the rectangle stays inside the sensor and keeps the Bayer phase
+		rect.width = r->width & ~1;
+		if (rect.width == 0 || rect.width > bounds.width)
+			rect.width = bounds.width;
+		rect.height = r->height & ~1;
+		if (rect.height == 0 || rect.height > bounds.height)
+			rect.height = bounds.height;
+		rect.left = bounds.left + (r->left < 0 ? 0 : r->left & ~1);
+		if (rect.left + rect.width > bounds.left + bounds.width)
+			rect.left = bounds.left + ((bounds.width - rect.width) & ~1);
+		rect.top = bounds.top + (r->top < 0 ? 0 : r->top & ~1);
+		if (rect.top + rect.height > bounds.top + bounds.height)
+			rect.top = bounds.top + ((bounds.height - rect.height) & ~1);
+	}
+	if (!memcmp(&rect, &previous, sizeof(rect)))
+		return 0;
+	/// the sensor scaler must absorb the change, the buffers stay the same
+	if (_v4l2_selection(dev, VIDIOC_S_SELECTION, V4L2_SEL_TGT_CROP, V4L2_SEL_FLAG_KEEP_CONFIG, &rect))
+	{
+		err("sv4l2: roi (%d %d %d %d) refused %m", rect.left, rect.top, rect.width, rect.height);
+		return -1;
+	}
+	if (!_v4l2_samesize(dev))
+	{
+		warn("sv4l2: roi changes the format, restore (%d %d %d %d)",
+			previous.left, previous.top, previous.width, previous.height);
+		_v4l2_selection(dev, VIDIOC_S_SELECTION, V4L2_SEL_TGT_CROP, V4L2_SEL_FLAG_KEEP_CONFIG, &previous);
+		return -1;
+	}
+	dbg("sv4l2: roi (%d %d %d %d)", rect.left, rect.top, rect.width, rect.height);
+	if (r != NULL)
+		*r = rect;
 	return 0;
 }
 
@@ -860,13 +1561,26 @@ void * sv4l2_control(V4L2_t *dev, int id, void *value)
 	int ctrlfd = dev->ctrlfd;
 	struct v4l2_queryctrl queryctrl = {0};
 	queryctrl.id = id;
-	int ret = ioctl (ctrlfd, VIDIOC_QUERYCTRL, &queryctrl);
+	int ret = _v4l2_queryctrl(ctrlfd, dev->cache, ctrlfd != dev->fd, &queryctrl);
 	if (ret != 0)
 	{
 		if (dev->ctrlfd != dev->fd)
 		{
 			ctrlfd = dev->fd;
-			ret = ioctl (ctrlfd, VIDIOC_QUERYCTRL, &queryctrl);
+			ret = _v4l2_queryctrl(ctrlfd, dev->cache, 0, &queryctrl);
+		}
+		if (ret != 0 && dev->cache)
+		{
+			/// the cache may be older than the driver, the device is the reference
+			ctrlfd = dev->ctrlfd;
+			ret = ioctl(ctrlfd, VIDIOC_QUERYCTRL, &queryctrl);
+			if (ret != 0 && dev->ctrlfd != dev->fd)
+			{
+				ctrlfd = dev->fd;
+				ret = ioctl(ctrlfd, VIDIOC_QUERYCTRL, &queryctrl);
+			}
+			if (ret == 0)
+				_v4l2_cache_invalidate(dev->cache);
 		}
 		if (ret != 0)
 		{
@@ -885,6 +1599,22 @@ void * sv4l2_control(V4L2_t *dev, int id, void *value)
 static int _sv4l2_treecontrols(int ctrlfd, V4L2_t *dev, int (*cb)(void *arg, struct v4l2_queryctrl *ctrl, V4L2_t *dev), void * arg)
 {
 	int nbctrls = 0;
+	if (dev->cache)
+	{
+		uint32_t ncontrols = 0;
+		struct v4l2_queryctrl *controls = _v4l2_cache_controls(dev->cache, ctrlfd != dev->fd, &ncontrols);
+		for (int i = 0; i < ncontrols; i++)
+		{
+			if (controls[i].flags & V4L2_CTRL_FLAG_DISABLED)
+				continue;
+			/// the callback may modify the structure
+			struct v4l2_queryctrl qctrl = controls[i];
+			if (cb)
+				cb(arg, &qctrl, dev);
+			nbctrls++;
+		}
+		return nbctrls;
+	}
 	struct v4l2_queryctrl qctrl = {0};
 	qctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
 	int ret;
@@ -901,7 +1631,7 @@ static int _sv4l2_treecontrols(int ctrlfd, V4L2_t *dev, int (*cb)(void *arg, str
 			cb(arg, &qctrl, dev);
 		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
 	}
-	if (ret)
+	if (ret && errno != EINVAL)
 	{
 		err("sv4l2: %s query controls error %m", dev->config->parent.name);
 	}
@@ -932,63 +1662,35 @@ int sv4l2_treecontrolmenu(V4L2_t *dev, int id, int (*cb)(void *arg, struct v4l2_
 	}
 }
 
-V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config)
+static int _v4l2_getformat(int fd, enum v4l2_buf_type type, int mode, CameraConfig_t *config)
 {
-	enum v4l2_buf_type type = 0;
-	int mode = 0;
-	if (config && config->mode)
-		mode = config->mode;
-	const char *device = devicename;
-	if (config && config->device)
-		device = config->device;
-	int fd = config->fd;
-	if (fd == 0)
-		fd = _v4l2_open(device, &mode);
-	if (fd == -1)
-		return NULL;
-	if (_v4l2_devicecapabilities(fd, device, &mode))
-		return NULL;
-	int ctrlfd = fd;
-
-	type = _v4l2_getbuftype(type, mode);
-	if (config->mode & MODE_VERBOSE)
-		warn("SV4l2 create %s", devicename);
-
-	if (_v4l2_setpixformat(fd, type, config) == -1)
-	{
-		err("pixel format error %m");
-		close(fd);
-		return NULL;
-	}
-
-	if (!(mode & MODE_META) &&
-		_v4l2_setframesize(fd, type, config) == -1)
-	{
-		err("frame size error %m");
-		close(fd);
-		return NULL;
-	}
-
-	_v4l2_setfps(fd, type, config->fps);
-
 	struct v4l2_format fmt;
 	fmt.type = type;
 	fmt.fmt.pix.field = V4L2_FIELD_ANY;
 	if (ioctl(fd, VIDIOC_G_FMT, &fmt) != 0)
 	{
 		err("FMT not found %m");
-		close(fd);
-		return NULL;
+		return -1;
 	}
+	int nplanes = 1;
 	uint32_t bytesperline = 0;
 	uint32_t sizeimage = 0;
-	if (mode & MODE_MPLANE)
+	if (mode & MODE_META)
+	{
+		/// the metadata is a line of bytes
+		config->parent.fourcc = fmt.fmt.meta.dataformat;
+		config->parent.width = fmt.fmt.meta.buffersize;
+		config->parent.height = 1;
+		sizeimage = fmt.fmt.meta.buffersize;
+	}
+	else if (mode & MODE_MPLANE)
 	{
 		config->parent.width = fmt.fmt.pix_mp.width;
 		config->parent.height = fmt.fmt.pix_mp.height;
 		config->parent.fourcc = fmt.fmt.pix_mp.pixelformat;
 		bytesperline = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
 		sizeimage = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+		nplanes = fmt.fmt.pix_mp.num_planes;
 	}
 	else
 	{
@@ -1001,8 +1703,106 @@ V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config)
 
 	if (bytesperline)
 		config->parent.stride = bytesperline;
-	else
+	else if (config->parent.height)
 		config->parent.stride = sizeimage / config->parent.height;
+	return nplanes;
+}
+
+static int _v4l2_subscribectrl(void *arg, struct v4l2_queryctrl *ctrl, V4L2_t *dev)
+{
+	if (ctrl->type == V4L2_CTRL_TYPE_CTRL_CLASS || ctrl->type == V4L2_CTRL_TYPE_BUTTON)
+		return 0;
+	struct v4l2_event_subscription sub = {0};
+	sub.type = V4L2_EVENT_CTRL;
+	sub.id = ctrl->id;
+	if (ioctl(dev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) != 0)
+		return -1;
+	return 0;
+}
+
+static int _v4l2_subscribeevents(V4L2_t *dev)
+{
+	uint32_t events[] = {
+		V4L2_EVENT_SOURCE_CHANGE,
+		V4L2_EVENT_EOS,
+		V4L2_EVENT_FRAME_SYNC,
+		0,
+	};
+	int nbevents = 0;
+	for (int i = 0; events[i] != 0; i++)
+	{
+		struct v4l2_event_subscription sub = {0};
+		sub.type = events[i];
+		if (ioctl(dev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) != 0)
+		{
+			dbg("sv4l2: event %u not supported", events[i]);
+			continue;
+		}
+		nbevents++;
+	}
+	/// the controls of the subdevice send their events on the subdevice
+	_sv4l2_treecontrols(dev->fd, dev, _v4l2_subscribectrl, NULL);
+	dbg("sv4l2: %d events subscribed", nbevents);
+	return nbevents;
+}
+
+static int _v4l2_setformat(int fd, V4L2Cache_t *cache, enum v4l2_buf_type type, int mode, CameraConfig_t *config)
+{
+	if (_v4l2_setpixformat(fd, cache, type, config) == -1)
+	{
+		err("pixel format error %m");
+		return -1;
+	}
+	if (!(mode & MODE_META) &&
+		_v4l2_setframesize(fd, cache, type, config) == -1)
+	{
+		err("frame size error %m");
+		return -1;
+	}
+	return 0;
+}
+
+static V4L2_t *_sv4l2_create(const char *devicename, CameraConfig_t *config, int fd, int mode)
+{
+	enum v4l2_buf_type type = 0;
+	int ctrlfd = fd;
+
+	type = _v4l2_getbuftype(type, mode);
+	if (config->mode & MODE_VERBOSE)
+		warn("SV4l2 create %s", devicename);
+
+	V4L2Cache_t *cache = _v4l2_cache_create(fd, type, config);
+	uint32_t fourcc = config->parent.fourcc;
+	uint32_t width = config->parent.width;
+	uint32_t height = config->parent.height;
+	int ret = _v4l2_setformat(fd, cache, type, mode, config);
+	if (ret == -1 && cache && cache->loaded)
+	{
+		/// the driver refuses a format from the cache, probe it again
+		_v4l2_cache_invalidate(cache);
+		_v4l2_cache_probe(cache, fd);
+		config->parent.fourcc = fourcc;
+		config->parent.width = width;
+		config->parent.height = height;
+		ret = _v4l2_setformat(fd, cache, type, mode, config);
+	}
+	if (ret == -1)
+	{
+		_v4l2_cache_destroy(cache);
+		close(fd);
+		return NULL;
+	}
+
+	if (!(mode & MODE_META))
+		_v4l2_setinterval(fd, type, config);
+
+	int nplanes = _v4l2_getformat(fd, type, mode, config);
+	if (nplanes < 0)
+	{
+		_v4l2_cache_destroy(cache);
+		close(fd);
+		return NULL;
+	}
 
 	if (mode & MODE_MEDIACTL)
 	{
@@ -1010,6 +1810,8 @@ V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config)
 		if (fd > 0)
 			ctrlfd = fd;
 	}
+	if (cache && !cache->loaded && ctrlfd != fd)
+		_v4l2_cache_queryctrls(ctrlfd, &cache->subcontrols, &cache->header.nsubcontrols);
 
 	V4L2_t *dev = calloc(1, sizeof(*dev));
 	dev->name = devicename;
@@ -1019,28 +1821,187 @@ V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config)
 	dev->type = type;
 	dev->mode = mode;
 	dev->transfer = config->transfer;
+	dev->period = _v4l2_getperiod(fd, type);
+	dev->cache = cache;
 
 	dev->ops.createbuffers = createbuffers_splane;
 	dev->nplanes = 1;
 	if (mode & MODE_MPLANE)
 	{
 		dev->ops.createbuffers = createbuffers_mplane;
-		dev->nplanes = fmt.fmt.pix_mp.num_planes;
+		dev->nplanes = nplanes;
 	}
 	if (config->mode & MODE_INTERACTIVE && pipe(dev->ifd))
 	{
 		err("interactive is disabled %m");
 	}
+	/// the OUTPUT queue of a m2m device shares the events of its CAPTURE queue
+	if (!(mode & MODE_M2M))
+		_v4l2_subscribeevents(dev);
+	if (cache)
+		_v4l2_cache_save(cache);
 	dbg("V4l2 settings: %dx%d, %.4s", config->parent.width, config->parent.height, (char*)&config->parent.fourcc);
 	config->parent.dev = dev;
 	return dev;
 }
 
+static V4L2_t *_sv4l2_meta_create(const char *devicename, CameraConfig_t *config)
+{
+	int mode = 0;
+	int fd = _v4l2_open(config->metadevice, &mode);
+	if (fd == -1)
+		return NULL;
+	if (_v4l2_devicecapabilities(fd, config->metadevice, &mode))
+		return NULL;
+	if (!(mode & MODE_META))
+	{
+		err("sv4l2: %s is not a metadata node", config->metadevice);
+		close(fd);
+		return NULL;
+	}
+	/// the format of the embedded data is the choice of the driver
+	CameraConfig_t *metaconfig = calloc(1, sizeof(*metaconfig));
+	memcpy(metaconfig, config, sizeof(*metaconfig));
+	metaconfig->parent.fourcc = 0;
+	metaconfig->device = config->metadevice;
+	metaconfig->subdevice = NULL;
+	metaconfig->metadevice = NULL;
+	metaconfig->transfer = NULL;
+	metaconfig->metadata = NULL;
+	metaconfig->nworkers = 0;
+	metaconfig->fd = fd;
+	/// the subdevice is configured by the image node
+	V4L2_t *meta = _sv4l2_create(devicename, metaconfig, fd, (mode | MODE_CAPTURE) & ~(MODE_OUTPUT | MODE_MEDIACTL | MODE_MPLANE));
+	if (meta == NULL)
+	{
+		free(metaconfig);
+		return NULL;
+	}
+	dbg("sv4l2: metadata %s %.4s", config->metadevice, (char*)&metaconfig->parent.fourcc);
+	return meta;
+}
+
+/**
+ * the statistics follow the format of the frames, the context is created
+ * again after each change of format.
+ */
+static void _sv4l2_s3a_refresh(V4L2_t *dev)
+{
+	if (dev->s3a)
+		s3a_destroy(dev->s3a);
+	dev->s3a = NULL;
+	if (dev->config->s3a && (dev->mode & MODE_CAPTURE) && !(dev->mode & MODE_META))
+		dev->s3a = s3a_create(dev, dev->config->s3a);
+}
+
+V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config)
+{
+	int mode = 0;
+	if (config && config->mode)
+		mode = config->mode;
+	const char *device = devicename;
+	if (config && config->device)
+		device = config->device;
+	int fd = config->fd;
+	if (fd == 0)
+		fd = _v4l2_open(device, &mode);
+	if (fd == -1)
+		return NULL;
+	if (_v4l2_devicecapabilities(fd, device, &mode))
+		return NULL;
+	V4L2_t *dev = _sv4l2_create(devicename, config, fd, mode);
+	if (dev)
+		_sv4l2_s3a_refresh(dev);
+	if (dev && config->metadevice)
+	{
+		dev->meta = _sv4l2_meta_create(devicename, config);
+		dev->metapending = -1;
+	}
+	return dev;
+}
+
+V4L2_t *sv4l2_m2m_create(const char *devicename, CameraConfig_t *config)
+{
+	int mode = config->mode;
+	const char *device = devicename;
+	if (config->device)
+		device = config->device;
+	int fd = config->fd;
+	if (fd == 0)
+		fd = _v4l2_open(device, &mode);
+	if (fd == -1)
+		return NULL;
+	if (_v4l2_devicecapabilities(fd, device, &mode))
+		return NULL;
+	if ((mode & (MODE_CAPTURE | MODE_OUTPUT)) != (MODE_CAPTURE | MODE_OUTPUT))
+	{
+		err("sv4l2: %s is not a memory to memory device", device);
+		close(fd);
+		return NULL;
+	}
+
+	/// the OUTPUT queue receives the frames of the upstream device
+	CameraConfig_t *outconfig = calloc(1, sizeof(*outconfig));
+	memcpy(outconfig, config, sizeof(*outconfig));
+	if (config->input)
+	{
+		outconfig->parent.fourcc = config->input->fourcc;
+		outconfig->parent.width = config->input->width;
+		outconfig->parent.height = config->input->height;
+	}
+	outconfig->input = NULL;
+	outconfig->transfer = NULL;
+	outconfig->fd = fd;
+	/// _sv4l2_create closes the file descriptor on error
+	V4L2_t *output = _sv4l2_create(devicename, outconfig, fd, (mode & ~MODE_CAPTURE) | MODE_M2M);
+	if (output == NULL)
+	{
+		free(outconfig);
+		return NULL;
+	}
+
+	V4L2_t *dev = _sv4l2_create(devicename, config, fd, mode & ~MODE_OUTPUT);
+	if (dev == NULL)
+	{
+		_v4l2_cache_destroy(output->cache);
+		if (output->ctrlfd != fd)
+			close(output->ctrlfd);
+		if (output->ifd[0] > 0)
+		{
+			close(output->ifd[0]);
+			close(output->ifd[1]);
+		}
+		free(output);
+		free(outconfig);
+		return NULL;
+	}
+	dev->m2m = output;
+	dbg("sv4l2: m2m %.4s %dx%d => %.4s %dx%d",
+		(char*)&outconfig->parent.fourcc, outconfig->parent.width, outconfig->parent.height,
+		(char*)&config->parent.fourcc, config->parent.width, config->parent.height);
+	return dev;
+}
+
+V4L2_t *sv4l2_m2m_output(V4L2_t *dev)
+{
+	return dev->m2m;
+}
+
+V4L2_t *sv4l2_meta(V4L2_t *dev)
+{
+	return dev->meta;
+}
+
 int sv4l2_fd(V4L2_t *dev)
 {
 	return dev->fd;
 }
 
+DeviceConf_t *sv4l2_config(V4L2_t *dev)
+{
+	return &dev->config->parent;
+}
+
 int sv4l2_type(V4L2_t *dev)
 {
 	return dev->type;
@@ -1054,8 +2015,19 @@ int sv4l2_interactive(V4L2_t *dev, const char *json, size_t length)
 int sv4l2_start(V4L2_t *dev)
 {
 	enum v4l2_buf_type type = dev->type;
+	if (dev->meta)
+	{
+		/// the metadata node streams before the first image and restarts with it
+		if (sv4l2_requestbuffer_mmap(dev->meta))
+			return -1;
+		ioctl(dev->meta->fd, VIDIOC_STREAMOFF, &dev->meta->type);
+		if (sv4l2_start(dev->meta))
+			return -1;
+		dev->metapending = -1;
+	}
 	if (dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE ||
-		dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+		dev->type == V4L2_BUF_TYPE_META_CAPTURE)
 	{
 		dbg("sv4l2: start buffers enqueuing");
 		for (int i = 0; i < dev->nbuffers; i++)
@@ -1067,6 +2039,10 @@ int sv4l2_start(V4L2_t *dev)
 	}
 	if (ioctl(dev->fd, VIDIOC_STREAMON, &type) != 0)
 		return -1;
+	/// the driver restarts the sequence numbering with the stream
+	dev->sequence = 0;
+	dev->timestamp = 0;
+	dev->clock = -1;
 	dbg("sv4l2: starting");
 	return 0;
 }
@@ -1076,9 +2052,273 @@ int sv4l2_stop(V4L2_t *dev)
 	enum v4l2_buf_type type = dev->type;
 	if (ioctl(dev->fd, VIDIOC_STREAMOFF, &type) != 0)
 		return -1;
+	if (dev->meta)
+		sv4l2_stop(dev->meta);
+	if (dev->stats.drops || dev->stats.errors)
+		warn("sv4l2: %s %u frames, %u dropped, %u corrupted, jitter max %u us",
+			dev->config->parent.name, dev->stats.frames, dev->stats.drops,
+			dev->stats.errors, dev->stats.maxjitter);
 	return 0;
 }
 
+/**
+ * the timestamps of the capture buffers are converted to the clock of
+ * the pipeline, the released output buffers take the current time.
+ */
+static uint64_t _sv4l2_timestamp(V4L2_t *dev, struct v4l2_buffer *buf)
+{
+	if (V4L2_TYPE_IS_OUTPUT(buf->type))
+		return sclock_now();
+	if (buf->timestamp.tv_sec == 0 && buf->timestamp.tv_usec == 0)
+		return 0;
+	if (dev->clock == -1)
+	{
+		dev->clock = CLOCK_MONOTONIC;
+		/// the driver doesn't tell its clock, the first frame is recent
+		if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN)
+			dev->clock = sclock_guess(sclock_timeval(CLOCK_MONOTONIC, &buf->timestamp));
+		if (dev->clock != CLOCK_MONOTONIC)
+			dbg("sv4l2: %s timestamps from clock %d", dev->config->parent.name, dev->clock);
+	}
+	return sclock_timeval(dev->clock, &buf->timestamp);
+}
+
+static void _sv4l2_statistics(V4L2_t *dev, struct v4l2_buffer *buf, uint64_t timestamp)
+{
+	V4L2Stats_t *stats = &dev->stats;
+	if (buf->flags & V4L2_BUF_FLAG_ERROR)
+		stats->errors++;
+	if (V4L2_TYPE_IS_OUTPUT(buf->type))
+		return;
+	if (dev->timestamp != 0)
+	{
+		/// the sequence counts the frames of the sensor, even those without buffer
+		if (buf->sequence > dev->sequence)
+			stats->drops += buf->sequence - dev->sequence;
+		/// a repeated or backward sequence doesn't give the number of periods
+		if (dev->period > 0 && timestamp > dev->timestamp && buf->sequence >= dev->sequence)
+		{
+			uint64_t interval = timestamp - dev->timestamp;
+			/// the interval covers the dropped frames too
+			uint64_t expected = dev->period * (1 + buf->sequence - dev->sequence);
+			uint32_t jitter = ((interval > expected)? interval - expected: expected - interval) / 1000;
+			if (jitter > stats->maxjitter)
+				stats->maxjitter = jitter;
+			stats->jitter += jitter;
+			stats->intervals++;
+		}
+	}
+	dev->sequence = buf->sequence + 1;
+	dev->timestamp = timestamp;
+	stats->frames++;
+}
+
+uint64_t sv4l2_timestamp(V4L2_t *dev, int index)
+{
+	if (index < 0 || index >= dev->nbuffers)
+		return 0;
+	return dev->buffers[index].timestamp;
+}
+
+uint32_t sv4l2_sequence(V4L2_t *dev, int index)
+{
+	if (index < 0 || index >= dev->nbuffers)
+		return 0;
+	return dev->buffers[index].sequence;
+}
+
+int sv4l2_formats(V4L2_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg)
+{
+	int nformats = 0;
+	struct v4l2_fmtdesc fmtdesc = {0};
+	fmtdesc.type = dev->type;
+	for (fmtdesc.index = 0; _v4l2_enumformat(dev->fd, dev->cache, &fmtdesc) == 0; fmtdesc.index++)
+	{
+		if (!V4L2_TYPE_IS_OUTPUT(dev->type) &&
+			(fmtdesc.flags & V4L2_FMT_FLAG_COMPRESSED) && !dev->config->compressed)
+			continue;
+		DeviceFormat_t format = {0};
+		format.fourcc = fmtdesc.pixelformat;
+		struct v4l2_frmsizeenum frmsize = {0};
+		frmsize.pixel_format = fmtdesc.pixelformat;
+		for (frmsize.index = 0; _v4l2_enumframesize(dev->fd, dev->cache, &frmsize) == 0; frmsize.index++)
+		{
+			if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+			{
+				format.minwidth = format.maxwidth = frmsize.discrete.width;
+				format.minheight = format.maxheight = frmsize.discrete.height;
+				format.stepwidth = format.stepheight = 1;
+				cb(arg, &format);
+				continue;
+			}
+			format.minwidth = frmsize.stepwise.min_width;
+			format.maxwidth = frmsize.stepwise.max_width;
+			format.stepwidth = frmsize.stepwise.step_width;
+			format.minheight = frmsize.stepwise.min_height;
+			format.maxheight = frmsize.stepwise.max_height;
+			format.stepheight = frmsize.stepwise.step_height;
+			break;
+		}
+		/// without frame sizes enumeration, the queue follows the other side (m2m OUTPUT)
+		if (frmsize.index == 0 || frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			cb(arg, &format);
+		nformats++;
+	}
+	return nformats;
+}
+
+int sv4l2_setformat(V4L2_t *dev, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	if (dev->buffers != NULL)
+	{
+		err("sv4l2: %s format is locked by the buffers", dev->config->parent.name);
+		errno = EBUSY;
+		return -1;
+	}
+	dev->config->parent.fourcc = fourcc;
+	dev->config->parent.width = width;
+	dev->config->parent.height = height;
+	if (_v4l2_setformat(dev->fd, dev->cache, dev->type, dev->mode, dev->config) == -1)
+		return -1;
+	_v4l2_setinterval(dev->fd, dev->type, dev->config);
+	int nplanes = _v4l2_getformat(dev->fd, dev->type, dev->mode, dev->config);
+	if (nplanes < 0)
+		return -1;
+	if (dev->mode & MODE_MPLANE)
+		dev->nplanes = nplanes;
+	dev->period = _v4l2_getperiod(dev->fd, dev->type);
+	dbg("sv4l2: %s format %.4s %dx%d", dev->config->parent.name, (char*)&dev->config->parent.fourcc,
+		dev->config->parent.width, dev->config->parent.height);
+	_sv4l2_s3a_refresh(dev);
+	return 0;
+}
+
+int sv4l2_statistics(V4L2_t *dev, V4L2Stats_t *stats, int reset)
+{
+	if (stats)
+		memcpy(stats, &dev->stats, sizeof(*stats));
+	if (reset)
+		memset(&dev->stats, 0, sizeof(dev->stats));
+	return 0;
+}
+
+static int _sv4l2_renegotiate(V4L2_t *dev)
+{
+	enum v4l2_buf_type type = dev->type;
+	ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
+	if (dev->buffers)
+	{
+		struct v4l2_requestbuffers req = {0};
+		req.type = dev->type;
+		req.memory = dev->buffers[0].v4l2.memory;
+		req.count = 0;
+		_sv4l2_freebuffers(dev);
+		dev->buffers = NULL;
+		dev->nbuffers = 0;
+		if (ioctl(dev->fd, VIDIOC_REQBUFS, &req) == -1)
+		{
+			err("sv4l2: Release buffer for renegotiation error %m");
+			return -1;
+		}
+	}
+	int nplanes = _v4l2_getformat(dev->fd, dev->type, dev->mode, dev->config);
+	if (nplanes < 0)
+		return -1;
+	if (dev->mode & MODE_MPLANE)
+		dev->nplanes = nplanes;
+	warn("sv4l2: %s source changed to %dx%d %.4s", dev->config->parent.name,
+		dev->config->parent.width, dev->config->parent.height, (char*)&dev->config->parent.fourcc);
+	_sv4l2_s3a_refresh(dev);
+	return 0;
+}
+
+/**
+ * the source change is reported without renegotiation, the caller
+ * releases the buffers before.
+ */
+static int _sv4l2_dqevents(V4L2_t *dev)
+{
+	int ret = event_type_none;
+	struct v4l2_event event = {0};
+	while (ioctl(dev->fd, VIDIOC_DQEVENT, &event) == 0)
+	{
+		switch (event.type)
+		{
+		case V4L2_EVENT_EOS:
+			warn("sv4l2: %s end of stream", dev->config->parent.name);
+			ret |= event_type_eos;
+		break;
+		case V4L2_EVENT_SOURCE_CHANGE:
+			if (!(event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+				break;
+			ret |= event_type_sourcechange;
+		break;
+		case V4L2_EVENT_FRAME_SYNC:
+			dbg("sv4l2: %s frame sync %u", dev->config->parent.name, event.u.frame_sync.frame_sequence);
+			ret |= event_type_framesync;
+		break;
+		case V4L2_EVENT_CTRL:
+			dbg("sv4l2: %s control %#x => %lld", dev->config->parent.name, event.id, event.u.ctrl.value64);
+			ret |= event_type_control;
+		break;
+		}
+		if (event.pending == 0)
+			break;
+	}
+	return ret;
+}
+
+int sv4l2_event(V4L2_t *dev)
+{
+	int ret = _sv4l2_dqevents(dev);
+	if ((ret & event_type_sourcechange) && _sv4l2_renegotiate(dev) != 0)
+	{
+		ret &= ~event_type_sourcechange;
+		ret |= event_type_eos;
+	}
+	return ret;
+}
+
+/**
+ * the 3A loop reads the frame from the CPU, the exported buffers are mapped once
+ */
+static void _sv4l2_s3a(V4L2_t *dev, struct v4l2_buffer *buf)
+{
+	V4L2Buffer_t *buffer = &dev->buffers[buf->index];
+	size_t bytesused = buf->bytesused;
+	if (dev->mode & MODE_MPLANE)
+		bytesused = buf->m.planes[0].bytesused;
+	int dma_fd = -1;
+	if (buffer->v4l2.memory == V4L2_MEMORY_DMABUF)
+		dma_fd = buffer->ops.getdmafd(buffer);
+	if (buffer->map == NULL && dma_fd > 0)
+	{
+		size_t length = buffer->ops.getsize(buffer);
+		void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, dma_fd, 0);
+		if (map == MAP_FAILED)
+		{
+			err("sv4l2: 3A mapping error %m");
+			s3a_destroy(dev->s3a);
+			dev->s3a = NULL;
+			return;
+		}
+		buffer->map = map;
+		buffer->length = length;
+	}
+	struct dma_buf_sync sync = {0};
+	if (dma_fd > 0)
+	{
+		sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+		ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	}
+	s3a_process(dev->s3a, buffer->map, bytesused);
+	if (dma_fd > 0)
+	{
+		sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+		ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	}
+}
+
 int sv4l2_dequeue(V4L2_t *dev, void **mem, size_t *bytesused)
 {
 	int ret = 0;
@@ -1094,10 +2334,18 @@ int sv4l2_dequeue(V4L2_t *dev, void **mem, size_t *bytesused)
 	ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
 	if (ret)
 	{
-		err("sv4l2: %s dequeueing error %m", dev->config->parent.name);
+		/// with m2m, the readiness of the fd may concern the other queue
+		if (errno != EAGAIN)
+			err("sv4l2: %s dequeueing error %m", dev->config->parent.name);
 		dbg_buffer((&buf));
 		return -1;
 	}
+	uint64_t timestamp = _sv4l2_timestamp(dev, &buf);
+	dev->buffers[buf.index].timestamp = timestamp;
+	dev->buffers[buf.index].sequence = buf.sequence;
+	_sv4l2_statistics(dev, &buf, timestamp);
+	if (dev->s3a)
+		_sv4l2_s3a(dev, &buf);
 	if (!ret && bytesused)
 	{
 		*bytesused = buf.bytesused;
@@ -1111,10 +2359,85 @@ int sv4l2_dequeue(V4L2_t *dev, void **mem, size_t *bytesused)
 	return buf.index;
 }
 
+/**
+ * compare the metadata buffer to the image buffer.
+ * the nodes of a sensor share the frame counter, otherwise the timestamps
+ * of the same frame are nearer than half of the period.
+ */
+static int _sv4l2_metacompare(V4L2_t *dev, V4L2_t *meta)
+{
+	if (meta->sequence == dev->sequence)
+		return 0;
+	uint64_t tolerance = 1000000;
+	if (dev->period > 0)
+		tolerance = dev->period / 2;
+	if (meta->timestamp + tolerance < dev->timestamp)
+		return -1;
+	if (meta->timestamp > dev->timestamp + tolerance)
+		return 1;
+	return 0;
+}
+
+int sv4l2_dequeue_meta(V4L2_t *dev, void **mem, size_t *bytesused)
+{
+	V4L2_t *meta = dev->meta;
+	if (meta == NULL || dev->timestamp == 0)
+		return -1;
+	int retry = 1;
+	while (1)
+	{
+		int index = dev->metapending;
+		size_t size = dev->metabytesused;
+		dev->metapending = -1;
+		if (index < 0)
+			index = sv4l2_dequeue(meta, NULL, &size);
+		if (index < 0 && errno == EAGAIN && retry--)
+		{
+			/// the metadata may arrive just after the image
+			fd_set rfds;
+			FD_ZERO(&rfds);
+			FD_SET(meta->fd, &rfds);
+			struct timeval timeout = {
+				.tv_sec = 0,
+				.tv_usec = (dev->period > 0)? dev->period / 2000: 1000,
+			};
+			if (select(meta->fd + 1, &rfds, NULL, NULL, &timeout) > 0)
+				continue;
+		}
+		if (index < 0)
+		{
+			dbg("sv4l2: %s frame without metadata", dev->config->parent.name);
+			return -1;
+		}
+		int cmp = _sv4l2_metacompare(dev, meta);
+		if (cmp < 0)
+		{
+			/// the image of this metadata is lost
+			sv4l2_queue(meta, index, 0);
+			continue;
+		}
+		if (cmp > 0)
+		{
+			/// the metadata of the image is lost, keep this one for the next image
+			dev->metapending = index;
+			dev->metabytesused = size;
+			return -1;
+		}
+		if (mem)
+			*mem = meta->buffers[index].map;
+		if (bytesused)
+			*bytesused = size;
+		return index;
+	}
+	return -1;
+}
+
 int sv4l2_queue(V4L2_t *dev, int index, size_t bytesused)
 {
 	int ret = 0;
-	if (bytesused > 0)
+	if (bytesused > 0 && (dev->mode & MODE_MPLANE))
+		dev->buffers[index].v4l2.m.planes[0].bytesused = bytesused;
+	else if (bytesused > 0)
 		dev->buffers[index].v4l2.bytesused = bytesused;
 	ret = ioctl(dev->fd, VIDIOC_QBUF, &dev->buffers[index].v4l2);
 	if (ret)
@@ -1125,6 +2448,162 @@ int sv4l2_queue(V4L2_t *dev, int index, size_t bytesused)
 	return ret;
 }
 
+typedef struct V4L2Job_s V4L2Job_t;
+struct V4L2Job_s
+{
+	int index;
+	void *mem;
+	size_t bytesused;
+	uint32_t order;
+};
+
+typedef struct V4L2Pool_s V4L2Pool_t;
+struct V4L2Pool_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	int (*transfer)(void *, int id, const char *mem, size_t size);
+	void *transferarg;
+	V4L2Job_t *jobs;
+	int size;
+	int head;
+	int njobs;
+	int pending;
+	uint32_t order;
+	uint32_t nextorder;
+	int ordered;
+	int run;
+	int done[2];
+};
+
+static void *_sv4l2_worker(void *arg)
+{
+	V4L2Pool_t *pool = (V4L2Pool_t *)arg;
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->run)
+	{
+		if (pool->njobs == 0)
+		{
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+			continue;
+		}
+		V4L2Job_t job = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % pool->size;
+		pool->njobs--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->transfer(pool->transferarg, job.index, job.mem, job.bytesused);
+
+		pthread_mutex_lock(&pool->mutex);
+		/// the buffers go back to the device in the capture order
+		while (pool->ordered && pool->run && job.order != pool->nextorder)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		pool->nextorder++;
+		pool->pending--;
+		if (write(pool->done[1], &job.index, sizeof(job.index)) != sizeof(job.index))
+			err("sv4l2: worker release error %m");
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static V4L2Pool_t *_sv4l2_pool_create(V4L2_t *dev, int nthreads, int ordered,
+		int (*transfer)(void *, int id, const char *mem, size_t size), void *transferarg)
+{
+	V4L2Pool_t *pool = calloc(1, sizeof(*pool));
+	if (pipe(pool->done))
+	{
+		err("sv4l2: workers pool error %m");
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->transfer = transfer;
+	pool->transferarg = transferarg;
+	pool->ordered = ordered;
+	/// the device can't give more jobs than its number of buffers
+	pool->size = dev->nbuffers;
+	pool->jobs = calloc(pool->size, sizeof(*pool->jobs));
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	pool->run = 1;
+	for (int i = 0; i < nthreads; i++)
+	{
+		if (pthread_create(&pool->threads[i], NULL, _sv4l2_worker, pool))
+		{
+			err("sv4l2: worker %d creation error %m", i);
+			break;
+		}
+		pool->nthreads++;
+	}
+	dbg("sv4l2: %d workers ready", pool->nthreads);
+	return pool;
+}
+
+static int _sv4l2_pool_push(V4L2Pool_t *pool, int index, void *mem, size_t bytesused)
+{
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->njobs == pool->size)
+	{
+		pthread_mutex_unlock(&pool->mutex);
+		return -1;
+	}
+	V4L2Job_t *job = &pool->jobs[(pool->head + pool->njobs) % pool->size];
+	job->index = index;
+	job->mem = mem;
+	job->bytesused = bytesused;
+	job->order = pool->order++;
+	pool->njobs++;
+	pool->pending++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+/**
+ * wait the end of the jobs before the release of the buffers,
+ * the indexes are obsolete after a renegotiation.
+ */
+static int _sv4l2_pool_wait(V4L2Pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(pool->done[0], &rfds);
+	struct timeval timeout = {0};
+	while (select(pool->done[0] + 1, &rfds, NULL, NULL, &timeout) > 0)
+	{
+		int index;
+		if (read(pool->done[0], &index, sizeof(index)) != sizeof(index))
+			break;
+		FD_SET(pool->done[0], &rfds);
+	}
+	return 0;
+}
+
+static void _sv4l2_pool_destroy(V4L2Pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->run = 0;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	close(pool->done[0]);
+	close(pool->done[1]);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool);
+}
+
 int sv4l2_loop(V4L2_t *dev, int (*transfer)(void *, int id, const char *mem, size_t size), void *transferarg)
 {
 	if (transfer == NULL)
@@ -1135,12 +2614,19 @@ int sv4l2_loop(V4L2_t *dev, int (*transfer)(void *, int id, const char *mem, siz
 		return -1;
 	}
 	int run = 1;
+	enum v4l2_memory memory = dev->buffers[0].v4l2.memory;
+	V4L2Pool_t *pool = NULL;
+	if (dev->config->nworkers > 1)
+		pool = _sv4l2_pool_create(dev, dev->config->nworkers, dev->config->ordered, transfer, transferarg);
 	sv4l2_start(dev);
 	while (run)
 	{
 		fd_set rfds;
+		fd_set efds;
 		FD_ZERO(&rfds);
+		FD_ZERO(&efds);
 		FD_SET(dev->fd, &rfds);
+		FD_SET(dev->fd, &efds);
 		struct timeval timeout = {
 			.tv_sec = 2,
 			.tv_usec = 0,
@@ -1152,12 +2638,56 @@ int sv4l2_loop(V4L2_t *dev, int (*transfer)(void *, int id, const char *mem, siz
 			FD_SET(dev->ifd[0], &rfds);
 			maxfd = (maxfd > dev->ifd[0])? maxfd:dev->ifd[0];
 		}
+		if (pool)
+		{
+			FD_SET(pool->done[0], &rfds);
+			maxfd = (maxfd > pool->done[0])? maxfd:pool->done[0];
+		}
 
-		ret = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
+		ret = select(maxfd + 1, &rfds, NULL, &efds, &timeout);
 		if (ret == -1 && errno == EINTR)
 			continue;
 		if (ret == 0)
 			warn("frame timeout");
+		if (ret > 0 && FD_ISSET(dev->fd, &efds))
+		{
+			/// the control and frame sync events keep the buffers into the workers
+			int event = _sv4l2_dqevents(dev);
+			if (event & event_type_eos)
+			{
+				run = 0;
+				break;
+			}
+			if (event & event_type_sourcechange)
+			{
+				/// the workers must release the buffers before the renegotiation
+				if (pool)
+					_sv4l2_pool_wait(pool);
+				if (_sv4l2_renegotiate(dev))
+				{
+					run = 0;
+					break;
+				}
+				if (memory == V4L2_MEMORY_MMAP)
+					ret = sv4l2_requestbuffer_mmap(dev);
+				else
+					ret = sv4l2_requestbuffer_dmabuf(dev);
+				if (ret || sv4l2_start(dev))
+				{
+					err("sv4l2: renegotiation error %m");
+					run = 0;
+					break;
+				}
+				/// the jobs ring follows the new number of buffers
+				if (pool)
+				{
+					_sv4l2_pool_destroy(pool);
+					pool = _sv4l2_pool_create(dev, dev->config->nworkers, dev->config->ordered, transfer, transferarg);
+				}
+				continue;
+			}
+			ret--;
+		}
 		if (ret > 0 && FD_ISSET(dev->fd, &rfds))
 		{
 			int index = 0;
@@ -1172,8 +2702,39 @@ int sv4l2_loop(V4L2_t *dev, int (*transfer)(void *, int id, const char *mem, siz
 				break;
 			}
 
-			transfer(transferarg, index, mem, bytesused);
-			if (sv4l2_queue(dev, index, 0) < 0)
+			if (dev->meta && dev->config->metadata)
+			{
+				void *meta = NULL;
+				size_t metasize = 0;
+				int metaindex = sv4l2_dequeue_meta(dev, &meta, &metasize);
+				if (metaindex >= 0)
+				{
+					dev->config->metadata(transferarg, index, meta, metasize);
+					sv4l2_queue(dev->meta, metaindex, 0);
+				}
+			}
+
+			if (pool && _sv4l2_pool_push(pool, index, mem, bytesused) == 0)
+			{
+				ret--;
+			}
+			else
+			{
+				transfer(transferarg, index, mem, bytesused);
+				if (sv4l2_queue(dev, index, 0) < 0)
+				{
+					run = 0;
+					err("sv4l2: queuing error %m");
+					break;
+				}
+				ret--;
+			}
+		}
+		if (ret > 0 && pool && FD_ISSET(pool->done[0], &rfds))
+		{
+			int index;
+			if (read(pool->done[0], &index, sizeof(index)) == sizeof(index) &&
+				sv4l2_queue(dev, index, 0) < 0)
 			{
 				run = 0;
 				err("sv4l2: queuing error %m");
@@ -1204,6 +2765,8 @@ int sv4l2_loop(V4L2_t *dev, int (*transfer)(void *, int id, const char *mem, siz
 		}
 #endif
 	}
+	if (pool)
+		_sv4l2_pool_destroy(pool);
 	sv4l2_stop(dev);
 	return 0;
 }
@@ -1315,14 +2878,40 @@ int sv4l2_transfer(V4L2_t *dev, V4L2_t *link)
 	return 0;
 }
 
-void sv4l2_destroy(V4L2_t *dev)
+static void _sv4l2_freebuffers(V4L2_t *dev)
 {
 	for (int i = 0; i < dev->nbuffers; i++)
 	{
-		if (dev->buffers[i].map)
+		/// the user memory belongs to the caller or to the arena
+		if (dev->buffers[i].map && dev->buffers[i].v4l2.memory != V4L2_MEMORY_USERPTR)
 			munmap(dev->buffers[i].map, dev->buffers[i].length);
 	}
 	free(dev->buffers);
+	_sv4l2_arena_free(&dev->arena);
+}
+
+void sv4l2_destroy(V4L2_t *dev)
+{
+	if (dev->m2m)
+	{
+		/// the OUTPUT queue shares the file descriptor and owns its configuration
+		_sv4l2_freebuffers(dev->m2m);
+		_v4l2_cache_destroy(dev->m2m->cache);
+		free(dev->m2m->config);
+		free(dev->m2m);
+	}
+	if (dev->meta)
+	{
+		_sv4l2_freebuffers(dev->meta);
+		_v4l2_cache_destroy(dev->meta->cache);
+		close(dev->meta->fd);
+		free(dev->meta->config);
+		free(dev->meta);
+	}
+	if (dev->s3a)
+		s3a_destroy(dev->s3a);
+	_sv4l2_freebuffers(dev);
+	_v4l2_cache_destroy(dev->cache);
 	close(dev->fd);
 	free(dev);
 }
@@ -1606,10 +3195,10 @@ int sv4l2_loadjsonsettings(V4L2_t *dev, void *entry)
 	if (crop && json_is_object(crop))
 	{
 		int disable = 0;
-		json_t *top = json_object_get(jconfig, "top");
-		json_t *left = json_object_get(jconfig, "left");
-		json_t *width = json_object_get(jconfig, "width");
-		json_t *height = json_object_get(jconfig, "height");
+		json_t *top = json_object_get(crop, "top");
+		json_t *left = json_object_get(crop, "left");
+		json_t *width = json_object_get(crop, "width");
+		json_t *height = json_object_get(crop, "height");
 		struct v4l2_rect r = {0};
 		if (top && json_is_integer(top))
 			r.top = json_integer_value(top);
@@ -1624,12 +3213,12 @@ int sv4l2_loadjsonsettings(V4L2_t *dev, void *entry)
 		else
 			disable = 1;
 		if (disable)
-			sv4l2_crop(dev, NULL);
+			sv4l2_roi(dev, NULL);
 		else
-			sv4l2_crop(dev, &r);
+			sv4l2_roi(dev, &r);
 	}
 	if (crop && json_is_boolean(crop) && !json_is_true(crop))
-		sv4l2_crop(dev, NULL);
+		sv4l2_roi(dev, NULL);
 
 	json_t *jcontrols = json_object_get(jconfig,"controls");
 	if (jcontrols && (json_is_array(jcontrols) || json_is_object(jcontrols)))
@@ -1817,6 +3406,22 @@ int sv4l2_loadjsonconfiguration(void *arg, void *entry)
 		int value = json_integer_value(fps);
 		config->fps = value;
 	}
+	else if (fps && json_is_real(fps) && json_real_value(fps) > 0)
+	{
+		/// 29.97 is rounded to the nearest interval of the device
+		config->interval.numerator = 1000;
+		config->interval.denominator = json_real_value(fps) * 1000 + 0.5;
+	}
+	else if (fps && json_is_string(fps))
+	{
+		/// "30000/1001" frames per second
+		unsigned int numerator = 0, denominator = 1;
+		if (sscanf(json_string_value(fps), "%u/%u", &numerator, &denominator) > 0 && numerator > 0)
+		{
+			config->interval.numerator = denominator;
+			config->interval.denominator = numerator;
+		}
+	}
 	if (mode && json_is_string(mode))
 	{
 		const char *value = json_string_value(mode);
@@ -1830,6 +3435,38 @@ int sv4l2_loadjsonconfiguration(void *arg, void *entry)
 	{
 		config->mode |= MODE_INTERACTIVE;
 	}
+	json_t *workers = json_object_get(jconfig, "workers");
+	if (workers && json_is_integer(workers))
+	{
+		config->nworkers = json_integer_value(workers);
+	}
+	json_t *nbuffers = json_object_get(jconfig, "buffers");
+	if (nbuffers && json_is_integer(nbuffers))
+	{
+		config->nbuffers = json_integer_value(nbuffers);
+	}
+	json_t *ordered = json_object_get(jconfig, "ordered");
+	if (ordered && json_is_boolean(ordered))
+	{
+		config->ordered = json_is_true(ordered);
+	}
+	json_t *metadevice = json_object_get(jconfig, "metadevice");
+	if (metadevice && json_is_string(metadevice))
+	{
+		config->metadevice = json_string_value(metadevice);
+	}
+	json_t *s3a = json_object_get(jconfig, "3a");
+	if (s3a && json_is_object(s3a))
+	{
+		config->s3a = calloc(1, sizeof(*config->s3a));
+		config->s3a->mode = S3A_AE | S3A_AWB;
+		s3a_loadjsonconfiguration(config->s3a, s3a);
+	}
+	json_t *cache = json_object_get(jconfig, "cache");
+	if (cache && json_is_string(cache))
+	{
+		config->cachepath = json_string_value(cache);
+	}
 	json_t *library = json_object_get(jconfig, "library");
 	if (library && json_is_string(library))
 	{
@@ -2124,7 +3761,7 @@ static int _v4l2_capabilities_imageformat(V4L2_t *dev, json_t *definition)
 	json_t *items = json_array();
 	struct v4l2_fmtdesc fmtdesc = {0};
 	fmtdesc.type = sv4l2_type(dev);
-	while (ioctl(sv4l2_fd(dev), VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+	while (_v4l2_enumformat(sv4l2_fd(dev), dev->cache, &fmtdesc) == 0)
 	{
 		json_array_append_new(items, json_stringn((char*)&fmtdesc.pixelformat, 4));
 		fmtdesc.index++;
@@ -2151,7 +3788,7 @@ static int _v4l2_capabilities_imageformat(V4L2_t *dev, json_t *definition)
 	struct v4l2_frmsizeenum video_cap = {0};
 	video_cap.pixel_format = fmt.fmt.pix.pixelformat;
 	video_cap.type = V4L2_FRMSIZE_TYPE_STEPWISE;
-	if(ioctl(sv4l2_fd(dev), VIDIOC_ENUM_FRAMESIZES, &video_cap) == 0)
+	if (_v4l2_enumframesize(sv4l2_fd(dev), dev->cache, &video_cap) == 0)
 	{
 		json_object_set(width, "minimum", json_integer(video_cap.stepwise.min_width));
 		json_object_set(width, "maximum", json_integer(video_cap.stepwise.max_width));
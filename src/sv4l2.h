@@ -24,7 +24,28 @@
  * @param width the width of the image.
  * @param height the height of the image.
  * @param fps the number of frames per second, positive value for more than 1 fps,
- * negative value if one frame in more than 1 second
+ * negative value if one frame in more than 1 second, 0 keeps the rate of the driver.
+ * @param interval the requested time per frame, as 1001/30000.
+ * @param timeperframe the time per frame of the driver, the nearest to the
+ * request, set by the creation and sv4l2_setformat.
+ * @param input the configuration of the upstream device, used by the OUTPUT
+ * queue of a memory to memory device.
+ * @param nworkers the number of threads calling transfer inside sv4l2_loop,
+ * 0 or 1 calls transfer directly from the loop.
+ * @param ordered the buffers are given back to the device in the capture
+ * order when nworkers is more than 1.
+ * @param cachepath the directory to store the enumerations of the device,
+ * the next creation reads the file in place of the ioctl calls.
+ * @param metadevice the path of the metadata node of the sensor
+ * (embedded data), captured with the image stream.
+ * @param metadata the callback receiving the metadata of a frame
+ * inside sv4l2_loop, just before the transfer of the image with the same id.
+ * @param s3a the configuration of the software auto exposure and white
+ * balance, computed on the dequeued frames (cf s3a.h).
+ * @param nbuffers the number of buffers to request, 0 for the default.
+ * The driver may allocate more.
+ * @param compressed the sink accepts the compressed formats (MJPG, JPEG),
+ * otherwise the CAPTURE queue neither chooses nor reports them.
  */
 typedef struct CameraConfig_s CameraConfig_t;
 struct CameraConfig_s
@@ -36,10 +57,43 @@ struct CameraConfig_s
 	int fd;
 	int mode;
 	int fps;
+	struct v4l2_fract interval;
+	struct v4l2_fract timeperframe;
+	DeviceConf_t *input;
+	int nworkers;
+	int ordered;
+	const char *cachepath;
+	const char *metadevice;
+	int (*metadata)(void *, int id, const char *mem, size_t size);
+	struct S3AConfig_s *s3a;
+	int nbuffers;
+	int compressed;
 };
 
 typedef struct V4L2_s V4L2_t;
 
+/**
+ * @brief statistics of the stream.
+ *
+ * @param frames the number of dequeued buffers.
+ * @param drops the number of frames lost by the driver (sequence gaps).
+ * @param errors the number of buffers flagged as corrupted by the driver.
+ * @param jitter the sum of the deviations of the frame intervals in us,
+ * compared to the nominal period of the device.
+ * @param intervals the number of intervals in jitter.
+ * @param maxjitter the maximum deviation of the frame interval in us.
+ */
+typedef struct V4L2Stats_s V4L2Stats_t;
+struct V4L2Stats_s
+{
+	uint32_t frames;
+	uint32_t drops;
+	uint32_t errors;
+	uint64_t jitter;
+	uint32_t intervals;
+	uint32_t maxjitter;
+};
+
 /**
  * @brief create v4l2 device
  * The pointer must be passed to each other functions of the API.
@@ -53,6 +107,35 @@ typedef struct V4L2_s V4L2_t;
  * @return V4L2_t object.
  */
 V4L2_t *sv4l2_create(const char *devicename, CameraConfig_t *config);
+/**
+ * @brief create memory to memory v4l2 device (scaler, ISP, codec...)
+ * The returned object drives the CAPTURE queue with the config definition.
+ * The OUTPUT queue is a second object sharing the same file descriptor,
+ * it receives the frames with the definition of config->input.
+ *
+ * @param devicename it must be a name to different of other v4l2 device,
+ * it may be the device path if this one is not defined into config.
+ * @param config a pointer to the configuration cf struct CameraConfig_s.
+ *
+ * @return V4L2_t object of the CAPTURE queue.
+ */
+V4L2_t *sv4l2_m2m_create(const char *devicename, CameraConfig_t *config);
+/**
+ * @brief get the OUTPUT queue of a memory to memory device.
+ *
+ * @param dev the V4L2_t object returned by sv4l2_m2m_create.
+ *
+ * @return V4L2_t object of the OUTPUT queue or NULL.
+ */
+V4L2_t *sv4l2_m2m_output(V4L2_t *dev);
+/**
+ * @brief get the metadata node paired with the image node.
+ *
+ * @param dev the V4L2_t object created with config->metadevice.
+ *
+ * @return V4L2_t object of the metadata node or NULL.
+ */
+V4L2_t *sv4l2_meta(V4L2_t *dev);
 /**
  * @brief select and create a type of buffers.
  *
@@ -66,6 +149,8 @@ int sv4l2_requestbuffer(V4L2_t *dev, enum buf_type_e t, ...);
 
 /**
  * @brief simple function to transfer data using a callback.
+ * With config->nworkers, the callback runs on a pool of threads and
+ * the buffer is queued again into the device when the callback returns.
  *
  * @param dev the V4L2_t object.
  * @param transfer the callback.
@@ -93,6 +178,15 @@ int sv4l2_transfer(V4L2_t *dev, V4L2_t *link);
  * @return fd.
  */
 int sv4l2_fd(V4L2_t *dev);
+/**
+ * @brief get the configuration of the queue.
+ * The OUTPUT queue of a m2m device owns a copy of the configuration.
+ *
+ * @param dev the V4L2_t object.
+ *
+ * @return the configuration.
+ */
+DeviceConf_t *sv4l2_config(V4L2_t *dev);
 /**
  * @brief get the true type of the buffers.
  *
@@ -127,6 +221,31 @@ int sv4l2_stop(V4L2_t *dev);
  * @return the buffer index on success, otherwise -1.
  */
 int sv4l2_dequeue(V4L2_t *dev, void **mem, size_t *bytesused);
+/**
+ * @brief get the metadata of the last dequeued image.
+ * The metadata buffer is selected with the sequence number or the timestamp
+ * of the image, the older buffers are given back to the device.
+ * The buffer must be queued again with sv4l2_queue(sv4l2_meta(dev), index, 0).
+ *
+ * @param dev the V4L2_t object of the image node.
+ * @param mem the pointer to the memory containing the metadata.
+ * @param bytesused the size of metadata.
+ *
+ * @return the metadata buffer index on success, otherwise -1.
+ */
+int sv4l2_dequeue_meta(V4L2_t *dev, void **mem, size_t *bytesused);
+/**
+ * @brief read the pending events of the device.
+ * It must be called when the file descriptor is in exception state (POLLPRI).
+ * On source change, the stream is stopped, the buffers are released and
+ * the configuration is updated. The buffers have to be requested again
+ * before restarting.
+ *
+ * @param dev the V4L2_t object.
+ *
+ * @return a bits field of enum event_type_e.
+ */
+int sv4l2_event(V4L2_t *dev);
 /**
  * @brief request to push a buffer into device.
  *
@@ -137,6 +256,63 @@ int sv4l2_dequeue(V4L2_t *dev, void **mem, size_t *bytesused);
  * @return -1 on error, 0 otherwise.
  */
 int sv4l2_queue(V4L2_t *dev, int index, size_t bytesused);
+/**
+ * @brief get the statistics of the stream.
+ * The mean jitter is stats->jitter / stats->intervals.
+ *
+ * @param dev the V4L2_t object.
+ * @param stats the structure to fill, it may be NULL.
+ * @param reset reset the counters after the copy.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sv4l2_statistics(V4L2_t *dev, V4L2Stats_t *stats, int reset);
+/**
+ * @brief get the time of the last dequeuing of a buffer.
+ * For a capture queue it is the timestamp of the frame, for an output
+ * queue it is the time of the release. The time is in the clock domain
+ * of the pipeline (cf sclock.h).
+ *
+ * @param dev the V4L2_t object.
+ * @param index the index of the buffer.
+ *
+ * @return the time in ns, 0 if unknown.
+ */
+uint64_t sv4l2_timestamp(V4L2_t *dev, int index);
+/**
+ * @brief get the sequence number of the last dequeued frame of a buffer.
+ * The driver counts the frames of the sensor, the gaps are the drops.
+ *
+ * @param dev the V4L2_t object.
+ * @param index the index of the buffer.
+ *
+ * @return the sequence number of the driver.
+ */
+uint32_t sv4l2_sequence(V4L2_t *dev, int index);
+/**
+ * @brief enumerate the formats and the frame sizes of the queue.
+ * it calls the cb function for each format and each discrete size,
+ * a stepwise size is reported once with its range.
+ *
+ * @param dev the V4L2_t object.
+ * @param cb the called function.
+ * @param arg the first argument of cb.
+ *
+ * @return the number of formats.
+ */
+int sv4l2_formats(V4L2_t *dev, int (*cb)(void *arg, DeviceFormat_t *format), void *arg);
+/**
+ * @brief change the format of the queue before the buffers request.
+ * The configuration is updated with the values accepted by the driver.
+ *
+ * @param dev the V4L2_t object.
+ * @param fourcc the pixel format.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sv4l2_setformat(V4L2_t *dev, uint32_t fourcc, uint32_t width, uint32_t height);
 /**
  * @brief set a rectaongle inseide the image to treat.
  *
@@ -147,6 +323,19 @@ int sv4l2_queue(V4L2_t *dev, int index, size_t bytesused);
  * @return -1 on error, 0 otherwise.
  */
 int sv4l2_crop(V4L2_t *dev, struct v4l2_rect *r);
+/**
+ * @brief move the region of interest of the sensor, during the streaming.
+ * The rectangle is aligned and clamped inside the crop bounds, and the
+ * format of the buffers is never changed: the scaler of the sensor must
+ * accept the new size. The "crop" object of the interactive settings uses it.
+ *
+ * @param dev the V4L2_t object.
+ * @param r the rectangle into the sensor coordinates, it is updated with the
+ * applied rectangle. NULL restores the full sensor.
+ *
+ * @return -1 on error, 0 otherwise.
+ */
+int sv4l2_roi(V4L2_t *dev, struct v4l2_rect *r);
 /**
  * @brief get/set device control
  *